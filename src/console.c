@@ -1,7 +1,9 @@
 
 #include "console.h"
 #include "syscalls.h"
+#include "systrace.h"
 #include "vicky3.h"
+#include "perf.h"
 
 
 static int16_t _columns_visible;
@@ -13,6 +15,7 @@ static int16_t _cursor_y;
 static uint8_t _current_color;
 static volatile char * _text_cursor_ptr;
 static volatile char * _color_cursor_ptr;
+static uint8_t _unread_key = 0;
 
 
 
@@ -125,7 +128,7 @@ void con_set_border(bool visible, int16_t width, int16_t height, uint32_t color)
 
 void con_set_cursor(int16_t color, uint8_t character, int16_t rate, bool enable)
 {
-    *CURSOR_SETTINGS_REG_A = ((color & 0xff) << 24) | (character << 16) | ((rate & 0x02) << 1) | (enable ? 0x01 : 0x00);
+    *CURSOR_SETTINGS_REG_A = ((uint32_t)(color & 0xff) << 24) | ((uint32_t)character << 16) | ((rate & 0x02) << 1) | (enable ? 0x01 : 0x00);
 }
 
 void con_clear_screen(void)
@@ -135,6 +138,8 @@ void con_clear_screen(void)
         SCREEN_TEXT_A[i] = ' ';
         COLOR_TEXT_A[i] = _current_color;
     }
+
+    PERF_ADD(PERF_VRAM_BYTES, 2 * 0x2000);
 }
 
 void con_clear_line(void)
@@ -147,10 +152,14 @@ void con_clear_line(void)
         SCREEN_TEXT_A[i] = ' ';
         COLOR_TEXT_A[i] = _current_color;
     }
+
+    PERF_ADD(PERF_VRAM_BYTES, 2 * _columns_max);
 }
 
 void con_set_xy(uint16_t x, uint16_t y)
 {
+    PERF_COUNT(PERF_SET_XY);
+
     if (x >= _columns_visible)
     {
         x = 0;
@@ -195,11 +204,13 @@ void con_out(uint8_t ch)
             con_set_xy(_cursor_x - 1, _cursor_y);
             *_text_cursor_ptr = ' ';
             *_color_cursor_ptr = _current_color;
+            PERF_ADD(PERF_VRAM_BYTES, 2);
             break;
 
         default:
             *_text_cursor_ptr++ = ch;
             *_color_cursor_ptr++ = _current_color;
+            PERF_ADD(PERF_VRAM_BYTES, 2);
             con_set_xy(_cursor_x + 1, _cursor_y);
             break;
     }
@@ -209,6 +220,7 @@ void con_out_raw(uint8_t ch)
 {
     *_text_cursor_ptr++ = ch;
     *_color_cursor_ptr++ = _current_color;
+    PERF_ADD(PERF_VRAM_BYTES, 2);
 }
 
 void con_newline(void)
@@ -223,9 +235,24 @@ void con_write(uint8_t * buffer, uint16_t size)
 }
 
 
+bool con_key_ready(void)
+{
+    return _unread_key != 0 || (sys_chan_status(0) & CDEV_STAT_READABLE) != 0;
+}
+
+// The key is returned again by the next con_get_key(). Only one is kept.
+void con_unget_key(uint8_t key)
+{
+    _unread_key = key;
+}
+
 uint8_t con_get_key(void)
 {
-    int16_t key = 0;
+    int16_t key = _unread_key;
+
+    _unread_key = 0;
+    if (key != 0)
+        return (uint8_t)key;
 
     while (key == 0)
     {
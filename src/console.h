@@ -49,8 +49,20 @@
 #define CON_KEY_F10             0xB9
 #define CON_KEY_F11             0xBA
 #define CON_KEY_F12             0xBB
+#define CON_KEY_CTRL_C          0x03
+#define CON_KEY_CTRL_D          0x04
+#define CON_KEY_CTRL_E          0x05
+#define CON_KEY_CTRL_F          0x06
+#define CON_KEY_CTRL_G          0x07
+#define CON_KEY_CTRL_K          0x0B
+#define CON_KEY_CTRL_O          0x0F
 #define CON_KEY_CTRL_Q          0x11
+#define CON_KEY_CTRL_R          0x12
 #define CON_KEY_CTRL_S          0x13
+#define CON_KEY_CTRL_T          0x14
+#define CON_KEY_CTRL_V          0x16
+#define CON_KEY_CTRL_Y          0x19
+#define CON_KEY_CTRL_Z          0x1A
 
 #define CON_CHAR_ESC            '\x1B'  /* Escape character */
 #define CON_CHAR_TAB            '\t'    /* Vertical tab */
@@ -77,5 +89,7 @@ void con_newline(void);
 void con_write(uint8_t * buffer, uint16_t size);
 
 uint8_t con_get_key(void);
+bool con_key_ready(void);
+void con_unget_key(uint8_t key);
 
 #endif
\ No newline at end of file
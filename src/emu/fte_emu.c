@@ -0,0 +1,571 @@
+/*
+ * Runs fte.bin on an emulated 68000 and counts the cycles it spends.
+ *
+ * The raw image is loaded at 0x20000 as run.bat uploads it, and started the
+ * way the kernel starts a program. The CPU is the Musashi core, which `make
+ * musashi` clones into emu/Musashi at the commit in emu/musashi.rev, or the
+ * checkout make is pointed at with MUSASHI. The `trap #15` kernel calls
+ * from foenix/syscalls.h are handled here, files on the workstation stand in
+ * for the SD card, and the VICKY registers and text planes are plain memory
+ * that costs extra cycles for every byte, as it sits on a byte wide bus.
+ *
+ *     fte_emu [-m mapfile] [-w wait] [-k] [-s budget] fte.bin < keys
+ *
+ * Keys are the raw bytes the keyboard channel would deliver, read from the
+ * file named by FTE_KEYS or from standard input. Once they run out the
+ * cycles spent on every key (with -k) and in every function are written to
+ * standard output. Functions are found in the map vlink writes with
+ * -Mmapfile, static functions included, leaving out the numbered labels
+ * vbcc gives its branches and static data.
+ *
+ * The deepest the stack pointer went is reported too. With -s, a run that
+ * used more than budget bytes of stack exits with status 3.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "m68k.h"
+
+// The numbers of the kernel calls, from foenix/syscalls.h
+#define syscall mcp_syscall
+#include "syscalls.h"
+#undef syscall
+
+
+#define EMU_RAM_SIZE        0x400000    // 4 Mb of system RAM, as reported to the program
+#define EMU_LOAD_ADDRESS    0x20000
+#define EMU_STACK_TOP       0x80000     // RAMSTART + RAMSIZE in vlink_ram.cmd
+#define EMU_CLOCK_HZ        20000000    // A2560U
+#define EMU_JIFFY_CYCLES    (EMU_CLOCK_HZ / 60)
+
+// Exception handlers the emulator catches when the CPU fetches them
+#define EMU_TRAP_HANDLER    0x400
+#define EMU_FAULT_HANDLER   0x402
+#define EMU_TRAP_VECTOR     (32 + 15)
+
+// VICKY III on the A2560U, as in the kernel's headers
+#define EMU_VICKY_REGS      0xB40000
+#define EMU_VICKY_REGS_END  0xB40100
+#define EMU_VICKY_TEXT      0xB60000
+#define EMU_VICKY_END       0xB70000
+
+#define EMU_MAX_SYMBOLS     4096
+#define EMU_MAX_FILES       16
+
+
+typedef struct symbol_t {
+    uint32_t address;
+    char name[48];
+    uint64_t cycles;
+} symbol_t;
+
+
+static uint8_t _ram[EMU_RAM_SIZE];
+static uint8_t _vicky_regs[EMU_VICKY_REGS_END - EMU_VICKY_REGS];
+static uint8_t _vicky_text[EMU_VICKY_END - EMU_VICKY_TEXT];
+
+static symbol_t _symbols[EMU_MAX_SYMBOLS];
+static int _symbol_count = 0;
+
+static uint64_t _cycles = 0;                // since reset
+static uint32_t _wait_cycles = 0;           // added by the instruction running now
+static uint32_t _vram_wait = 4;             // per byte of VICKY memory accessed
+static int _files[EMU_MAX_FILES];           // channel numbers given out for host files
+
+static uint8_t *_keys = 0;
+static size_t _key_count = 0;
+static size_t _key_pos = 0;
+static uint64_t _key_start = 0;
+static bool _key_report = false;
+
+static uint32_t _stack_low = EMU_STACK_TOP;    // lowest the stack pointer went
+static uint32_t _stack_budget = 0;             // bytes, 0 for none
+
+
+/** Memory **/
+
+static uint8_t *emu_memory(uint32_t address)
+{
+    address &= 0xFFFFFF;
+
+    if (address < EMU_RAM_SIZE)
+        return &_ram[address];
+
+    if (address >= EMU_VICKY_TEXT && address < EMU_VICKY_END)
+    {
+        _wait_cycles += _vram_wait;
+        return &_vicky_text[address - EMU_VICKY_TEXT];
+    }
+
+    if (address >= EMU_VICKY_REGS && address < EMU_VICKY_REGS_END)
+    {
+        _wait_cycles += _vram_wait;
+        return &_vicky_regs[address - EMU_VICKY_REGS];
+    }
+
+    return 0;
+}
+
+unsigned int m68k_read_memory_8(unsigned int address)
+{
+    uint8_t *it = emu_memory(address);
+    return it != 0 ? it[0] : 0xFF;
+}
+
+unsigned int m68k_read_memory_16(unsigned int address)
+{
+    return (m68k_read_memory_8(address) << 8) | m68k_read_memory_8(address + 1);
+}
+
+unsigned int m68k_read_memory_32(unsigned int address)
+{
+    return (m68k_read_memory_16(address) << 16) | m68k_read_memory_16(address + 2);
+}
+
+void m68k_write_memory_8(unsigned int address, unsigned int value)
+{
+    uint8_t *it = emu_memory(address);
+    if (it != 0)
+        it[0] = value;
+}
+
+void m68k_write_memory_16(unsigned int address, unsigned int value)
+{
+    m68k_write_memory_8(address, value >> 8);
+    m68k_write_memory_8(address + 1, value);
+}
+
+void m68k_write_memory_32(unsigned int address, unsigned int value)
+{
+    m68k_write_memory_16(address, value >> 16);
+    m68k_write_memory_16(address + 2, value);
+}
+
+unsigned int m68k_read_disassembler_16(unsigned int address)
+{
+    return m68k_read_memory_16(address);
+}
+
+unsigned int m68k_read_disassembler_32(unsigned int address)
+{
+    return m68k_read_memory_32(address);
+}
+
+// Copies a string out of emulated memory
+static const char *emu_string(uint32_t address, char *buffer, size_t size)
+{
+    size_t i = 0;
+
+    for (; i + 1 < size && m68k_read_memory_8(address + i) != 0; ++i)
+        buffer[i] = m68k_read_memory_8(address + i);
+
+    buffer[i] = 0;
+    return buffer;
+}
+
+
+/** Symbols **/
+
+static int emu_symbol_compare(const void *a, const void *b)
+{
+    uint32_t x = ((const symbol_t *)a)->address;
+    uint32_t y = ((const symbol_t *)b)->address;
+    return x < y ? -1 : x > y;
+}
+
+// Reads the symbols of a vlink map. They are listed as
+// "  0x00020000 _main: global reloc, value 0x0, size 0" after the sections.
+static void emu_load_map(const char *path)
+{
+    char line[256];
+    FILE *file = fopen(path, "r");
+
+    if (file == 0)
+    {
+        perror(path);
+        exit(2);
+    }
+
+    while (fgets(line, sizeof(line), file) != 0 && _symbol_count < EMU_MAX_SYMBOLS)
+    {
+        symbol_t *symbol = &_symbols[_symbol_count];
+        unsigned long address;
+        char name[sizeof(symbol->name)];
+
+        if (sscanf(line, " 0x%lx %47[^:]:", &address, name) != 2 || strstr(line, "value") == 0)
+            continue;
+
+        // vbcc names its labels l1, l2 and so on, they would split functions
+        if (name[0] == 'l' && name[1] != 0 && strspn(name + 1, "0123456789") == strlen(name + 1))
+            continue;
+
+        symbol->address = address;
+        strcpy(symbol->name, name);
+        symbol->cycles = 0;
+        _symbol_count++;
+    }
+
+    fclose(file);
+    qsort(_symbols, _symbol_count, sizeof(symbol_t), emu_symbol_compare);
+}
+
+static symbol_t *emu_symbol(uint32_t address)
+{
+    int low = 0;
+    int high = _symbol_count - 1;
+    symbol_t *found = 0;
+
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+
+        if (_symbols[mid].address <= address)
+        {
+            found = &_symbols[mid];
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+static int emu_cycles_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const symbol_t *)a)->cycles;
+    uint64_t y = ((const symbol_t *)b)->cycles;
+    return x > y ? -1 : x < y;
+}
+
+
+/** Kernel Calls **/
+
+static void emu_report(void)
+{
+    printf("total %llu cycles, %.3f s at %u MHz\n", (unsigned long long)_cycles, (double)_cycles / EMU_CLOCK_HZ, EMU_CLOCK_HZ / 1000000);
+
+    qsort(_symbols, _symbol_count, sizeof(symbol_t), emu_cycles_compare);
+
+    for (int i = 0; i < _symbol_count && _symbols[i].cycles > 0; ++i)
+        printf("%12llu %6.2f%% %s\n", (unsigned long long)_symbols[i].cycles, 100.0 * _symbols[i].cycles / _cycles, _symbols[i].name);
+
+    printf("stack %u bytes at the deepest\n", EMU_STACK_TOP - _stack_low);
+}
+
+static void emu_exit(int result)
+{
+    emu_report();
+
+    if (_stack_budget > 0 && EMU_STACK_TOP - _stack_low > _stack_budget)
+    {
+        fprintf(stderr, "stack used %u bytes, over the budget of %u\n", EMU_STACK_TOP - _stack_low, _stack_budget);
+        exit(3);
+    }
+
+    exit(result);
+}
+
+static void emu_load_keys(void)
+{
+    const char *path = getenv("FTE_KEYS");
+    int fd = path != 0 ? open(path, O_RDONLY) : STDIN_FILENO;
+    size_t cap = 4096;
+    ssize_t count;
+
+    if (fd < 0)
+    {
+        perror(path);
+        exit(2);
+    }
+
+    _keys = malloc(cap);
+    while ((count = read(fd, _keys + _key_count, cap - _key_count)) > 0)
+    {
+        _key_count += count;
+        if (_key_count == cap)
+            _keys = realloc(_keys, cap *= 2);
+    }
+}
+
+// The cycles since the last key are what the one before it cost
+static int32_t emu_read_key(void)
+{
+    if (_key_pos > 0 && _key_report)
+        printf("key %zu 0x%02X %llu cycles\n", _key_pos, _keys[_key_pos - 1], (unsigned long long)(_cycles - _key_start));
+
+    _key_start = _cycles;
+
+    if (_key_pos < _key_count)
+        return _keys[_key_pos++];
+
+    emu_exit(0);
+}
+
+static int emu_fd(int32_t channel)
+{
+    return channel > 0 && channel < EMU_MAX_FILES ? _files[channel] : -1;
+}
+
+static int32_t emu_open(const char *path, int32_t mode)
+{
+    int flags = O_RDONLY;
+
+    if (mode & FILE_MODE_WRITE)
+    {
+        flags = (mode & FILE_MODE_READ) ? O_RDWR : O_WRONLY;
+        if (mode & FILE_MODE_CREATE_ALWAYS)
+            flags |= O_CREAT | O_TRUNC;
+        if (mode & FILE_MODE_CREATE_NEW)
+            flags |= O_CREAT | O_EXCL;
+    }
+
+    for (int32_t channel = 1; channel < EMU_MAX_FILES; ++channel)
+    {
+        if (_files[channel] < 0)
+        {
+            _files[channel] = open(path, flags, 0644);
+            return _files[channel] < 0 ? -1 : channel;
+        }
+    }
+
+    return -1;
+}
+
+// Does the kernel call in D0 with the parameters in D1 to D6 and returns the
+// result for D0. Shorts arrive sign extended.
+static int32_t emu_syscall(void)
+{
+    int32_t function = m68k_get_reg(0, M68K_REG_D0);
+    int32_t p0 = m68k_get_reg(0, M68K_REG_D1);
+    int32_t p1 = m68k_get_reg(0, M68K_REG_D2);
+    int32_t p2 = m68k_get_reg(0, M68K_REG_D3);
+    char path[MAX_PATH_LEN];
+    char other[MAX_PATH_LEN];
+    uint8_t buffer[4096];
+    struct stat st;
+
+    switch (function)
+    {
+        case KFN_EXIT:
+            emu_exit((int16_t)p0);
+
+        case KFN_SYS_GET_INFO:
+            // Only the RAM size is filled in, at its offset with vbcc's 68000
+            // alignment of two bytes for longs and pointers
+            for (uint32_t i = 0; i < sizeof(t_sys_info); ++i)
+                m68k_write_memory_8(p0 + i, 0);
+            m68k_write_memory_16(p0 + 6, MODEL_FOENIX_A2560U);
+            m68k_write_memory_32(p0 + 36, EMU_RAM_SIZE);
+            return 0;
+
+        case KFN_CHAN_READ_B:
+            if (p0 == 0)
+                return emu_read_key();
+            return read(emu_fd(p0), buffer, 1) == 1 ? buffer[0] : -1;
+
+        case KFN_CHAN_READ:
+        {
+            int16_t size = p2 < (int32_t)sizeof(buffer) ? p2 : (int32_t)sizeof(buffer);
+            ssize_t count = read(emu_fd(p0), buffer, size);
+
+            for (ssize_t i = 0; i < count; ++i)
+                m68k_write_memory_8(p1 + i, buffer[i]);
+            return count;
+        }
+
+        case KFN_CHAN_WRITE:
+        {
+            int16_t size = p2 < (int32_t)sizeof(buffer) ? p2 : (int32_t)sizeof(buffer);
+
+            for (int16_t i = 0; i < size; ++i)
+                buffer[i] = m68k_read_memory_8(p1 + i);
+            return write(p0 == 0 ? STDERR_FILENO : emu_fd(p0), buffer, size);
+        }
+
+        case KFN_CHAN_WRITE_B:
+            buffer[0] = p1;
+            return write(p0 == 0 ? STDERR_FILENO : emu_fd(p0), buffer, 1);
+
+        case KFN_CHAN_STATUS:
+            // Keys replay as if held down
+            return p0 == 0 && _key_pos < _key_count ? CDEV_STAT_READABLE : 0;
+
+        case KFN_CHAN_SEEK:
+            return lseek(emu_fd(p0), p1, p2 == CDEV_SEEK_ABSOLUTE ? SEEK_SET : SEEK_CUR) < 0 ? -1 : 0;
+
+        case KFN_OPEN:
+            return emu_open(emu_string(p0, path, sizeof(path)), p1);
+
+        case KFN_CLOSE:
+            if (emu_fd(p0) < 0)
+                return -1;
+            close(_files[p0]);
+            _files[p0] = -1;
+            return 0;
+
+        case KFN_FINDFIRST:
+        {
+            // The pattern is taken as the name of one file in the directory
+            size_t len = strlen(emu_string(p0, path, sizeof(path)));
+
+            if (len > 0 && path[len - 1] != '/' && path[len - 1] != ':')
+                path[len++] = '/';
+            emu_string(p1, path + len, sizeof(path) - len);
+
+            if (stat(path, &st) != 0)
+                return -1;
+
+            m68k_write_memory_32(p2, st.st_size);
+            return 1;
+        }
+
+        case KFN_DELETE:
+            return unlink(emu_string(p0, path, sizeof(path)));
+
+        case KFN_RENAME:
+            return rename(emu_string(p0, path, sizeof(path)), emu_string(p1, other, sizeof(other)));
+
+        case KFN_LOAD:
+        {
+            int fd = open(emu_string(p0, path, sizeof(path)), O_RDONLY);
+            uint32_t at = p1;
+            ssize_t count;
+
+            if (fd < 0)
+                return -1;
+
+            while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+            {
+                for (ssize_t i = 0; i < count; ++i)
+                    m68k_write_memory_8(at++, buffer[i]);
+            }
+
+            close(fd);
+            if (p2 != 0)
+                m68k_write_memory_32(p2, 0);
+            return 0;
+        }
+
+        case KFN_TIME_JIFFIES:
+            return _cycles / EMU_JIFFY_CYCLES;
+
+        default:
+            // Interrupt setup, ioctrl and the like have nothing to do here
+            return 0;
+    }
+}
+
+
+/** Main **/
+
+static void emu_load_image(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == 0)
+    {
+        perror(path);
+        exit(2);
+    }
+
+    fread(&_ram[EMU_LOAD_ADDRESS], 1, EMU_STACK_TOP - EMU_LOAD_ADDRESS, file);
+    fclose(file);
+}
+
+// Sets up the vectors and a stack the way the kernel calls a program, with
+// the argument count and list behind the return address. fte.c does not look
+// at its arguments, so the list is empty.
+static void emu_reset(void)
+{
+    uint32_t sp = EMU_STACK_TOP - 16;
+
+    m68k_write_memory_32(sp, EMU_FAULT_HANDLER);    // return address
+    m68k_write_memory_32(sp + 4, 0);                // argc
+    m68k_write_memory_32(sp + 8, sp + 12);          // argv
+    m68k_write_memory_32(sp + 12, 0);               // argv[0], the end of the list
+
+    m68k_write_memory_32(0, sp);
+    m68k_write_memory_32(4, EMU_LOAD_ADDRESS);
+
+    for (uint32_t vector = 2; vector < 256; ++vector)
+        m68k_write_memory_32(vector * 4, vector == EMU_TRAP_VECTOR ? EMU_TRAP_HANDLER : EMU_FAULT_HANDLER);
+
+    m68k_write_memory_16(EMU_TRAP_HANDLER, 0x4E73);    // rte
+    m68k_write_memory_16(EMU_FAULT_HANDLER, 0x4E72);   // stop
+
+    m68k_init();
+    m68k_set_cpu_type(M68K_CPU_TYPE_68000);
+    m68k_pulse_reset();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *image = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            emu_load_map(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            _vram_wait = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0)
+            _key_report = true;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            _stack_budget = atoi(argv[++i]);
+        else
+            image = argv[i];
+    }
+
+    if (image == 0)
+    {
+        fprintf(stderr, "usage: fte_emu [-m mapfile] [-w wait] [-k] [-s budget] fte.bin < keys\n");
+        return 2;
+    }
+
+    for (int i = 0; i < EMU_MAX_FILES; ++i)
+        _files[i] = -1;
+
+    emu_load_keys();
+    emu_load_image(image);
+    emu_reset();
+
+    // One instruction at a time, so every cycle is charged to the function
+    // the instruction belongs to
+    while (true)
+    {
+        uint32_t pc = m68k_get_reg(0, M68K_REG_PC);
+
+        if (pc == EMU_TRAP_HANDLER)
+        {
+            m68k_set_reg(M68K_REG_D0, emu_syscall());
+        }
+        else if (pc == EMU_FAULT_HANDLER)
+        {
+            uint32_t sp = m68k_get_reg(0, M68K_REG_A7);
+            fprintf(stderr, "exception, PC was 0x%06X\n", m68k_read_memory_32(sp + 2));
+            emu_report();
+            return 1;
+        }
+
+        _wait_cycles = 0;
+        uint32_t cycles = m68k_execute(1) + _wait_cycles;
+        _cycles += cycles;
+
+        uint32_t sp = m68k_get_reg(0, M68K_REG_A7);
+        if (sp < _stack_low)
+            _stack_low = sp;
+
+        symbol_t *symbol = emu_symbol(pc);
+        if (symbol != 0)
+            symbol->cycles += cycles;
+    }
+}
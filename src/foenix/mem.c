@@ -1,35 +1,343 @@
 
 #include <stdint.h>
+#include "mem.h"
+#include "syscalls.h"
+#include "systrace.h"
+#include "perf.h"
+#include "trace.h"
+
+#define MEM_MAX_REGIONS		4
+#define MEM_KERNEL_RESERVE	0x10000	// top of RAM, where the kernel allocates its own memory
+
+// Start of system RAM, the size sys_get_info() reports counts from here
+#ifndef MEM_RAM_BASE
+#define MEM_RAM_BASE		0x00000000UL	// bottom of the A2560U's address space
+#endif
+
+// End of the window the program is linked into, its stack is at the top
+extern uint8_t __STACK[];
+
+// A released block, kept in a list sorted by address so neighbours can be
+// merged. Blocks that reach the top of the heap go back to it.
+typedef struct mem_block_t {
+	struct mem_block_t *next;
+	unsigned long size;
+} mem_block_t;
 
 static uint8_t *_heap;
 static uint8_t *_heap_end;
 
 static uint8_t *_heap_ptr;
 
+static mem_block_t *_free_list;
+static mem_block_t *_free_finger;		// the block last released into, inserts above it start there
+static unsigned long _free_bytes;
+
+// Memory outside the linked heap. Each region starts out as one released block.
+static uint8_t *_region_start[MEM_MAX_REGIONS];
+static uint8_t *_region_end[MEM_MAX_REGIONS];
+static uint8_t _region_count;
+static unsigned long _total_bytes;
+
+static unsigned long _alloc_count;
+static unsigned long _release_count;
+static unsigned long _peak_used;		// most bytes handed out at once
+static unsigned long _visits;			// free list nodes walked
+
 void mem_init(uint8_t *heap, uint8_t *heap_end)
 {
 	_heap = heap;
 	_heap_end = heap_end;
 	_heap_ptr = _heap;
+	_free_list = 0;
+	_free_finger = 0;
+	_free_bytes = 0;
+	_region_count = 0;
+	_total_bytes = heap_end - heap;
 }
 
-void *mem_alloc(unsigned long size)
+static unsigned long mem_round(unsigned long size)
+{
+	size = (size + MEM_GRAIN - 1) & ~(unsigned long)(MEM_GRAIN - 1);
+	return size == 0 ? MEM_GRAIN : size;
+}
+
+static void mem_note_peak(void)
+{
+	unsigned long used = _total_bytes - (unsigned long)(_heap_end - _heap_ptr) - _free_bytes;
+
+	if (used > _peak_used)
+		_peak_used = used;
+}
+
+// Hands out size bytes from the start of the free block *it points at and
+// leaves the rest on the list
+static void *mem_take(mem_block_t **it, unsigned long size)
+{
+	mem_block_t *block = *it;
+
+	// Sizes are multiples of MEM_GRAIN, so anything left is big enough to list
+	if (block->size > size)
+	{
+		mem_block_t *rest = (mem_block_t *)((uint8_t *)block + size);
+
+		rest->next = block->next;
+		rest->size = block->size - size;
+		*it = rest;
+
+		if (_free_finger == block)
+			_free_finger = rest;
+	}
+	else
+	{
+		*it = block->next;
+
+		if (_free_finger == block)
+			_free_finger = 0;
+	}
+
+	_free_bytes -= size;
+	mem_note_peak();
+	return block;
+}
+
+static void *mem_alloc_top(unsigned long size)
 {
-	size = ((size / 4) + 1) * 4;
 	if ((_heap_ptr + size) >= _heap_end)
 		return 0;
 
 	void *ptr = _heap_ptr;
 	_heap_ptr = _heap_ptr + size;
+	mem_note_peak();
 	return ptr;
 }
 
+static void mem_count_alloc(unsigned long size)
+{
+	_alloc_count++;
+	PERF_ADD(PERF_ALLOC_BYTES, size);
+	trace_alloc(size);
+}
+
+void *mem_alloc(unsigned long size)
+{
+	size = mem_round(size);
+	mem_count_alloc(size);
+
+	// The lowest released block that fits is used first
+	for (mem_block_t **it = &_free_list; *it != 0; it = &(*it)->next)
+	{
+		_visits++;
+		if ((*it)->size >= size)
+			return mem_take(it, size);
+	}
+
+	return mem_alloc_top(size);
+}
+
+// Allocates size bytes below ptr, looking at no more than limit free blocks.
+// Returns 0 if none of those fits, so the work done is bounded even when the
+// free list is long.
+void *mem_alloc_below(void *ptr, unsigned long size, unsigned long limit)
+{
+	size = mem_round(size);
+
+	for (mem_block_t **it = &_free_list; *it != 0 && (void *)*it < ptr; it = &(*it)->next)
+	{
+		if (limit-- == 0)
+			return 0;
+
+		_visits++;
+		if ((*it)->size >= size)
+		{
+			mem_count_alloc(size);
+			return mem_take(it, size);
+		}
+	}
+
+	// Memory in a region above the heap can still move down to its top
+	if ((void *)(_heap_ptr + size) <= ptr)
+	{
+		mem_count_alloc(size);
+		return mem_alloc_top(size);
+	}
+
+	return 0;
+}
+
+// Puts a block on the free list, merged with its neighbours. The walk to its
+// place starts from the last block released into when that is below it, as
+// blocks tend to be released in the order of their addresses.
+static void mem_insert(void *ptr, unsigned long size)
+{
+	mem_block_t *block = (mem_block_t *)ptr;
+	mem_block_t *prev = 0;
+	mem_block_t *next = _free_list;
+	mem_block_t **before = 0;		// the link to prev, if the walk saw it
+
+	size = mem_round(size);
+
+	if (_free_finger != 0 && _free_finger < block)
+	{
+		prev = _free_finger;
+		next = _free_finger->next;
+	}
+
+	while (next != 0 && next < block)
+	{
+		_visits++;
+		before = prev != 0 ? &prev->next : &_free_list;
+		prev = next;
+		next = next->next;
+	}
+
+	block->size = size;
+	block->next = next;
+	_free_bytes += size;
+
+	if (next != 0 && (uint8_t *)block + block->size == (uint8_t *)next)
+	{
+		block->size += next->size;
+		block->next = next->next;
+	}
+
+	// link ends up pointing at whatever points at block
+	mem_block_t **link;
+	if (prev != 0 && (uint8_t *)prev + prev->size == (uint8_t *)block)
+	{
+		prev->size += block->size;
+		prev->next = block->next;
+		block = prev;
+		link = before;
+	}
+	else
+	{
+		link = prev != 0 ? &prev->next : &_free_list;
+		*link = block;
+	}
+
+	_free_finger = block;
+
+	// The last block is handed back to the top of the heap
+	if (block->next == 0 && (uint8_t *)block + block->size == _heap_ptr)
+	{
+		// Only a walk that started from the finger does not know the link
+		if (link == 0)
+		{
+			link = &_free_list;
+			while (*link != block)
+			{
+				_visits++;
+				link = &(*link)->next;
+			}
+		}
+
+		*link = 0;
+		_heap_ptr = (uint8_t *)block;
+		_free_bytes -= block->size;
+		_free_finger = 0;
+	}
+}
+
+// Gives a block back. The size has to be the one it was allocated with.
+void mem_release(void *ptr, unsigned long size)
+{
+	_release_count++;
+	mem_insert(ptr, size);
+}
+
+// Adds memory that does not follow the heap, such as RAM above the program
+void mem_add_region(uint8_t *start, uint8_t *end)
+{
+	start = (uint8_t *)(((unsigned long)start + MEM_ALIGN - 1) & ~(unsigned long)(MEM_ALIGN - 1));
+	end = (uint8_t *)((unsigned long)end & ~(unsigned long)(MEM_ALIGN - 1));
+	if (end > start)
+		end -= (unsigned long)(end - start) % MEM_GRAIN;
+
+	if (_region_count == MEM_MAX_REGIONS || end <= start || (unsigned long)(end - start) < sizeof(mem_block_t))
+		return;
+
+	_region_start[_region_count] = start;
+	_region_end[_region_count] = end;
+	_region_count++;
+
+	_total_bytes += end - start;
+	mem_insert(start, end - start);
+}
+
+// The program is linked into a fixed window at the bottom of RAM. The kernel
+// reports how much RAM the machine has, the part between the window and the
+// top of RAM is added to the heap.
+void mem_add_system_ram(void)
+{
+	static t_sys_info info;
+	unsigned long end;
+
+	sys_get_info(&info);
+
+	if (info.system_ram_size <= MEM_KERNEL_RESERVE)
+		return;
+
+	end = MEM_RAM_BASE + info.system_ram_size - MEM_KERNEL_RESERVE;
+	if (end > (unsigned long)__STACK)
+		mem_add_region(__STACK, (uint8_t *)end);
+}
+
 void mem_reset(void)
 {
 	_heap_ptr =_heap;
+	_free_list = 0;
+	_free_finger = 0;
+	_free_bytes = 0;
+
+	for (uint8_t i = 0; i < _region_count; ++i)
+		mem_insert(_region_start[i], _region_end[i] - _region_start[i]);
 }
 
 unsigned long mem_free(void)
 {
-	return (unsigned long)(_heap_end - _heap_ptr);
+	return (unsigned long)(_heap_end - _heap_ptr) + _free_bytes;
+}
+
+unsigned long mem_total(void)
+{
+	return _total_bytes;
+}
+
+// Number of calls to mem_alloc so far, failed ones included
+unsigned long mem_alloc_count(void)
+{
+	return _alloc_count;
+}
+
+unsigned long mem_release_count(void)
+{
+	return _release_count;
+}
+
+unsigned long mem_peak_used(void)
+{
+	return _peak_used;
+}
+
+// Free list nodes walked so far, the work the allocator did
+unsigned long mem_visits(void)
+{
+	return _visits;
+}
+
+// Number of released blocks waiting to be reused, and the size of the largest
+unsigned long mem_free_blocks(unsigned long *largest)
+{
+	unsigned long count = 0;
+
+	*largest = 0;
+	for (mem_block_t *it = _free_list; it != 0; it = it->next)
+	{
+		if (it->size > *largest)
+			*largest = it->size;
+		++count;
+	}
+
+	return count;
 }
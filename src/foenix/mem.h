@@ -2,9 +2,35 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stdint.h>
+
+// Blocks are aligned for any type. Four bytes is enough on the 68000, a
+// hosted build needs what its largest types do.
+#ifdef __VBCC__
+#define MEM_ALIGN		4
+#else
+#include <stddef.h>
+#define MEM_ALIGN		_Alignof(max_align_t)
+#endif
+
+// Sizes are rounded up to a multiple of this, which also holds the link and
+// size a free block keeps, so what is left of a block can always be listed
+#define MEM_GRAIN		(MEM_ALIGN > 2 * sizeof(void *) ? MEM_ALIGN : 2 * sizeof(void *))
+
 void *mem_alloc(unsigned long size);
+void mem_release(void *ptr, unsigned long size);
+void *mem_alloc_below(void *ptr, unsigned long size, unsigned long limit);
 void mem_reset(void);
 
+void mem_add_region(uint8_t *start, uint8_t *end);
+void mem_add_system_ram(void);
+
 unsigned long mem_free(void);
+unsigned long mem_total(void);
+unsigned long mem_alloc_count(void);
+unsigned long mem_release_count(void);
+unsigned long mem_peak_used(void);
+unsigned long mem_visits(void);
+unsigned long mem_free_blocks(unsigned long *largest);
 
 #endif
\ No newline at end of file
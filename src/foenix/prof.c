@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include "syscalls.h"
+#include "timers.h"
+#include "prof.h"
+
+#ifdef FTE_PERF
+
+// Timer 0 counts CPU clocks. Its rate is a prime, so the samples do not fall
+// at the same point of every 60 Hz frame, as they would on the start of frame
+// interrupt, and a redraw is sampled all the way through.
+#define PROF_INTERRUPT		INT_TIMER0
+#define PROF_RATE_HZ		997
+#define PROF_RATE_TEXT		"997"		// PROF_RATE_HZ as text, for prof_timer_source()
+
+// Where the program is linked, as run.bat loads it, and the end of its data
+#define PROF_CODE_START		0x20000
+extern uint8_t __BSSSTART[];
+
+// The interrupt entry in startup.s, which passes the interrupted address on
+extern void prof_tick(void);
+
+static p_int_handler _chained = 0;
+static uint32_t _saved_control;
+static uint32_t _saved_compare;
+
+
+// The kernel's own handler, if it had one, still runs after each sample
+void prof_interrupt(unsigned long pc)
+{
+	prof_sample(pc);
+
+	if (_chained != 0)
+		_chained();
+}
+
+// The kernel has no call for the timers, so timer 0 is programmed directly,
+// as console.c does the VICKY. Its settings are put back when profiling stops.
+void prof_timer_start(void)
+{
+	_saved_control = *TIMER_TCR0 & TCR_MASK_0;
+	_saved_compare = *TIMER_COMPARE_0;
+
+	*TIMER_TCR0 = (*TIMER_TCR0 & ~TCR_MASK_0) | TCR_CLEAR_0;
+	*TIMER_COMPARE_0 = TIMER_CPU_CLOCK_HZ / PROF_RATE_HZ;
+
+	_chained = sys_int_register(PROF_INTERRUPT, prof_tick);
+	sys_int_enable(PROF_INTERRUPT);
+
+	*TIMER_TCR0 = (*TIMER_TCR0 & ~TCR_MASK_0) | TCR_ENABLE_0 | TCR_COUNTUP_0 | TCR_RECLEAR_0 | TCR_INE_0;
+}
+
+void prof_timer_stop(void)
+{
+	*TIMER_TCR0 = (*TIMER_TCR0 & ~TCR_MASK_0) | TCR_CLEAR_0;
+	*TIMER_COMPARE_0 = _saved_compare;
+	*TIMER_TCR0 = (*TIMER_TCR0 & ~TCR_MASK_0) | _saved_control;
+
+	sys_int_register(PROF_INTERRUPT, _chained);
+	if (_chained == 0)
+		sys_int_disable(PROF_INTERRUPT);
+}
+
+const char *prof_timer_source(void)
+{
+	return "timer 0 at " PROF_RATE_TEXT " Hz";
+}
+
+void prof_code_range(unsigned long *start, unsigned long *end, unsigned long *linked)
+{
+	*start = PROF_CODE_START;
+	*end = (unsigned long)__BSSSTART;
+	*linked = PROF_CODE_START;
+}
+
+#endif
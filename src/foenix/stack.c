@@ -0,0 +1,22 @@
+#include <stdint.h>
+#include "stack.h"
+
+// vlink_ram.cmd puts the stack between the end of the heap and ___STACK
+extern uint8_t __heapend[];
+extern uint8_t __STACK[];
+
+
+unsigned long stack_used(void)
+{
+	uint32_t *it = (uint32_t *)__heapend;
+
+	while (it < (uint32_t *)__STACK && *it == STACK_CANARY)
+		++it;
+
+	return (unsigned long)(__STACK - (uint8_t *)it);
+}
+
+unsigned long stack_size(void)
+{
+	return (unsigned long)(__STACK - __heapend);
+}
@@ -1,6 +1,12 @@
 	xdef ___exit
 	xdef _syscall
 
+	ifd FTE_PERF
+	xref _perf_syscalls
+	xref _prof_interrupt
+	xdef _prof_tick
+	endif
+
 	section "CODE",code
 
 ;	start by retreiving arguments
@@ -10,6 +16,14 @@
 ;	set stack pointer
 	lea	___STACK,sp
 
+;	paint the stack with a canary, to measure how deep it goes, see stack.h
+	lea	___heapend,a0
+	move.l	#$A5A5A5A5,d0
+paint:
+	move.l	d0,(a0)+
+	cmpa.l	sp,a0
+	blo	paint
+
 ;	clear bss, could be optimized to use .l
 	lea	___BSSSTART,a0
 	move.l	#___BSSSIZE,d0
@@ -54,7 +68,38 @@ _syscall:
     move.l (36,sp),d1           ; Parameter 0 to D1
     move.l (32,sp),d0           ; Function number to D0
 
+    ifd FTE_PERF
+    move.l d0,d7                ; Count the call by its number, see perf.h
+    and.w #$7F,d7
+    lsl.w #2,d7
+    lea _perf_syscalls,a0
+    addq.l #1,(a0,d7.w)
+    endif
+
     trap #15                    ; Call into the kernel
 
     movem.l (sp)+,d1-d7         ; Restore caller's registers
     rts
+
+	ifd FTE_PERF
+;
+; Interrupt handler of the sampling profiler, see foenix/prof.c. The MCP's
+; interrupt entry saves D0-D7/A0-A6 with movem.l and calls the registered
+; handler with jsr, so the stack holds, from the top:
+;
+;   the return address of that jsr          PROF_RETURN_SIZE
+;   D0-D7/A0-A6, 15 long words              PROF_SAVED_SIZE
+;   the exception frame of the 68000: the status register, then the
+;   program counter that was interrupted    PROF_SR_SIZE
+;
+PROF_RETURN_SIZE equ 4
+PROF_SAVED_SIZE equ 15*4
+PROF_SR_SIZE equ 2
+PROF_PC_OFFSET equ PROF_RETURN_SIZE+PROF_SAVED_SIZE+PROF_SR_SIZE
+
+_prof_tick:
+    move.l (PROF_PC_OFFSET,sp),-(sp)    ; Interrupted address as the argument
+    jsr _prof_interrupt
+    addq.l #4,sp
+    rts
+	endif
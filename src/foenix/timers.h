@@ -0,0 +1,40 @@
+/*
+ * Registers of the GABE timers on the A2560U, as the MCP's timers_a2560u.h
+ * lays them out
+ */
+
+#ifndef __MCP_TIMERS_H
+#define __MCP_TIMERS_H
+
+#include <stdint.h>
+
+#define TIMER_CPU_CLOCK_HZ  20000000    /* Timers 0 to 2 count CPU clocks, the 68000 runs at 20 MHz */
+
+/*
+ * Control registers, a byte for each timer: TCR0 holds timers 0 and 1, TCR1
+ * timers 2 to 4. The bits below are those of timer 0, the others are shifted
+ * up by 8 bits per timer.
+ */
+
+#define TIMER_TCR0          ((volatile uint32_t *)0x00B00200)
+#define TIMER_TCR1          ((volatile uint32_t *)0x00B00204)
+
+#define TCR_ENABLE_0        0x00000001  /* Counter 0 runs */
+#define TCR_CLEAR_0         0x00000002  /* Counter 0 is set to 0 */
+#define TCR_LOAD_0          0x00000004  /* Counter 0 is set to its value register */
+#define TCR_COUNTUP_0       0x00000008  /* Counter 0 counts up to its compare register, else down to 0 */
+#define TCR_RECLEAR_0       0x00000010  /* Counter 0 starts again from 0 when it reaches the compare register */
+#define TCR_RELOAD_0        0x00000020  /* Counter 0 starts again from its value register when it reaches 0 */
+#define TCR_INE_0           0x00000080  /* Counter 0 raises INT_TIMER0 when it reaches its end */
+#define TCR_MASK_0          0x000000FF
+
+/* Value and compare registers, 24 bits each */
+
+#define TIMER_VALUE_0       ((volatile uint32_t *)0x00B00208)
+#define TIMER_COMPARE_0     ((volatile uint32_t *)0x00B0020C)
+#define TIMER_VALUE_1       ((volatile uint32_t *)0x00B00210)
+#define TIMER_COMPARE_1     ((volatile uint32_t *)0x00B00214)
+#define TIMER_VALUE_2       ((volatile uint32_t *)0x00B00218)
+#define TIMER_COMPARE_2     ((volatile uint32_t *)0x00B0021C)
+
+#endif
@@ -4,9 +4,73 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "syscalls.h"
+#include "systrace.h"
 #include "console.h"
 #include "mem.h"
+#include "regex.h"
+#include "perf.h"
+#include "prof.h"
+#include "stack.h"
+#include "trace.h"
+
+
+#define LINE_MAX_LEN		128
+#define MACRO_MAX_KEYS		256
+#define MACRO_MAX_REPEAT	10000	// replays to the end of the document stop after this many runs
+#define LOAD_CHUNK_SIZE		512
+
+#define UNDO_ARENA_SIZE		4096	// must be a power of two
+#define UNDO_MAX_RUN		1024
+#define UNDO_HEADER_SIZE	8
+#define UNDO_FOOTER_SIZE	2
+#define UNDO_INSERT			0x01
+#define UNDO_DELETE			0x02
+#define UNDO_SPLIT			0x03
+#define UNDO_JOIN			0x04
+#define UNDO_PUT_LINES		0x05	// the text is payload pointers, one per line
+#define UNDO_CUT_LINES		0x06
+#define UNDO_KIND_MASK		0x0F
+#define UNDO_LINKED			0x80	// undone together with the record before it
+#define UNDO_FILE_VERSION	1
+#define UNDO_FILE_BUFFER	256
+#define DOC_HASH_SEED		2166136261u
+#define SEARCH_MAX_LEN		128
+#define PAGE_LINES			64
+#define PAGE_MAX_BYTES		0x7F00	// a page is closed early once it holds this many bytes
+#define PAGE_RESIDENT_MAX	12		// clean pages kept loaded before the oldest is dropped
+#define PAGE_TABLE_SIZE		32
+#define BLOCK_SIZE			512
+#define BLOCK_COUNT			8
+#define DOC_PAGED_SIZE		32768	// larger files are opened as pages
+#define PACK_LINES			128
+#define PACK_MIN_LINES		8		// shorter runs of cold lines are left alone
+#define PACK_MAX_BYTES		4096	// text of a pack, a newline after every line
+#define PACK_OUT_SIZE		(PACK_MAX_BYTES + PACK_MAX_BYTES / 8 + 1)
+#define PACK_CLASS_SIZE		128
+#define PACK_CLASSES		((PACK_OUT_SIZE + PACK_CLASS_SIZE - 1) / PACK_CLASS_SIZE)
+#define PACK_CACHE_COUNT	2
+#define PACK_HASH_SIZE		1024	// must be a power of two
+#define PACK_WINDOW			4096
+#define PACK_MIN_MATCH		3
+#define PACK_MAX_MATCH		18
+#define PACK_CHAIN_DEPTH	16		// earlier matches tried for every position
+
+#define LINE_STUB			0x01	// stands for a page of the file that is not loaded
+#define LINE_CLEAN			0x02	// loaded from a page and not edited since
+#define LINE_VIEW			0x04	// data points into the file image, not into the line
+#define LINE_SHARED			0x08	// data belongs to a payload other lines may share
+#define LINE_PACKED			0x10	// a stub whose page is compressed in memory
+#define LINE_CLASSES		5		// sizes lines are allocated in, see get_line_cache()
+#define CLIP_MAX_LINES		64
+#define INTERN_MAX_LEN		16		// longer payloads are not looked up
+#define INTERN_TABLE_SIZE	256
+#define STATUS_MSG_SIZE		168		// fits the longest status message with every number at its widest
+#define COMPACT_STEP		16		// lines or free nodes handled per idle step
+#define COMPACT_STEP_NODES	256		// free list nodes an idle step may walk before it stops
+#define MEM_LOW_WATER		8192	// below this much free memory, memory is reclaimed after every command
+#define MEM_RESERVE_SIZE	(PAGE_LINES * (sizeof(line_t) + LINE_MAX_LEN + MEM_GRAIN) + 1024)	// a page can still be loaded on it
 
 
 typedef bool (*command_t)(uint8_t ch);
@@ -16,11 +80,60 @@ typedef void (*buffer_command_t)(void);
 typedef struct line_t {
 	struct line_t *prev;
 	struct line_t *next;
+	uint8_t *data;				// the storage following the line, or a view
 	uint8_t len;
 	uint8_t cap;
-	uint8_t data[1];
+	uint8_t flags;
 } line_t;
 
+// Line text that is never changed once written, so lines, the clipboard and
+// the undo journal can all refer to it
+typedef struct payload_t {
+	struct payload_t *next;		// free list
+	uint16_t refs;
+	uint8_t len;
+	uint8_t cap;
+	uint8_t data[1];
+} payload_t;
+
+// A run of lines in the file, stored in the data of a stub line
+typedef struct page_t {
+	uint32_t offset;
+	uint16_t bytes;
+	uint8_t lines;
+} page_t;
+
+// A run of lines compressed in memory. A packed stub points its data here.
+typedef struct pack_t {
+	struct pack_t *next;		// free list
+	uint16_t size;				// compressed bytes
+	uint16_t bytes;				// text bytes, a newline after every line
+	uint8_t lines;
+	uint8_t cls;
+	uint8_t data[1];
+} pack_t;
+
+typedef struct resident_t {
+	line_t *first;
+	line_t *last;
+	page_t page;
+	pack_t *pack;				// the packed page the lines came from, or 0
+	uint32_t stamp;
+} resident_t;
+
+typedef struct pack_slot_t {
+	pack_t *pack;
+	uint32_t stamp;
+	uint8_t *text;
+} pack_slot_t;
+
+typedef struct block_t {
+	uint32_t index;
+	uint32_t stamp;
+	uint16_t len;
+	uint8_t data[BLOCK_SIZE];
+} block_t;
+
 typedef struct line_cache_t {
 	line_t *first;
 	uint8_t size;
@@ -31,6 +144,15 @@ typedef struct location_t {
 	uint8_t offset;
 } location_t;
 
+typedef struct heap_stats_t {
+	uint32_t lines[LINE_CLASSES];	// document lines with text of their own, by size
+	uint32_t cached[LINE_CLASSES];	// nodes parked in the line caches
+	uint32_t stubs;					// stub and packed lines
+	uint32_t views;					// lines in the file image
+	uint32_t wasted;				// capacity over length of the lines
+	uint32_t parked;				// bytes in every cache, lines, payloads and packs
+} heap_stats_t;
+
 
 static int16_t _width;
 static int16_t _height;
@@ -42,6 +164,8 @@ static uint16_t _cursor_y = 0;
 
 static line_t *_document_first_line = 0;
 static char _document_name[32];
+static line_t *_numbered_line = 0;			// the line doc_line_number() found last
+static uint32_t _numbered_no;
 
 static char _buffer_prompt[32] = {0};
 static uint16_t _buffer_prompt_len;
@@ -49,23 +173,156 @@ static line_t *_buffer_line = 0;
 static bool _in_buffer = false;
 static buffer_command_t _buffer_accept_cmd;
 static buffer_command_t _buffer_reject_cmd;
+static buffer_command_t _buffer_change_cmd;
 static location_t _buffer_old_cursor;
 
+static bool _statusbar_message = false;
+static bool _paint_suppressed = false;
+
+static uint8_t _macro_keys[MACRO_MAX_KEYS];
+static uint16_t _macro_len = 0;
+static bool _macro_recording = false;
+
+static location_t _highlight = {0};
+static uint8_t _highlight_len = 0;
+
+static uint8_t _search_pattern[SEARCH_MAX_LEN];
+static uint8_t _search_len = 0;
+static uint8_t _search_skip_fwd[256];
+static uint8_t _search_skip_back[256];
+static uint8_t _search_identity[256];
+static uint8_t _search_fold[256];
+static const uint8_t *_search_map = _search_identity;
+static bool _search_fold_case = false;
+static bool _search_backward = false;
+static bool _search_regex = false;
+static bool _search_valid = false;
+static bool _search_wrapped = false;		// the last match was found past an end of the document
+static re_prog_t _search_prog;
+static uint8_t _search_match_len;
+
+static uint8_t _replace_text[LINE_MAX_LEN];
+static uint8_t _replace_len;
+
+// Undo records live back to back in a ring: a header (kind, offset, length,
+// line number), the text, and a footer holding the record size so the ring
+// can be walked in both directions.
+static uint8_t _undo_arena[UNDO_ARENA_SIZE];
+static uint16_t _undo_tail = 0;			// start of the oldest record
+static uint16_t _undo_current = 0;		// end of the newest record that is applied
+static uint16_t _undo_head = 0;			// end of the newest record, redo stops here
+static uint16_t _undo_used = 0;			// bytes from tail to head
+static uint16_t _undo_records = 0;
+static uint16_t _undo_open = 0;			// start of the record that may still grow
+static location_t _undo_open_end = {0};	// where an edit must happen to coalesce
+static bool _undo_suspended = false;
+static uint16_t _undo_group = 0;		// start of the newest record that is not linked
+static bool _undo_lost = false;			// the newest group outgrew the ring and was dropped
+static bool _undo_file_pending = false;		// history beside the opened file is not read yet
+
+static uint8_t _undo_file_buffer[UNDO_FILE_BUFFER];
+static uint16_t _undo_file_pos;
+static uint16_t _undo_file_count;
+static short _undo_file_chan;
+static location_t _search_origin;
+static line_t *_search_origin_scroll;
+static location_t _search_match;
+
 
 static command_t _basic_commands[256];
 static command_t _buffer_commands[256];
+static command_t _search_commands[256];
 static command_t * _current_commands;
 
+static line_t _line_cache_0 = {0};
 static line_t _line_cache_8 = {0};
 static line_t _line_cache_32 = {0};
 static line_t _line_cache_64 = {0};
 static line_t _line_cache_128 = {0};
+static line_t *const _line_caches[LINE_CLASSES] = { &_line_cache_0, &_line_cache_8, &_line_cache_32, &_line_cache_64, &_line_cache_128 };
+static const uint8_t _line_class_size[LINE_CLASSES] = { 0, 8, 32, 64, 128 };
+
+// A small file is loaded whole into one block and its lines start out as views
+// into it. A view has the length of its line as capacity, so edits that do not
+// grow the line happen in place and anything longer copies it to a new line.
+// The blocks are kept for the next file that fits.
+static uint8_t *_doc_image = 0;
+static uint32_t _doc_image_size = 0;
+static line_t *_doc_views = 0;
+static uint32_t _doc_view_count = 0;
+
+static payload_t *_payload_cache[4];
+
+// Short payloads are hash-consed, so identical lines hold one payload between
+// them. Every empty line shares the one empty payload, which is never freed.
+static payload_t *_intern[INTERN_TABLE_SIZE];
+static payload_t *_empty_payload = 0;
+static uint32_t _shared_bytes = 0;		// text held in payloads
+static uint32_t _shared_saved = 0;		// bytes not copied thanks to sharing
+
+// Whole lines are kept as shared payloads in the clipboard and in the undo
+// journal, so cutting, copying and pasting does not copy any text.
+static payload_t *_clip[CLIP_MAX_LINES];
+static uint8_t _clip_count = 0;
+static payload_t *_undo_lines[CLIP_MAX_LINES];
+static command_t _last_command = 0;
+
+// A paged document keeps its file open and holds stub lines for the pages that
+// are not loaded. Loaded pages that are still clean are tracked so they can be
+// turned back into stubs, edited pages stay in memory until the next save.
+static short _page_chan = -1;
+static resident_t _resident[PAGE_TABLE_SIZE];
+static uint8_t _resident_count = 0;
+static uint32_t _page_clock = 0;
+static block_t _blocks[BLOCK_COUNT];
+static uint32_t _block_clock = 0;
+
+// With packing on, runs of edited lines away from the screen are compressed
+// into packed stubs after every command. They load like pages of the file and
+// the text of the last few unpacked stays cached. The buffers are allocated
+// the first time packing is turned on.
+static bool _pack_enabled = false;
+static pack_t *_pack_cache[PACK_CLASSES];
+static pack_slot_t _pack_slots[PACK_CACHE_COUNT];
+static uint32_t _pack_clock = 0;
+static uint8_t *_pack_out = 0;
+static uint16_t *_pack_hash = 0;
+static uint16_t *_pack_chain = 0;
+static uint32_t _pack_bytes = 0;		// compressed bytes held in packs
+static uint32_t _pack_text = 0;			// text bytes they stand for
+
+// While no key is waiting, the nodes kept for reuse are given back to the heap
+// and the lines are moved, a few per step and in document order, into the
+// lowest free memory that fits their length. _compact_line is the last line
+// handled, the next step goes on after it.
+static bool _compact_pending = false;
+static line_t *_compact_line = 0;
+
+// A block set aside at startup. When the heap is full even after the caches
+// are drained it is given back, so the command can finish, and the editor only
+// allows saving until enough is free to set it aside again. It holds a whole
+// page, so running out while loading one still ends up here.
+static void *_mem_reserve = 0;
+static bool _mem_critical = false;
 
 
 
 
 static void display_statusbar(char * msg);
+static void redisplay_all(void);
 static void buffer_close(void);
+static void undo_load_pending(void);
+static void page_forget(line_t *line);
+static void page_trim(line_t *keep);
+static uint8_t stub_read_line(line_t *stub, uint32_t *pos, uint8_t *text);
+static line_t *doc_first_line(void);
+static line_t *line_next(line_t *line);
+static line_t *line_prev(line_t *line);
+static void page_reset(void);
+static payload_t *payload_ref(payload_t *payload);
+static location_t doc_location(uint32_t line_no, uint8_t offset);
+static uint8_t compact_drain(uint8_t work);
+static bool doc_save_copy(char *path);
 
 
 
@@ -79,536 +336,4587 @@ static void error(const char * msg)
 	sys_exit(1);
 }
 
-
-
-
-/** Line and Document **/
-
-static line_t *get_line_cache(uint16_t *size)
+static void heap_exhausted(void)
 {
-	if (*size <= 8)
-	{
-		*size = 8;
-		return &_line_cache_8;
-	}
-	else if (*size <= 32)
-	{
-		*size = 32;
-		return &_line_cache_32;
-	}
-	else if (*size <= 64)
-	{
-		*size = 64;
-		return &_line_cache_64;
-	}
-	else if (*size <= 128)
-	{
-		*size = 128;
-		return &_line_cache_128;
-	}
+	char path[sizeof(_document_name) + 4];
+
+	if (doc_save_copy(path))
+		error("Out of memory, the document was saved with .sav added to its name");
 	else
-	{
-		error("Requested line to large");
-	}
+		error("Out of memory, the document could not be saved");
 }
 
-static line_t *new_line_from_cache(line_t *cache, uint16_t size)
+// Allocates memory for text. A full heap first gives up the nodes kept for
+// reuse and then the reserve. If even that is not enough the document is
+// written to a copy before the editor exits.
+static void *heap_alloc(unsigned long size)
 {
-	line_t *line = 0;
-	if (cache->next == 0)
+	void *ptr = mem_alloc(size);
+
+	if (ptr == 0)
 	{
-		line = (line_t*)mem_alloc(sizeof(line_t) + size - 1);
-		if (line == 0)
-			error("Out of memory, could not allocate line");
+		while (compact_drain(COMPACT_STEP) == 0)
+			;
 
-		line->cap = size;
+		ptr = mem_alloc(size);
 	}
-	else
+
+	if (ptr == 0 && _mem_reserve != 0)
 	{
-		line = cache->next;
-		cache->next = line->next;
+		mem_release(_mem_reserve, MEM_RESERVE_SIZE);
+		_mem_reserve = 0;
+		_mem_critical = true;
+
+		ptr = mem_alloc(size);
 	}
 
-	line->len = 0;
-	line->prev = 0;
-	line->next = 0;
+	if (ptr == 0)
+		heap_exhausted();
 
-	return line;
+	return ptr;
 }
 
-static line_t *alloc_line(uint16_t size)
+static page_t line_page(line_t *stub)
 {
-	line_t *cache = get_line_cache(&size);
-	return new_line_from_cache(cache, size);
+	page_t page;
+
+	memcpy(&page, stub->data, sizeof(page));
+	return page;
 }
 
-static void free_line(line_t *line)
+static pack_t *line_pack(line_t *stub)
 {
-	uint16_t size = line->cap;
-	line_t *cache = get_line_cache(&size);
-	line->next = cache->next;
-	cache->next = line;
+	return (pack_t *)stub->data;
 }
 
-static line_t *grow_line(line_t *line)
+// Returns how many document lines a line in the list stands for
+static uint16_t line_count(line_t *line)
 {
-	uint16_t size = line->cap + 1;
-	line_t *cache = get_line_cache(&size);
-	line_t *new_line = new_line_from_cache(cache, size);
+	if (line->flags & LINE_PACKED)
+		return line_pack(line)->lines;
+
+	return (line->flags & LINE_STUB) ? line_page(line).lines : 1;
+}
 
-	new_line->len = line->len;
-	memcpy(new_line->data, line->data, line->len);
 
 
-	if (line->prev != 0)
-	{
-		new_line->prev = line->prev;
-		line->prev->next = new_line;
-	}
-	if (line->next != 0)
-	{
-		new_line->next = line->next;
-		line->next->prev = new_line;
-	}
 
+/** Shared Text **/
 
-	free_line(line);
-	return new_line;
-}
+static uint8_t intern_hash(const uint8_t *text, uint8_t len)
+{
+	uint16_t hash = len;
 
+	for (uint8_t i = 0; i < len; ++i)
+		hash = (hash << 3) ^ (hash >> 5) ^ text[i];
 
-static void free_document(void)
+	return (hash ^ (hash >> 8)) & (INTERN_TABLE_SIZE - 1);
+}
+
+// Returns a payload holding the text. A short text that is already held by a
+// payload gets another reference to it.
+static payload_t *payload_new(const uint8_t *text, uint8_t len)
 {
-	if (_document_first_line != 0)
+	uint8_t index = 0;
+	uint8_t cap = 8;
+	uint8_t hash = 0;
+
+	if (len <= INTERN_MAX_LEN)
 	{
-		line_t *it = _document_first_line;
-		while (it != 0)
-		{
-			line_t *to_free = it;
-			it = it->next;
+		hash = intern_hash(text, len);
 
-			free_line(to_free);
+		for (payload_t *it = _intern[hash]; it != 0; it = it->next)
+		{
+			if (it->len == len && memcmp(it->data, text, len) == 0)
+				return payload_ref(it);
 		}
 	}
 
-	_document_first_line = 0;
-}
+	while (cap < len)
+	{
+		cap = cap == 8 ? 32 : cap * 2;
+		++index;
+	}
 
-static void doc_new(void)
-{
-	free_document();
+	payload_t *payload = _payload_cache[index];
+	if (payload != 0)
+	{
+		_payload_cache[index] = payload->next;
+	}
+	else
+	{
+		payload = (payload_t*)heap_alloc(sizeof(payload_t) + cap - 1);
+		payload->cap = cap;
+	}
 
-	_document_first_line = alloc_line(8);
-	memset(_document_name, 0, sizeof(_document_name));
+	payload->refs = 1;
+	payload->len = len;
+	memcpy(payload->data, text, len);
 
-	_scroll.line = _document_first_line;
-	_scroll.offset = 0;
-	_cursor.line = _document_first_line;
-	_cursor.offset = 0;
+	// An interned payload is linked into its bucket until it is freed
+	if (len <= INTERN_MAX_LEN)
+	{
+		payload->next = _intern[hash];
+		_intern[hash] = payload;
+	}
+
+	_shared_bytes += len;
+	return payload;
 }
 
+static payload_t *payload_ref(payload_t *payload)
+{
+	++payload->refs;
+	_shared_saved += payload->len;
+	return payload;
+}
 
-static void doc_save_as(void)
+static void payload_release(payload_t *payload)
 {
-	buffer_close();
-	if (_buffer_line->len == 0)
+	if (--payload->refs > 0)
 	{
-		display_statusbar("No filename specified");
+		_shared_saved -= payload->len;
 		return;
 	}
 
-	// Copy new buffer filename
-	memcpy(_document_name, _buffer_line->data, _buffer_line->len);
-	_document_name[_buffer_line->len] = 0;
+	uint8_t index = 0;
+	for (uint8_t cap = 8; cap < payload->cap; cap = cap == 8 ? 32 : cap * 2)
+		++index;
 
-	short file_chan = sys_fsys_open(_document_name, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
-	if (file_chan <= 0)
+	_shared_bytes -= payload->len;
+
+	if (payload->len <= INTERN_MAX_LEN)
 	{
-		display_statusbar("Could not save document to file");
-		return;
+		payload_t **it = &_intern[intern_hash(payload->data, payload->len)];
+
+		while (*it != payload)
+			it = &(*it)->next;
+		*it = payload->next;
 	}
 
-	line_t *it = _document_first_line;
-	while (it != 0)
-	{
-		sys_chan_write(file_chan, it->data, it->len);
-		if (it->next != 0)
-			sys_chan_write_b(file_chan, '\n');
+	payload->next = _payload_cache[index];
+	_payload_cache[index] = payload;
+}
 
-		it = it->next;
-	}	
+static void clip_clear(void)
+{
+	for (uint8_t i = 0; i < _clip_count; ++i)
+		payload_release(_clip[i]);
 
-	sys_fsys_close(file_chan);
-	return;
+	_clip_count = 0;
 }
 
 
-/** Painting **/
+/** Packed Text **/
 
-static uint16_t get_line_number(line_t *current)
+static pack_t *pack_alloc(uint16_t size)
 {
-	if (current == _buffer_line)
-		return _height - 1;
+	uint8_t cls = (size + PACK_CLASS_SIZE - 1) / PACK_CLASS_SIZE;
+	pack_t *pack = _pack_cache[cls - 1];
 
-	line_t * line = _scroll.line;
-	uint16_t line_number = 0;
+	if (pack != 0)
+	{
+		_pack_cache[cls - 1] = pack->next;
+	}
+	else
+	{
+		pack = (pack_t *)mem_alloc(sizeof(pack_t) + cls * PACK_CLASS_SIZE - 1);
+		if (pack == 0)
+			return 0;
+	}
 
-	while (line != 0 && line != current)
+	pack->cls = cls;
+	pack->size = size;
+	return pack;
+}
+
+static void pack_free(pack_t *pack)
+{
+	for (uint8_t i = 0; i < PACK_CACHE_COUNT; ++i)
 	{
-		line = line->next;
-		++line_number;
+		if (_pack_slots[i].pack == pack)
+			_pack_slots[i].pack = 0;
 	}
 
-	return line_number;
+	_pack_bytes -= pack->size;
+	_pack_text -= pack->bytes;
+
+	pack->next = _pack_cache[pack->cls - 1];
+	_pack_cache[pack->cls - 1] = pack;
 }
 
-static uint16_t get_current_line_number(void)
+// Allocates the work buffers the first time packing is used
+static bool pack_init(void)
 {
-	return get_line_number(_cursor.line);
+	if (_pack_out != 0)
+		return true;
+
+	for (uint8_t i = 0; i < PACK_CACHE_COUNT; ++i)
+	{
+		if (_pack_slots[i].text == 0)
+			_pack_slots[i].text = (uint8_t *)mem_alloc(PACK_MAX_BYTES);
+		if (_pack_slots[i].text == 0)
+			return false;
+	}
+
+	_pack_hash = (uint16_t *)mem_alloc(PACK_HASH_SIZE * sizeof(uint16_t));
+	_pack_chain = (uint16_t *)mem_alloc(PACK_MAX_BYTES * sizeof(uint16_t));
+	if (_pack_hash == 0 || _pack_chain == 0)
+		return false;
+
+	_pack_out = (uint8_t *)mem_alloc(PACK_OUT_SIZE);
+	return _pack_out != 0;
 }
 
-static void update_cursor(void)
+static uint16_t pack_hash(const uint8_t *text)
 {
-	line_t *line = _cursor.line;
+	return ((text[0] << 6) ^ (text[1] << 3) ^ text[2]) & (PACK_HASH_SIZE - 1);
+}
 
-	_cursor_x = _in_buffer ? _buffer_prompt_len : 0;
+// Remembers a position under the hash of the bytes that start there. Positions
+// are stored plus one, so 0 ends a chain.
+static void pack_index(const uint8_t *text, uint16_t pos)
+{
+	uint16_t hash = pack_hash(text + pos);
 
-	for (uint8_t i = 0; i < _cursor.offset; ++i)
+	_pack_chain[pos] = _pack_hash[hash];
+	_pack_hash[hash] = pos + 1;
+}
+
+// Compresses text into _pack_out and returns the compressed size. Every flag
+// byte tells for the eight items after it if they are a literal byte or a two
+// byte match of 12 bits of distance and 4 bits of length.
+static uint16_t pack_compress(const uint8_t *text, uint16_t len)
+{
+	uint8_t *out = _pack_out;
+	uint8_t *flags = 0;
+	uint8_t bit = 0;
+	uint16_t pos = 0;
+
+	memset(_pack_hash, 0, PACK_HASH_SIZE * sizeof(uint16_t));
+
+	while (pos < len)
 	{
-		uint8_t ch = line->data[i];
+		uint16_t match_len = 0;
+		uint16_t distance = 0;
 
-		if (ch == '\t')
+		if (bit == 0)
 		{
-			uint8_t tab_count = _cursor_x / 2;
-			_cursor_x = (tab_count + 1) * 2;
+			flags = out++;
+			*flags = 0;
+			bit = 1;
+		}
+
+		if (pos + PACK_MIN_MATCH <= len)
+		{
+			uint16_t max = len - pos < PACK_MAX_MATCH ? len - pos : PACK_MAX_MATCH;
+			uint16_t candidate = _pack_hash[pack_hash(text + pos)];
+
+			// Take the longest of the most recent matches
+			for (uint8_t depth = 0; depth < PACK_CHAIN_DEPTH && candidate != 0 && pos - (candidate - 1) <= PACK_WINDOW; ++depth)
+			{
+				const uint8_t *from = text + candidate - 1;
+				uint16_t n = 0;
+
+				while (n < max && from[n] == text[pos + n])
+					++n;
+
+				if (n > match_len)
+				{
+					match_len = n;
+					distance = pos - (candidate - 1);
+					if (n == max)
+						break;
+				}
+
+				candidate = _pack_chain[candidate - 1];
+			}
+
+			pack_index(text, pos);
+		}
+
+		if (match_len >= PACK_MIN_MATCH)
+		{
+			*flags |= bit;
+			*out++ = (distance - 1) >> 4;
+			*out++ = ((distance - 1) << 4) | (match_len - PACK_MIN_MATCH);
+
+			// Index the bytes inside the match too, so later text can refer to them
+			for (uint16_t i = 1; i < match_len && pos + i + PACK_MIN_MATCH <= len; ++i)
+				pack_index(text, pos + i);
+
+			pos += match_len;
 		}
 		else
 		{
-			++_cursor_x;
+			*out++ = text[pos++];
 		}
+
+		bit <<= 1;
 	}
 
-	_cursor_y = get_current_line_number();
-	con_set_xy(_cursor_x, _cursor_y);
+	return out - _pack_out;
 }
 
-
-static void display_line(line_t *line)
+static void pack_decompress(const pack_t *pack, uint8_t *text)
 {
-	uint8_t pos = 0;
-	for (uint8_t i = 0; i < _width; ++i)
+	const uint8_t *in = pack->data;
+	uint16_t pos = 0;
+
+	while (pos < pack->bytes)
 	{
-		if (i < line->len)
-		{
-			uint8_t ch = line->data[i];
+		uint8_t flags = *in++;
 
-			if (ch == '\t')
+		for (uint8_t i = 0; i < 8 && pos < pack->bytes; ++i, flags >>= 1)
+		{
+			if (flags & 1)
 			{
-				uint8_t tab_count = pos / 2;
-				uint8_t new_pos = (tab_count + 1) * 2;
+				uint16_t distance = ((in[0] << 4) | (in[1] >> 4)) + 1;
+				uint8_t len = (in[1] & 0x0F) + PACK_MIN_MATCH;
 
-				while (pos < new_pos)
-				{
-					++pos;
-					con_out_raw(' ');
-				}
+				in += 2;
+				for (uint8_t j = 0; j < len; ++j, ++pos)
+					text[pos] = text[pos - distance];
 			}
 			else
 			{
-				++pos;
-				con_out_raw(ch);
+				text[pos++] = *in++;
 			}
 		}
-		else
+	}
+}
+
+// Returns a cache slot to hold the text of a pack, the least recently used
+// one if the pack is not cached
+static pack_slot_t *pack_slot(pack_t *pack)
+{
+	pack_slot_t *oldest = &_pack_slots[0];
+
+	for (uint8_t i = 0; i < PACK_CACHE_COUNT; ++i)
+	{
+		pack_slot_t *slot = &_pack_slots[i];
+
+		if (slot->pack == pack && pack != 0)
 		{
-			con_out_raw(' ');
+			slot->stamp = ++_pack_clock;
+			return slot;
 		}
+
+		if (slot->stamp < oldest->stamp)
+			oldest = slot;
 	}
+
+	oldest->pack = 0;
+	oldest->stamp = ++_pack_clock;
+	return oldest;
 }
 
-static void redisplay_current_line(void)
+// Returns the text of a pack, unpacking it unless it is cached
+static const uint8_t *pack_text(pack_t *pack)
 {
-	if (_in_buffer)
+	pack_slot_t *slot = pack_slot(pack);
+
+	if (slot->pack != pack)
+	{
+		pack_decompress(pack, slot->text);
+		slot->pack = pack;
+	}
+
+	return slot->text;
+}
+
+
+/** Undo Journal **/
+
+static uint8_t undo_get(uint16_t pos)
+{
+	return _undo_arena[pos & (UNDO_ARENA_SIZE - 1)];
+}
+
+static void undo_put(uint16_t pos, uint8_t value)
+{
+	_undo_arena[pos & (UNDO_ARENA_SIZE - 1)] = value;
+}
+
+static uint16_t undo_get16(uint16_t pos)
+{
+	return (undo_get(pos) << 8) | undo_get(pos + 1);
+}
+
+static void undo_put16(uint16_t pos, uint16_t value)
+{
+	undo_put(pos, value >> 8);
+	undo_put(pos + 1, value);
+}
+
+static uint32_t undo_get32(uint16_t pos)
+{
+	return ((uint32_t)undo_get16(pos) << 16) | undo_get16(pos + 2);
+}
+
+static void undo_put32(uint16_t pos, uint32_t value)
+{
+	undo_put16(pos, value >> 16);
+	undo_put16(pos + 2, value);
+}
+
+static payload_t *undo_get_payload(uint16_t pos)
+{
+	payload_t *payload;
+	uint8_t *bytes = (uint8_t *)&payload;
+
+	for (uint8_t i = 0; i < sizeof(payload); ++i)
+		bytes[i] = undo_get(pos + i);
+
+	return payload;
+}
+
+static void undo_put_payload(uint16_t pos, payload_t *payload)
+{
+	uint8_t *bytes = (uint8_t *)&payload;
+
+	for (uint8_t i = 0; i < sizeof(payload); ++i)
+		undo_put(pos + i, bytes[i]);
+}
+
+static uint16_t undo_record_size(uint16_t start)
+{
+	return UNDO_HEADER_SIZE + undo_get16(start + 2) + UNDO_FOOTER_SIZE;
+}
+
+static bool undo_is_lines(uint16_t start)
+{
+	uint8_t kind = undo_get(start) & UNDO_KIND_MASK;
+	return kind == UNDO_PUT_LINES || kind == UNDO_CUT_LINES;
+}
+
+// Drops the references a record holds on shared text before it is removed
+static void undo_release(uint16_t start)
+{
+	if (!undo_is_lines(start))
+		return;
+
+	uint16_t len = undo_get16(start + 2);
+	for (uint16_t i = 0; i < len; i += sizeof(payload_t *))
+		payload_release(undo_get_payload(start + UNDO_HEADER_SIZE + i));
+}
+
+static void undo_reset(void)
+{
+	for (uint16_t pos = _undo_tail; pos != _undo_head; pos += undo_record_size(pos))
+		undo_release(pos);
+
+	_undo_tail = 0;
+	_undo_current = 0;
+	_undo_head = 0;
+	_undo_used = 0;
+	_undo_records = 0;
+	_undo_open_end.line = 0;
+	_undo_file_pending = false;
+	_undo_lost = false;
+}
+
+static void undo_close(void)
+{
+	_undo_open_end.line = 0;
+}
+
+// Evicts the oldest record, and the records linked to it, so that what is left
+// of a group is never undone on its own
+static void undo_evict_oldest(void)
+{
+	do
+	{
+		uint16_t size = undo_record_size(_undo_tail);
+
+		undo_release(_undo_tail);
+
+		if (_undo_current == _undo_tail)
+			_undo_current += size;
+
+		_undo_tail += size;
+		_undo_used -= size;
+		_undo_records--;
+	}
+	while (_undo_tail != _undo_head && (undo_get(_undo_tail) & UNDO_LINKED) != 0);
+}
+
+// Returns true if a record in the history keeps lines alive. Only those hold
+// memory outside the arena.
+static bool undo_holds_lines(void)
+{
+	for (uint16_t pos = _undo_tail; pos != _undo_head; pos += undo_record_size(pos))
+	{
+		if (undo_is_lines(pos))
+			return true;
+	}
+
+	return false;
+}
+
+// Drops the records that could be redone, since a new edit replaces them
+static void undo_truncate_redo(void)
+{
+	while (_undo_head != _undo_current)
+	{
+		uint16_t size = undo_get16(_undo_head - UNDO_FOOTER_SIZE);
+
+		undo_release(_undo_head - size);
+
+		_undo_head -= size;
+		_undo_used -= size;
+		_undo_records--;
+	}
+}
+
+// Evicts the oldest history until size more bytes fit. A linked record does
+// not evict the group it belongs to. Returns false if the record can never
+// fit.
+static bool undo_make_room(uint16_t size, bool linked)
+{
+	if (size > UNDO_ARENA_SIZE)
+		return false;
+
+	while (UNDO_ARENA_SIZE - _undo_used < size)
+	{
+		if (linked && _undo_tail == _undo_group)
+			return false;
+
+		undo_evict_oldest();
+	}
+
+	return true;
+}
+
+// Starts a record and returns the position of its text, which the caller fills
+// in before calling undo_end_record.
+static uint16_t undo_begin_record(uint8_t kind, uint32_t line_no, uint8_t offset, uint16_t len)
+{
+	uint16_t start = _undo_head;
+
+	undo_put(start, kind);
+	undo_put(start + 1, offset);
+	undo_put16(start + 2, len);
+	undo_put32(start + 4, line_no);
+
+	_undo_open = start;
+	return start + UNDO_HEADER_SIZE;
+}
+
+static void undo_end_record(void)
+{
+	uint16_t size = undo_record_size(_undo_open);
+
+	undo_put16(_undo_open + size - UNDO_FOOTER_SIZE, size);
+
+	_undo_head = _undo_open + size;
+	_undo_current = _undo_head;
+	_undo_used += size;
+	_undo_records++;
+}
+
+static bool undo_is_recording(line_t *line)
+{
+	return !_undo_suspended && line != _buffer_line;
+}
+
+// Numbers a line by searching both ways from the line numbered last, since
+// undo records tend to follow each other through the document. Edits that
+// move lines keep the cached number valid or forget it.
+static uint32_t doc_line_number(line_t *line)
+{
+	line_t *ahead = _numbered_line;
+	line_t *behind = _numbered_line;
+	uint32_t ahead_no = _numbered_no;
+	uint32_t behind_no = _numbered_no;
+
+	if (line == 0)
+		ahead = behind = 0;
+
+	while (ahead != 0 || behind != 0)
+	{
+		if (ahead == line)
+		{
+			_numbered_no = ahead_no;
+			break;
+		}
+		if (behind == line)
+		{
+			_numbered_no = behind_no;
+			break;
+		}
+
+		if (ahead != 0)
+		{
+			ahead_no += line_count(ahead);
+			ahead = ahead->next;
+		}
+		if (behind != 0)
+		{
+			behind = behind->prev;
+			if (behind != 0)
+				behind_no -= line_count(behind);
+		}
+	}
+
+	if (ahead == 0 && behind == 0)
+	{
+		uint32_t line_no = 0;
+
+		for (line_t *it = _document_first_line; it != 0 && it != line; it = it->next)
+			line_no += line_count(it);
+
+		if (line == 0)
+			return line_no;
+		_numbered_no = line_no;
+	}
+
+	_numbered_line = line;
+	return _numbered_no;
+}
+
+// Called after an edit that added or removed the lines after a line. The lines
+// up to it keep their numbers, so the cached one is kept if it is that line.
+static void doc_lines_moved(line_t *line)
+{
+	if (_numbered_line != line)
+		_numbered_line = 0;
+}
+
+// Appends text to a record. Only the newest record can grow, the footer moves
+// along with it.
+static void undo_append(const uint8_t *text, uint16_t len)
+{
+	uint16_t pos = _undo_head - UNDO_FOOTER_SIZE;
+	uint16_t old_len = undo_get16(_undo_open + 2);
+
+	for (uint16_t i = 0; i < len; ++i)
+		undo_put(pos + i, text[i]);
+
+	undo_put16(_undo_open + 2, old_len + len);
+	undo_put16(pos + len, UNDO_HEADER_SIZE + old_len + len + UNDO_FOOTER_SIZE);
+
+	_undo_head += len;
+	_undo_current = _undo_head;
+	_undo_used += len;
+}
+
+// Makes room to grow the open record by len bytes without evicting it.
+// Returns false if the record should be closed instead.
+static bool undo_can_grow(uint16_t len)
+{
+	if (_undo_open_end.line == 0 || _undo_current != _undo_head)
+		return false;
+
+	if (undo_get16(_undo_open + 2) + len + 1 > UNDO_MAX_RUN)
+		return false;
+
+	while (UNDO_ARENA_SIZE - _undo_used < len + 1)
+	{
+		if (_undo_tail == _undo_open)
+			return false;
+
+		undo_evict_oldest();
+	}
+
+	return true;
+}
+
+// Turns a lone split or join into an insert or delete of a newline so it can
+// take more text.
+static void undo_open_as_run(uint8_t kind)
+{
+	uint8_t open_kind = undo_get(_undo_open) & UNDO_KIND_MASK;
+	uint8_t newline = '\n';
+
+	if (open_kind == UNDO_SPLIT || open_kind == UNDO_JOIN)
+	{
+		undo_put(_undo_open, (undo_get(_undo_open) & UNDO_LINKED) | kind);
+		undo_append(&newline, 1);
+	}
+}
+
+// Stores a complete record for text that is already in one buffer. A group of
+// linked records that does not fit in the ring is dropped along with the rest
+// of the history, as undoing only part of it would leave the edit half done.
+static void undo_record_text(uint8_t kind, uint32_t line_no, uint8_t offset, const uint8_t *text, uint16_t len)
+{
+	bool linked = (kind & UNDO_LINKED) != 0;
+
+	undo_load_pending();
+	undo_truncate_redo();
+	undo_close();
+
+	if (linked && _undo_lost)
+		return;
+
+	_undo_lost = false;
+
+	if (!undo_make_room(UNDO_HEADER_SIZE + len + UNDO_FOOTER_SIZE, linked))
+	{
+		undo_reset();
+		_undo_lost = linked;
+		return;
+	}
+
+	if (!linked)
+		_undo_group = _undo_head;
+
+	uint16_t pos = undo_begin_record(kind, line_no, offset, len);
+	for (uint16_t i = 0; i < len; ++i)
+		undo_put(pos + i, text[i]);
+
+	undo_end_record();
+}
+
+static void undo_record_insert(location_t at, const uint8_t *text, uint16_t len)
+{
+	if (!undo_is_recording(at.line))
+		return;
+
+	undo_load_pending();
+
+	uint8_t open_kind = undo_get(_undo_open) & UNDO_KIND_MASK;
+
+	// Typing at the end of the last insert extends it
+	if (at.line == _undo_open_end.line && at.offset == _undo_open_end.offset && (open_kind == UNDO_INSERT || open_kind == UNDO_SPLIT) && undo_can_grow(len))
+	{
+		undo_open_as_run(UNDO_INSERT);
+		undo_append(text, len);
+		return;
+	}
+
+	uint32_t line_no = doc_line_number(at.line);
+
+	if (len == 1 && text[0] == '\n')
+		undo_record_text(UNDO_SPLIT, line_no, at.offset, 0, 0);
+	else
+		undo_record_text(UNDO_INSERT, line_no, at.offset, text, len);
+}
+
+static uint16_t undo_range_length(location_t from, location_t to)
+{
+	uint16_t len = 0;
+
+	for (line_t *it = from.line; it != to.line; it = it->next)
+		len += it->len + 1;
+
+	return len - from.offset + to.offset;
+}
+
+// Copies the document text between two locations into the ring
+static void undo_put_range(uint16_t pos, location_t from, location_t to)
+{
+	line_t *line = from.line;
+	uint8_t offset = from.offset;
+
+	while (true)
+	{
+		uint8_t end = line == to.line ? to.offset : line->len;
+
+		while (offset < end)
+			undo_put(pos++, line->data[offset++]);
+
+		if (line == to.line)
+			break;
+
+		undo_put(pos++, '\n');
+		line = line->next;
+		offset = 0;
+	}
+}
+
+static void undo_record_delete(location_t from, location_t to)
+{
+	if (!undo_is_recording(from.line))
+		return;
+
+	undo_load_pending();
+
+	uint16_t len = undo_range_length(from, to);
+	uint8_t open_kind = undo_get(_undo_open) & UNDO_KIND_MASK;
+
+	// Backspacing from the start of the last delete extends it at the front
+	if (to.line == _undo_open_end.line && to.offset == _undo_open_end.offset && (open_kind == UNDO_DELETE || open_kind == UNDO_JOIN) && undo_can_grow(len))
+	{
+		undo_open_as_run(UNDO_DELETE);
+
+		uint16_t text = _undo_open + UNDO_HEADER_SIZE;
+		uint16_t old_len = undo_get16(_undo_open + 2);
+		uint32_t line_no = undo_get32(_undo_open + 4);
+
+		// Grow the record and shift the old text up to make room at the front
+		_undo_head += len;
+		_undo_current = _undo_head;
+		_undo_used += len;
+
+		for (uint16_t i = old_len; i > 0; --i)
+			undo_put(text + len + i - 1, undo_get(text + i - 1));
+
+		undo_put_range(text, from, to);
+
+		for (uint16_t i = 0; i < len; ++i)
+		{
+			if (undo_get(text + i) == '\n')
+				--line_no;
+		}
+
+		undo_put(_undo_open + 1, from.offset);
+		undo_put16(_undo_open + 2, old_len + len);
+		undo_put32(_undo_open + 4, line_no);
+		undo_put16(_undo_head - UNDO_FOOTER_SIZE, UNDO_HEADER_SIZE + old_len + len + UNDO_FOOTER_SIZE);
+		return;
+	}
+
+	uint32_t line_no = doc_line_number(from.line);
+	uint16_t size = UNDO_HEADER_SIZE + len + UNDO_FOOTER_SIZE;
+
+	undo_truncate_redo();
+	undo_close();
+
+	if (!undo_make_room(size, false))
+	{
+		undo_reset();
+		return;
+	}
+
+	if (len == 1 && from.line != to.line)
+	{
+		undo_begin_record(UNDO_JOIN, line_no, from.offset, 0);
+	}
+	else
+	{
+		uint16_t pos = undo_begin_record(UNDO_DELETE, line_no, from.offset, len);
+		undo_put_range(pos, from, to);
+	}
+
+	undo_end_record();
+}
+
+// Stores whole lines that were put into or cut from the document. The record
+// keeps a reference to the text of every line instead of a copy.
+static void undo_record_lines(uint8_t kind, uint32_t line_no, payload_t **payloads, uint8_t count)
+{
+	if (_undo_suspended)
+		return;
+
+	undo_load_pending();
+	undo_truncate_redo();
+	undo_close();
+
+	uint16_t len = count * sizeof(payload_t *);
+	if (!undo_make_room(UNDO_HEADER_SIZE + len + UNDO_FOOTER_SIZE, false))
+	{
+		undo_reset();
+		return;
+	}
+
+	uint16_t pos = undo_begin_record(kind, line_no, 0, len);
+	for (uint8_t i = 0; i < count; ++i)
+		undo_put_payload(pos + i * sizeof(payload_t *), payload_ref(payloads[i]));
+
+	undo_end_record();
+}
+
+// Marks where the next edit has to happen to join the record just written
+static void undo_set_open_end(location_t end)
+{
+	if (undo_is_recording(end.line))
+		_undo_open_end = end;
+}
+
+
+/** Undo File **/
+
+// The history of a document is kept in a file next to it, named after the
+// document with ".und" added. It starts with a version, a hash of the text the
+// history belongs to and the record counts, followed by the records oldest
+// first. Line numbers are stored as the difference to the previous record and
+// all numbers are varints, so typical records take a few bytes plus their text.
+
+static uint32_t doc_hash_update(uint32_t hash, const uint8_t *data, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; ++i)
+		hash = (hash ^ data[i]) * 16777619;
+
+	return hash;
+}
+
+// Writes a line and its newline to a channel, unless it is negative, and
+// returns the hash updated with them
+static uint32_t doc_write_line(short chan, uint32_t hash, const uint8_t *text, uint8_t len, bool newline)
+{
+	uint8_t ch = '\n';
+
+	if (chan >= 0)
+	{
+		sys_chan_write(chan, (uint8_t *)text, len);
+		if (newline)
+			sys_chan_write_b(chan, ch);
+	}
+
+	hash = doc_hash_update(hash, text, len);
+	return newline ? doc_hash_update(hash, &ch, 1) : hash;
+}
+
+// Writes the document to a channel and returns its hash, or only hashes it if
+// the channel is negative. Pages that are not loaded are read straight from
+// the file or their pack, so nothing is allocated. The text is static as this
+// also runs when the heap is full, deep down in an edit.
+static uint32_t doc_write(short chan)
+{
+	static uint8_t text[LINE_MAX_LEN];
+	uint32_t hash = DOC_HASH_SEED;
+
+	for (line_t *it = _document_first_line; it != 0; it = it->next)
+	{
+		if (it->flags & LINE_STUB)
+		{
+			uint8_t lines = line_count(it);
+			uint32_t pos = 0;
+
+			for (uint8_t i = 0; i < lines; ++i)
+			{
+				uint8_t len = stub_read_line(it, &pos, text);
+				hash = doc_write_line(chan, hash, text, len, i + 1 < lines || it->next != 0);
+			}
+		}
+		else
+		{
+			hash = doc_write_line(chan, hash, it->data, it->len, it->next != 0);
+		}
+	}
+
+	return hash;
+}
+
+static uint32_t doc_hash(void)
+{
+	return doc_write(-1);
+}
+
+static void undo_file_name(char *name)
+{
+	strcpy(name, _document_name);
+	strcat(name, ".und");
+}
+
+static void undo_file_flush(void)
+{
+	if (_undo_file_pos > 0)
+		sys_chan_write(_undo_file_chan, _undo_file_buffer, _undo_file_pos);
+
+	_undo_file_pos = 0;
+}
+
+static void undo_file_put(uint8_t value)
+{
+	if (_undo_file_pos == UNDO_FILE_BUFFER)
+		undo_file_flush();
+
+	_undo_file_buffer[_undo_file_pos++] = value;
+}
+
+static void undo_file_put_varint(uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		undo_file_put(value | 0x80);
+		value >>= 7;
+	}
+
+	undo_file_put(value);
+}
+
+// Returns the next byte of the file, or -1 at the end
+static int16_t undo_file_get(void)
+{
+	if (_undo_file_pos == _undo_file_count)
+	{
+		short count = sys_chan_read(_undo_file_chan, _undo_file_buffer, UNDO_FILE_BUFFER);
+		if (count <= 0)
+			return -1;
+
+		_undo_file_count = count;
+		_undo_file_pos = 0;
+	}
+
+	return _undo_file_buffer[_undo_file_pos++];
+}
+
+static bool undo_file_get_varint(uint32_t *value)
+{
+	*value = 0;
+
+	for (uint8_t shift = 0; shift < 32; shift += 7)
+	{
+		int16_t byte = undo_file_get();
+		if (byte < 0)
+			return false;
+
+		*value |= (uint32_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// Writes the history of the document that was just saved with the given hash.
+// An empty history removes the file instead.
+static void undo_save(uint32_t hash)
+{
+	char name[sizeof(_document_name) + 4];
+	uint32_t line_no = 0;
+	uint16_t redo = 0;
+
+	undo_file_name(name);
+
+	if (_undo_records == 0)
+	{
+		sys_fsys_delete(name);
+		return;
+	}
+
+	_undo_file_chan = sys_fsys_open(name, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+	if (_undo_file_chan < 0)
+		return;
+
+	for (uint16_t pos = _undo_current; pos != _undo_head; pos += undo_record_size(pos))
+		++redo;
+
+	_undo_file_pos = 0;
+	undo_file_put(UNDO_FILE_VERSION);
+	undo_file_put_varint(hash);
+	undo_file_put_varint(_undo_records);
+	undo_file_put_varint(redo);
+
+	for (uint16_t pos = _undo_tail; pos != _undo_head; pos += undo_record_size(pos))
+	{
+		uint16_t len = undo_get16(pos + 2);
+		uint32_t record_line = undo_get32(pos + 4);
+		int32_t delta = (int32_t)(record_line - line_no);
+
+		undo_file_put(undo_get(pos));
+		undo_file_put_varint(delta < 0 ? ((uint32_t)~delta << 1) | 1 : (uint32_t)delta << 1);
+		undo_file_put(undo_get(pos + 1));
+
+		if (undo_is_lines(pos))
+		{
+			// Shared lines are written as their text, a newline after each
+			uint16_t text_len = 0;
+			for (uint16_t i = 0; i < len; i += sizeof(payload_t *))
+				text_len += undo_get_payload(pos + UNDO_HEADER_SIZE + i)->len + 1;
+
+			undo_file_put_varint(text_len);
+
+			for (uint16_t i = 0; i < len; i += sizeof(payload_t *))
+			{
+				payload_t *payload = undo_get_payload(pos + UNDO_HEADER_SIZE + i);
+
+				for (uint8_t j = 0; j < payload->len; ++j)
+					undo_file_put(payload->data[j]);
+				undo_file_put('\n');
+			}
+		}
+		else
+		{
+			undo_file_put_varint(len);
+
+			for (uint16_t i = 0; i < len; ++i)
+				undo_file_put(undo_get(pos + UNDO_HEADER_SIZE + i));
+		}
+
+		line_no = record_line;
+	}
+
+	undo_file_flush();
+	sys_fsys_close(_undo_file_chan);
+}
+
+// Reads the text of a record of whole lines into new payloads
+static bool undo_load_lines(uint8_t kind, uint32_t line_no, uint32_t len)
+{
+	uint8_t text[LINE_MAX_LEN];
+	uint8_t count = 0;
+	uint8_t text_len = 0;
+	bool valid = true;
+
+	for (uint32_t i = 0; i < len && valid; ++i)
+	{
+		int16_t byte = undo_file_get();
+
+		if (byte == '\n' && count < CLIP_MAX_LINES)
+		{
+			_undo_lines[count++] = payload_new(text, text_len);
+			text_len = 0;
+		}
+		else if (byte >= 0 && byte != '\n' && text_len < LINE_MAX_LEN)
+		{
+			text[text_len++] = byte;
+		}
+		else
+		{
+			valid = false;
+		}
+	}
+
+	uint16_t size = count * sizeof(payload_t *);
+
+	if (valid && text_len == 0 && count > 0 && undo_make_room(UNDO_HEADER_SIZE + size + UNDO_FOOTER_SIZE, false))
+	{
+		uint16_t pos = undo_begin_record(kind, line_no, 0, size);
+		for (uint8_t i = 0; i < count; ++i)
+			undo_put_payload(pos + i * sizeof(payload_t *), _undo_lines[i]);
+		undo_end_record();
+		return true;
+	}
+
+	for (uint8_t i = 0; i < count; ++i)
+		payload_release(_undo_lines[i]);
+
+	return false;
+}
+
+// Reads the records of a history file into the empty ring. Returns false if
+// the file is damaged or does not belong to the current text.
+static bool undo_load(void)
+{
+	uint32_t hash, records, redo, line_no = 0;
+
+	if (undo_file_get() != UNDO_FILE_VERSION || !undo_file_get_varint(&hash) || hash != doc_hash())
+		return false;
+
+	if (!undo_file_get_varint(&records) || !undo_file_get_varint(&redo) || redo > records)
+		return false;
+
+	for (uint32_t i = 0; i < records; ++i)
+	{
+		int16_t kind = undo_file_get();
+		int16_t offset;
+		uint32_t delta, len;
+
+		if (kind < 0 || !undo_file_get_varint(&delta) || (offset = undo_file_get()) < 0 || !undo_file_get_varint(&len))
+			return false;
+
+		if ((kind & UNDO_KIND_MASK) < UNDO_INSERT || (kind & UNDO_KIND_MASK) > UNDO_CUT_LINES || len > UNDO_ARENA_SIZE - UNDO_HEADER_SIZE - UNDO_FOOTER_SIZE)
+			return false;
+
+		line_no += (delta & 1) ? ~(delta >> 1) : delta >> 1;
+
+		if ((kind & UNDO_KIND_MASK) >= UNDO_PUT_LINES)
+		{
+			if (!undo_load_lines(kind, line_no, len))
+				return false;
+			continue;
+		}
+
+		undo_make_room(UNDO_HEADER_SIZE + len + UNDO_FOOTER_SIZE, false);
+		uint16_t pos = undo_begin_record(kind, line_no, offset, len);
+		for (uint16_t j = 0; j < len; ++j)
+		{
+			int16_t byte = undo_file_get();
+			if (byte < 0)
+				return false;
+
+			undo_put(pos + j, byte);
+		}
+		undo_end_record();
+	}
+
+	// Step back over the records that were undone when the file was saved
+	for (uint32_t i = 0; i < redo && _undo_current != _undo_tail; ++i)
+		_undo_current -= undo_get16(_undo_current - UNDO_FOOTER_SIZE);
+
+	return true;
+}
+
+// Reads the history of the opened document the first time the journal is
+// needed, so opening a file never waits on it. Until then the document still
+// holds the text the history was saved with.
+static void undo_load_pending(void)
+{
+	char name[sizeof(_document_name) + 4];
+
+	if (!_undo_file_pending)
+		return;
+
+	_undo_file_pending = false;
+
+	undo_file_name(name);
+	_undo_file_chan = sys_fsys_open(name, FILE_MODE_READ);
+	if (_undo_file_chan < 0)
+		return;
+
+	_undo_file_pos = 0;
+	_undo_file_count = 0;
+
+	if (!undo_load())
+		undo_reset();
+
+	sys_fsys_close(_undo_file_chan);
+}
+
+
+/** Line and Document **/
+
+static line_t *get_line_cache(uint16_t *size)
+{
+	if (*size == 0)
+	{
+		return &_line_cache_0;
+	}
+	else if (*size <= 8)
+	{
+		*size = 8;
+		return &_line_cache_8;
+	}
+	else if (*size <= 32)
+	{
+		*size = 32;
+		return &_line_cache_32;
+	}
+	else if (*size <= 64)
+	{
+		*size = 64;
+		return &_line_cache_64;
+	}
+	else if (*size <= 128)
+	{
+		*size = 128;
+		return &_line_cache_128;
+	}
+	else
+	{
+		error("Requested line to large");
+	}
+}
+
+static line_t *new_line_from_cache(line_t *cache, uint16_t size)
+{
+	line_t *line = 0;
+	if (cache->next == 0)
+	{
+		line = (line_t*)heap_alloc(sizeof(line_t) + size);
+	}
+	else
+	{
+		line = cache->next;
+		cache->next = line->next;
+	}
+
+	// A shared line pointed its data at a payload, so this is set every time
+	line->data = (uint8_t *)(line + 1);
+	line->cap = size;
+	line->len = 0;
+	line->flags = 0;
+	line->prev = 0;
+	line->next = 0;
+
+	return line;
+}
+
+static line_t *alloc_line(uint16_t size)
+{
+	line_t *cache = get_line_cache(&size);
+	return new_line_from_cache(cache, size);
+}
+
+static payload_t *line_payload(line_t *line)
+{
+	return (payload_t *)(line->data - offsetof(payload_t, data));
+}
+
+static void free_line(line_t *line)
+{
+	uint16_t size = line->cap;
+	line_t *cache = get_line_cache(&size);
+
+	page_forget(line);
+
+	// Views are part of the loaded file and are reused with it
+	if (line->flags & LINE_VIEW)
+		return;
+
+	if (line->flags & LINE_SHARED)
+		payload_release(line_payload(line));
+	if (line->flags & LINE_PACKED)
+		pack_free(line_pack(line));
+
+	line->next = cache->next;
+	cache->next = line;
+}
+
+// Links a new line in place of an old one and moves every reference to the
+// old line over
+static void relink_line(line_t *old, line_t *line)
+{
+	line->prev = old->prev;
+	line->next = old->next;
+
+	if (line->prev != 0)
+		line->prev->next = line;
+	if (line->next != 0)
+		line->next->prev = line;
+
+	if (_document_first_line == old)
+		_document_first_line = line;
+	if (_buffer_line == old)
+		_buffer_line = line;
+	if (_scroll.line == old)
+		_scroll.line = line;
+	if (_cursor.line == old)
+		_cursor.line = line;
+	if (_buffer_old_cursor.line == old)
+		_buffer_old_cursor.line = line;
+	if (_undo_open_end.line == old)
+		_undo_open_end.line = line;
+	if (_compact_line == old)
+		_compact_line = line;
+	if (_numbered_line == old)
+		_numbered_line = line;
+}
+
+// Links a new line in place of an old one and frees the old one
+static void replace_line(line_t *old, line_t *line)
+{
+	relink_line(old, line);
+	free_line(old);
+}
+
+
+// A shared line points at the text of a payload and has no capacity of its
+// own, so every edit that writes to it goes through a new line first. Its cap
+// of 0 is not enough to tell, an edit that leaves it empty fits in that, so
+// the writers check LINE_SHARED as well.
+static line_t *alloc_shared_line(payload_t *payload)
+{
+	line_t *line = alloc_line(0);
+
+	line->data = payload_ref(payload)->data;
+	line->len = payload->len;
+	line->flags = LINE_SHARED;
+
+	return line;
+}
+
+// Allocates a line holding a copy of the text. Short lines share an interned
+// payload instead.
+static line_t *alloc_text_line(const uint8_t *text, uint8_t len)
+{
+	line_t *line;
+
+	if (len == 0)
+	{
+		if (_empty_payload == 0)
+			_empty_payload = payload_new((const uint8_t *)"", 0);
+
+		return alloc_shared_line(_empty_payload);
+	}
+
+	if (len <= INTERN_MAX_LEN)
+	{
+		payload_t *payload = payload_new(text, len);
+
+		line = alloc_shared_line(payload);
+		payload_release(payload);
+		return line;
+	}
+
+	line = alloc_line(len);
+	memcpy(line->data, text, len);
+	line->len = len;
+	return line;
+}
+
+
+static void free_document(void)
+{
+	page_reset();
+	_compact_line = 0;
+	_numbered_line = 0;
+
+	if (_document_first_line != 0)
+	{
+		line_t *it = _document_first_line;
+		while (it != 0)
+		{
+			line_t *to_free = it;
+			it = it->next;
+
+			free_line(to_free);
+		}
+	}
+
+	_document_first_line = 0;
+}
+
+static void doc_new(void)
+{
+	free_document();
+
+	_document_first_line = alloc_text_line(0, 0);
+	memset(_document_name, 0, sizeof(_document_name));
+
+	undo_reset();
+
+	_scroll.line = _document_first_line;
+	_scroll.offset = 0;
+	_cursor.line = _document_first_line;
+	_cursor.offset = 0;
+}
+
+// Moves references to a line that is about to be freed onto a location that
+// stays in the document.
+static void forget_line(line_t *line, location_t to)
+{
+	if (_scroll.line == line)
+		_scroll.line = to.line;
+	if (_cursor.line == line)
+		_cursor = to;
+	if (_buffer_old_cursor.line == line)
+		_buffer_old_cursor = to;
+	if (_compact_line == line)
+		_compact_line = to.line;
+}
+
+
+// Turns a line into a shared one in place. Returns a reference to its text
+// that the caller has to release.
+static payload_t *line_share(line_t **line)
+{
+	line_t *old = *line;
+
+	if (old->flags & LINE_SHARED)
+		return payload_ref(line_payload(old));
+
+	payload_t *payload = payload_new(old->data, old->len);
+	line_t *shared = alloc_shared_line(payload);
+
+	shared->flags |= old->flags & LINE_CLEAN;
+	replace_line(old, shared);
+
+	*line = shared;
+	return payload;
+}
+
+// Copies a shared line into one that can be written to
+static line_t *line_own(line_t *line)
+{
+	PERF_COUNT(PERF_GROW_LINE);
+
+	line_t *own = alloc_line(line->len);
+
+	memcpy(own->data, line->data, line->len);
+	own->len = line->len;
+	replace_line(line, own);
+
+	return own;
+}
+
+// Inserts text at a location, splitting lines at every newline in the text.
+// Each touched line is allocated at most once. Returns the location just
+// after the inserted text, or one with a null line if a line would end up
+// longer than LINE_MAX_LEN, in which case nothing is changed.
+static location_t doc_insert(location_t at, const uint8_t *text, uint16_t len)
+{
+	location_t end = {0};
+	line_t *line = at.line;
+	uint8_t tail_len = line->len - at.offset;
+	uint16_t first_len = 0;
+	uint16_t last_start = 0;
+	uint16_t newlines = 0;
+
+	// Find the first and last segments and check every line fits
+	for (uint16_t i = 0; i < len; ++i)
+	{
+		if (text[i] != '\n')
+			continue;
+
+		if (newlines == 0)
+			first_len = i;
+		else if (i - last_start > LINE_MAX_LEN)
+			return end;
+
+		++newlines;
+		last_start = i + 1;
+	}
+
+	if (newlines == 0)
+	{
+		if (line->len + len > LINE_MAX_LEN)
+			return end;
+
+		undo_record_insert(at, text, len);
+
+		if (line->len + len > line->cap || (line->flags & LINE_SHARED))
+		{
+			PERF_COUNT(PERF_GROW_LINE);
+
+			line_t *new_line = alloc_line(line->len + len);
+			memcpy(new_line->data, line->data, at.offset);
+			memcpy(new_line->data + at.offset + len, line->data + at.offset, tail_len);
+			new_line->len = line->len;
+			replace_line(line, new_line);
+			line = new_line;
+		}
+		else
+		{
+			memmove(line->data + at.offset + len, line->data + at.offset, tail_len);
+		}
+
+		memcpy(line->data + at.offset, text, len);
+		line->len += len;
+		line->flags &= ~LINE_CLEAN;
+
+		end.line = line;
+		end.offset = at.offset + len;
+		undo_set_open_end(end);
+		return end;
+	}
+
+	uint16_t last_len = len - last_start;
+	if (at.offset + first_len > LINE_MAX_LEN || last_len + tail_len > LINE_MAX_LEN)
+		return end;
+
+	undo_record_insert(at, text, len);
+
+	// The last line takes the text after the insertion point
+	line_t *last;
+	if (tail_len == 0 || last_len == 0)
+	{
+		last = tail_len == 0 ? alloc_text_line(text + last_start, last_len) : alloc_text_line(line->data + at.offset, tail_len);
+	}
+	else
+	{
+		last = alloc_line(last_len + tail_len);
+		memcpy(last->data, text + last_start, last_len);
+		memcpy(last->data + last_len, line->data + at.offset, tail_len);
+		last->len = last_len + tail_len;
+	}
+
+	if (at.offset + first_len > line->cap || (line->flags & LINE_SHARED))
+	{
+		PERF_COUNT(PERF_GROW_LINE);
+
+		line_t *new_line = alloc_line(at.offset + first_len);
+		memcpy(new_line->data, line->data, at.offset);
+		replace_line(line, new_line);
+		line = new_line;
+	}
+
+	memcpy(line->data + at.offset, text, first_len);
+	line->len = at.offset + first_len;
+	line->flags &= ~LINE_CLEAN;
+
+	// Link the middle lines and the last line after the first one
+	line_t *prev = line;
+	line_t *next = line->next;
+	uint16_t pos = first_len + 1;
+
+	while (pos < last_start)
+	{
+		uint16_t seg_end = pos;
+		while (text[seg_end] != '\n')
+			++seg_end;
+
+		line_t *mid = alloc_text_line(text + pos, seg_end - pos);
+
+		mid->prev = prev;
+		prev->next = mid;
+		prev = mid;
+
+		pos = seg_end + 1;
+	}
+
+	last->prev = prev;
+	prev->next = last;
+	last->next = next;
+	if (next != 0)
+		next->prev = last;
+	doc_lines_moved(line);
+
+	end.line = last;
+	end.offset = last_len;
+	undo_set_open_end(end);
+	return end;
+}
+
+// Deletes the text between two locations, joining the first and last line.
+// Returns the location where the text was, or one with a null line if the
+// joined line would be longer than LINE_MAX_LEN, in which case nothing is
+// changed.
+static location_t doc_delete(location_t from, location_t to)
+{
+	location_t at = {0};
+	line_t *line = from.line;
+
+	if (from.line == to.line)
+	{
+		undo_record_delete(from, to);
+
+		if (line->flags & LINE_SHARED)
+		{
+			line = line_own(line);
+			from.line = line;
+		}
+
+		memmove(line->data + from.offset, line->data + to.offset, line->len - to.offset);
+		line->len -= to.offset - from.offset;
+		line->flags &= ~LINE_CLEAN;
+
+		undo_set_open_end(from);
+		return from;
+	}
+
+	uint8_t tail_len = to.line->len - to.offset;
+	if (from.offset + tail_len > LINE_MAX_LEN)
+		return at;
+
+	undo_record_delete(from, to);
+
+	if (from.offset + tail_len > line->cap || (line->flags & LINE_SHARED))
+	{
+		PERF_COUNT(PERF_GROW_LINE);
+
+		line_t *new_line = alloc_line(from.offset + tail_len);
+		memcpy(new_line->data, line->data, from.offset);
+		replace_line(line, new_line);
+		line = new_line;
+	}
+
+	memcpy(line->data + from.offset, to.line->data + to.offset, tail_len);
+	line->len = from.offset + tail_len;
+	line->flags &= ~LINE_CLEAN;
+
+	at.line = line;
+	at.offset = from.offset;
+
+	// Unlink and free every line after the first, up to and including the last
+	line_t *it = line->next;
+	line_t *last = to.line;
+	line->next = last->next;
+	if (last->next != 0)
+		last->next->prev = line;
+
+	while (true)
+	{
+		line_t *next = it->next;
+
+		forget_line(it, at);
+		free_line(it);
+
+		if (it == last)
+			break;
+
+		it = next;
+	}
+	doc_lines_moved(line);
+
+	undo_set_open_end(at);
+	return at;
+}
+
+// Puts shared lines into the document before a line number, or after the last
+// line if the number is past the end. Returns the first new line.
+static line_t *doc_put_lines(uint32_t line_no, payload_t **payloads, uint8_t count)
+{
+	location_t at = doc_location(line_no, 0);
+	uint32_t at_no = doc_line_number(at.line);
+	line_t *prev = at.line->prev;
+	line_t *next = at.line;
+
+	if (at_no < line_no)
+	{
+		line_no = at_no + 1;
+		prev = at.line;
+		next = 0;
+	}
+
+	undo_record_lines(UNDO_PUT_LINES, line_no, payloads, count);
+
+	line_t *first = 0;
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		line_t *line = alloc_shared_line(payloads[i]);
+
+		line->prev = prev;
+		if (prev != 0)
+			prev->next = line;
+		else
+			_document_first_line = line;
+
+		if (first == 0)
+			first = line;
+		prev = line;
+	}
+
+	prev->next = next;
+	if (next != 0)
+		next->prev = prev;
+
+	_numbered_line = first;
+	_numbered_no = line_no;
+	return first;
+}
+
+// Removes whole lines from the document, sharing their text into payloads
+// that the caller has to release. Returns the line that took their place.
+static line_t *doc_cut_lines(line_t *line, uint8_t count, payload_t **payloads)
+{
+	uint32_t line_no = doc_line_number(line);
+	line_t *first = 0;
+	line_t *last = line;
+
+	for (uint8_t i = 0; i < count; ++i)
+	{
+		if (i > 0)
+			last = line_next(last);
+
+		payloads[i] = line_share(&last);
+		if (first == 0)
+			first = last;
+	}
+
+	undo_record_lines(UNDO_CUT_LINES, line_no, payloads, count);
+
+	line_t *prev = line_prev(first);
+	line_t *next = line_next(last);
+	location_t to = {0};
+
+	if (prev != 0)
+		prev->next = next;
+	else
+		_document_first_line = next;
+	if (next != 0)
+		next->prev = prev;
+
+	// The document always keeps at least one line
+	to.line = next != 0 ? next : prev;
+	if (to.line == 0)
+	{
+		to.line = alloc_text_line(0, 0);
+		_document_first_line = to.line;
+	}
+
+	// The line after the cut takes over its number
+	_numbered_line = next;
+	_numbered_no = line_no;
+
+	last->next = 0;
+	while (first != 0)
+	{
+		line_t *it = first;
+		first = first->next;
+
+		forget_line(it, to);
+		free_line(it);
+	}
+
+	return to.line;
+}
+
+
+/** Paged Documents **/
+
+static void page_reset(void)
+{
+	if (_page_chan >= 0)
+		sys_fsys_close(_page_chan);
+
+	_page_chan = -1;
+
+	while (_resident_count > 0)
+	{
+		if (_resident[--_resident_count].pack != 0)
+			pack_free(_resident[_resident_count].pack);
+	}
+
+	for (uint8_t i = 0; i < BLOCK_COUNT; ++i)
+		_blocks[i].index = 0xFFFFFFFF;
+}
+
+// Returns a block of the file, reading it into the least recently used slot
+// if it is not cached
+static block_t *block_get(uint32_t index)
+{
+	block_t *oldest = &_blocks[0];
+
+	for (uint8_t i = 0; i < BLOCK_COUNT; ++i)
+	{
+		block_t *block = &_blocks[i];
+
+		if (block->index == index)
+		{
+			block->stamp = ++_block_clock;
+			return block;
+		}
+
+		if (block->stamp < oldest->stamp)
+			oldest = block;
+	}
+
+	short count = -1;
+	if (sys_chan_seek(_page_chan, index * BLOCK_SIZE, CDEV_SEEK_ABSOLUTE) >= 0)
+		count = sys_chan_read(_page_chan, oldest->data, BLOCK_SIZE);
+
+	oldest->index = index;
+	oldest->len = count > 0 ? count : 0;
+	oldest->stamp = ++_block_clock;
+	return oldest;
+}
+
+static line_t *page_new_stub(page_t *page)
+{
+	line_t *stub = alloc_line(sizeof(page_t));
+
+	memcpy(stub->data, page, sizeof(page_t));
+	stub->flags = LINE_STUB;
+	return stub;
+}
+
+static line_t *pack_new_stub(pack_t *pack)
+{
+	line_t *stub = alloc_line(0);
+
+	stub->data = (uint8_t *)pack;
+	stub->flags = LINE_STUB | LINE_PACKED;
+	return stub;
+}
+
+// Links a chain of lines in place of another chain
+static void page_splice(line_t *old_first, line_t *old_last, line_t *first, line_t *last)
+{
+	// Both chains hold the same lines, only a number cached inside is lost
+	if (_numbered_line == old_first)
+		_numbered_line = first;
+	else
+	{
+		for (line_t *it = old_first->next; it != 0 && it != old_last->next; it = it->next)
+			if (it == _numbered_line)
+				_numbered_line = 0;
+	}
+
+	first->prev = old_first->prev;
+	last->next = old_last->next;
+
+	if (first->prev != 0)
+		first->prev->next = first;
+	else
+		_document_first_line = first;
+
+	if (last->next != 0)
+		last->next->prev = last;
+}
+
+// Called when a line is freed. If it was the first or last line of a loaded
+// page the page has been edited, so it is no longer tracked.
+static void page_forget(line_t *line)
+{
+	for (uint8_t i = 0; i < _resident_count; ++i)
+	{
+		if (_resident[i].first == line || _resident[i].last == line)
+		{
+			if (_resident[i].pack != 0)
+				pack_free(_resident[i].pack);
+
+			_resident[i] = _resident[--_resident_count];
+			return;
+		}
+	}
+}
+
+// Reads the next line of a page into text and returns its length. Lines end
+// at a newline, when they are full, or at the end of the page.
+static uint8_t page_read_line(uint32_t *pos, uint32_t end, uint8_t *text)
+{
+	uint8_t len = 0;
+
+	while (*pos < end)
+	{
+		block_t *block = block_get(*pos / BLOCK_SIZE);
+		uint16_t index = *pos % BLOCK_SIZE;
+
+		// The file got shorter since it was indexed
+		if (index >= block->len)
+		{
+			*pos = end;
+			break;
+		}
+
+		uint8_t ch = block->data[index];
+
+		if (ch == '\n')
+		{
+			++*pos;
+			break;
+		}
+
+		if (ch != '\r')
+		{
+			if (len == LINE_MAX_LEN)
+				break;
+
+			text[len++] = ch;
+		}
+
+		++*pos;
+	}
+
+	return len;
+}
+
+// Reads the next line of a stub, from the file or from its pack. The position
+// starts at 0 for the first line.
+static uint8_t stub_read_line(line_t *stub, uint32_t *pos, uint8_t *text)
+{
+	uint8_t len = 0;
+
+	if (stub->flags & LINE_PACKED)
+	{
+		pack_t *pack = line_pack(stub);
+		const uint8_t *it = pack_text(pack);
+
+		while (*pos < pack->bytes && it[*pos] != '\n')
+			text[len++] = it[(*pos)++];
+
+		++*pos;
+		return len;
+	}
+
+	page_t page = line_page(stub);
+	uint32_t at = page.offset + *pos;
+
+	len = page_read_line(&at, page.offset + page.bytes, text);
+	*pos = at - page.offset;
+	return len;
+}
+
+// Most memory loading the page behind a stub can take. Each line has a node
+// and either an interned payload or text rounded up to at most twice its
+// length.
+static unsigned long page_expand_size(line_t *stub)
+{
+	unsigned long lines;
+	unsigned long bytes;
+
+	if (stub->flags & LINE_PACKED)
+	{
+		lines = line_pack(stub)->lines;
+		bytes = line_pack(stub)->bytes;
+	}
+	else
+	{
+		lines = line_page(stub).lines;
+		bytes = line_page(stub).bytes;
+	}
+
+	return lines * (sizeof(line_t) + sizeof(payload_t) + INTERN_MAX_LEN + 2 * MEM_GRAIN) + 2 * bytes;
+}
+
+// Whether the page behind a stub can be loaded without touching the reserve.
+// The nodes kept for reuse are given up first if that helps.
+static bool page_fits(line_t *stub)
+{
+	unsigned long size = page_expand_size(stub);
+
+	while (mem_free() < size && compact_drain(COMPACT_STEP) == 0)
+		;
+
+	return mem_free() >= size;
+}
+
+// Reads the page behind a stub from the file or unpacks it, and links its
+// lines in place of the stub. Returns the first line of the page.
+static line_t *page_expand(line_t *stub)
+{
+	page_t page = {0};
+	pack_t *pack = 0;
+	uint8_t text[LINE_MAX_LEN];
+	line_t *first = 0;
+	line_t *last = 0;
+	uint32_t pos = 0;
+
+	// A pack is kept while its lines are loaded, so they can be packed again
+	// without compressing them if they are not edited
+	if (stub->flags & LINE_PACKED)
+	{
+		pack = line_pack(stub);
+		page.lines = pack->lines;
+	}
+	else
+	{
+		page = line_page(stub);
+	}
+
+	for (uint8_t i = 0; i < page.lines; ++i)
+	{
+		uint8_t len = stub_read_line(stub, &pos, text);
+
+		line_t *line = alloc_text_line(text, len);
+		line->flags |= LINE_CLEAN;
+
+		line->prev = last;
+		if (last != 0)
+			last->next = line;
+		else
+			first = line;
+
+		last = line;
+	}
+
+	page_splice(stub, stub, first, last);
+	stub->flags &= ~LINE_PACKED;
+	free_line(stub);
+
+	if (_resident_count < PAGE_TABLE_SIZE)
+	{
+		resident_t *entry = &_resident[_resident_count++];
+
+		entry->first = first;
+		entry->last = last;
+		entry->page = page;
+		entry->pack = pack;
+		entry->stamp = ++_page_clock;
+	}
+	else if (pack != 0)
+	{
+		pack_free(pack);
+	}
+
+	return first;
+}
+
+// Returns the next line, loading its page if needed
+static line_t *line_next(line_t *line)
+{
+	line_t *next = line->next;
+
+	if (next != 0 && (next->flags & LINE_STUB))
+		next = page_expand(next);
+
+	return next;
+}
+
+// Returns the previous line, loading its page if needed
+static line_t *line_prev(line_t *line)
+{
+	if (line->prev != 0 && (line->prev->flags & LINE_STUB))
+		page_expand(line->prev);
+
+	return line->prev;
+}
+
+static line_t *doc_first_line(void)
+{
+	if (_document_first_line->flags & LINE_STUB)
+		return page_expand(_document_first_line);
+
+	return _document_first_line;
+}
+
+static line_t *doc_last_line(void)
+{
+	line_t *line = _document_first_line;
+
+	while (line->next != 0)
+		line = line->next;
+
+	if (line->flags & LINE_STUB)
+	{
+		line = page_expand(line);
+		while (line->next != 0)
+			line = line->next;
+	}
+
+	return line;
+}
+
+static bool page_in_use(line_t *line, line_t *keep, line_t *bottom)
+{
+	return line == keep || line == bottom || line == _scroll.line || line == _cursor.line ||
+		line == _buffer_old_cursor.line || line == _highlight.line || line == _undo_open_end.line ||
+		line == _search_origin.line || line == _search_origin_scroll || line == _search_match.line ||
+		line == _compact_line;
+}
+
+// Turns a loaded page back into a stub unless one of its lines is in use. A
+// page with edited lines is dropped from the table, it stays in memory until
+// the document is saved.
+static void page_collapse(uint8_t index, line_t *keep, line_t *bottom)
+{
+	resident_t entry = _resident[index];
+	line_t *line = entry.first;
+	line_t *last = 0;
+
+	for (uint8_t i = 0; i < entry.page.lines; ++i)
+	{
+		if (line == 0 || !(line->flags & LINE_CLEAN) || (i + 1 == entry.page.lines && line != entry.last))
+		{
+			if (entry.pack != 0)
+				pack_free(entry.pack);
+
+			_resident[index] = _resident[--_resident_count];
+			return;
+		}
+
+		if (page_in_use(line, keep, bottom))
+		{
+			_resident[index].stamp = ++_page_clock;
+			return;
+		}
+
+		last = line;
+		line = line->next;
+	}
+
+	_resident[index] = _resident[--_resident_count];
+
+	line_t *stub = entry.pack != 0 ? pack_new_stub(entry.pack) : page_new_stub(&entry.page);
+	page_splice(entry.first, last, stub, stub);
+
+	line = entry.first;
+	while (true)
+	{
+		line_t *next = line->next;
+
+		free_line(line);
+		if (line == last)
+			break;
+
+		line = next;
+	}
+}
+
+// Drops the least recently loaded clean pages until at most max are left. The
+// pages on screen, the ones the editor points into and the page holding keep
+// are left alone.
+static void page_trim_to(line_t *keep, uint8_t max)
+{
+	if (_resident_count <= max)
+		return;
+
+	line_t *bottom = _scroll.line;
+	for (int16_t row = 1; row < _height - 1 && bottom->next != 0 && !(bottom->next->flags & LINE_STUB); ++row)
+		bottom = bottom->next;
+
+	for (uint8_t tries = _resident_count; tries > 0 && _resident_count > max; --tries)
+	{
+		uint8_t oldest = 0;
+
+		for (uint8_t i = 1; i < _resident_count; ++i)
+		{
+			if (_resident[i].stamp < _resident[oldest].stamp)
+				oldest = i;
+		}
+
+		page_collapse(oldest, keep, bottom);
+	}
+}
+
+static void page_trim(line_t *keep)
+{
+	page_trim_to(keep, PAGE_RESIDENT_MAX);
+}
+
+// Closes the current page and links a stub for it after last
+static line_t *page_append(line_t *last, page_t *page, uint32_t end)
+{
+	page->bytes = end - page->offset;
+
+	line_t *stub = page_new_stub(page);
+	stub->prev = last;
+	if (last != 0)
+		last->next = stub;
+	else
+		_document_first_line = stub;
+
+	page->offset = end;
+	page->lines = 0;
+	return stub;
+}
+
+// Indexes a whole file in one pass, building a stub for every PAGE_LINES
+// lines. Long lines are wrapped the same way doc_open does. The file stays
+// open for the pages to be read from.
+static void page_index(short chan, uint16_t *wrapped)
+{
+	static uint8_t chunk[LOAD_CHUNK_SIZE];
+	page_t page = {0};
+	line_t *last = 0;
+	uint32_t pos = 0;
+	uint8_t column = 0;
+
+	page_reset();
+	_page_chan = chan;
+
+	while (true)
+	{
+		short count = sys_chan_read(chan, chunk, sizeof(chunk));
+		if (count <= 0)
+			break;
+
+		for (short i = 0; i < count; ++i, ++pos)
+		{
+			uint8_t ch = chunk[i];
+
+			if (ch == '\r')
+				continue;
+
+			if (ch == '\n')
+			{
+				column = 0;
+				if (++page.lines == PAGE_LINES || pos + 1 - page.offset >= PAGE_MAX_BYTES)
+					last = page_append(last, &page, pos + 1);
+				continue;
+			}
+
+			// The byte starts a new line when the current one is full
+			if (column == LINE_MAX_LEN)
+			{
+				column = 0;
+				++*wrapped;
+				if (++page.lines == PAGE_LINES || pos - page.offset >= PAGE_MAX_BYTES)
+					last = page_append(last, &page, pos);
+			}
+
+			++column;
+		}
+	}
+
+	++page.lines;
+	page_append(last, &page, pos);
+}
+
+// Compresses a run of lines into a packed stub linked in their place. The
+// text is gathered into a cache slot, so it is cached for the new pack.
+static bool pack_lines(line_t *first, line_t *last, uint8_t count)
+{
+	pack_slot_t *slot = pack_slot(0);
+	uint16_t bytes = 0;
+
+	for (line_t *it = first; ; it = it->next)
+	{
+		memcpy(slot->text + bytes, it->data, it->len);
+		bytes += it->len;
+		slot->text[bytes++] = '\n';
+
+		if (it == last)
+			break;
+	}
+
+	uint16_t size = pack_compress(slot->text, bytes);
+	pack_t *pack = pack_alloc(size);
+	if (pack == 0)
+		return false;
+
+	memcpy(pack->data, _pack_out, size);
+	pack->bytes = bytes;
+	pack->lines = count;
+	slot->pack = pack;
+
+	_pack_bytes += size;
+	_pack_text += bytes;
+
+	line_t *stub = pack_new_stub(pack);
+	page_splice(first, last, stub, stub);
+
+	line_t *it = first;
+	while (true)
+	{
+		line_t *next = it->next;
+
+		free_line(it);
+		if (it == last)
+			break;
+
+		it = next;
+	}
+
+	return true;
+}
+
+// Packs every run of lines that is off the screen by more than a screen and
+// not in use. Loaded pages that are still clean are left for page_trim.
+static void pack_document(line_t *keep)
+{
+	uint32_t scroll_no = doc_line_number(_scroll.line);
+	uint32_t hot_first = scroll_no > (uint32_t)_height ? scroll_no - _height : 0;
+	uint32_t hot_end = scroll_no + 2 * _height;
+	uint32_t line_no = 0;
+	uint16_t skip = 0;
+	line_t *first = 0;
+	uint8_t count = 0;
+	uint16_t bytes = 0;
+
+	for (line_t *it = _document_first_line; it != 0; )
+	{
+		line_t *next = it->next;
+		uint16_t lines = line_count(it);
+		bool cold = false;
+
+		if ((it->flags & LINE_CLEAN) && skip == 0)
+		{
+			for (uint8_t i = 0; i < _resident_count; ++i)
+			{
+				if (_resident[i].first == it)
+					skip = _resident[i].page.lines;
+			}
+		}
+
+		if (skip > 0)
+			--skip;
+		else if (!(it->flags & (LINE_STUB | LINE_VIEW)) && (line_no < hot_first || line_no >= hot_end))
+			cold = !page_in_use(it, keep, 0);
+
+		// A run ends at a line that is not cold or does not fit
+		if (count > 0 && (!cold || bytes + it->len + 1 > PACK_MAX_BYTES))
+		{
+			if (count >= PACK_MIN_LINES && !pack_lines(first, it->prev, count))
+				return;
+
+			count = 0;
+		}
+
+		if (cold)
+		{
+			if (count++ == 0)
+			{
+				first = it;
+				bytes = 0;
+			}
+
+			bytes += it->len + 1;
+		}
+
+		if (count > 0 && (count == PACK_LINES || next == 0))
+		{
+			if (count >= PACK_MIN_LINES && !pack_lines(first, it, count))
+				return;
+
+			count = 0;
+		}
+
+		line_no += lines;
+		it = next;
+	}
+}
+
+
+/** Compaction **/
+
+// Gives up to work nodes kept for reuse back to the heap. Returns the work
+// left over.
+static uint8_t compact_drain(uint8_t work)
+{
+	for (uint8_t i = 0; i < LINE_CLASSES; ++i)
+	{
+		while (work > 0 && _line_caches[i]->next != 0)
+		{
+			line_t *line = _line_caches[i]->next;
+
+			_line_caches[i]->next = line->next;
+			mem_release(line, sizeof(line_t) + line->cap);
+			--work;
+		}
+	}
+
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		while (work > 0 && _payload_cache[i] != 0)
+		{
+			payload_t *payload = _payload_cache[i];
+
+			_payload_cache[i] = payload->next;
+			mem_release(payload, sizeof(payload_t) + payload->cap - 1);
+			--work;
+		}
+	}
+
+	for (uint8_t i = 0; i < PACK_CLASSES; ++i)
+	{
+		while (work > 0 && _pack_cache[i] != 0)
+		{
+			pack_t *pack = _pack_cache[i];
+
+			_pack_cache[i] = pack->next;
+			mem_release(pack, sizeof(pack_t) + pack->cls * PACK_CLASS_SIZE - 1);
+			--work;
+		}
+	}
+
+	return work;
+}
+
+// Moves a line into the smallest size that holds it, if that is smaller or
+// lower in memory than where it is. A lower place is looked for in no more
+// than limit free blocks. Returns the line where it ends up.
+static line_t *compact_move(line_t *line, unsigned long limit)
+{
+	if ((line->flags & (LINE_STUB | LINE_VIEW | LINE_CLEAN)) || page_in_use(line, 0, 0))
+		return line;
+
+	// A shared line only has its node to move
+	uint16_t size = (line->flags & LINE_SHARED) ? 0 : line->len;
+	get_line_cache(&size);
+
+	line_t *moved;
+	if (size < line->cap)
+		moved = (line_t *)mem_alloc(sizeof(line_t) + size);
+	else
+		moved = (line_t *)mem_alloc_below(line, sizeof(line_t) + size, limit);
+	if (moved == 0)
+		return line;
+
+	*moved = *line;
+	moved->cap = size;
+	if (!(line->flags & LINE_SHARED))
+	{
+		moved->data = (uint8_t *)(moved + 1);
+		memcpy(moved->data, line->data, line->len);
+	}
+
+	relink_line(line, moved);
+	page_forget(line);
+	mem_release(line, sizeof(line_t) + line->cap);
+	return moved;
+}
+
+// Does a bounded amount of compaction. Returns true while there is more to do.
+static bool compact_step(void)
+{
+	unsigned long visits = mem_visits();
+	uint8_t work = COMPACT_STEP;
+
+	// Each node given back walks the free list, so the walk is what bounds
+	// a step once the list is long
+	while (work > 0 && compact_drain(1) == 0)
+	{
+		if (--work == 0 || mem_visits() - visits >= COMPACT_STEP_NODES)
+			return true;
+	}
+
+	line_t *it = _compact_line != 0 ? _compact_line->next : _document_first_line;
+
+	while (it != 0 && work-- > 0 && mem_visits() - visits < COMPACT_STEP_NODES)
+	{
+		_compact_line = compact_move(it, COMPACT_STEP_NODES - (mem_visits() - visits));
+		it = _compact_line->next;
+	}
+
+	if (it == 0)
+	{
+		_compact_line = 0;
+		_compact_pending = false;
+	}
+
+	return _compact_pending;
+}
+
+// Reclaims memory after a command once less than MEM_LOW_WATER is free. Pages
+// are dropped and lines packed first, then the gaps are compacted away and
+// only then the oldest undo records are given up. The reserve is set aside
+// again as soon as there is room for it.
+static void compact_relieve(void)
+{
+	if (mem_free() < MEM_LOW_WATER)
+	{
+		page_trim_to(0, 0);
+
+		// The work buffers are not allocated just for this
+		if (_pack_out != 0)
+			pack_document(0);
+
+		while (compact_step())
+			;
+
+		if (!_undo_file_pending)
+		{
+			undo_close();
+			while (mem_free() < MEM_LOW_WATER && undo_holds_lines())
+				undo_evict_oldest();
+		}
+	}
+
+	if (_mem_reserve == 0 && mem_free() >= MEM_LOW_WATER + MEM_RESERVE_SIZE)
+		_mem_reserve = mem_alloc(MEM_RESERVE_SIZE);
+
+	_mem_critical = _mem_reserve == 0;
+}
+
+
+/** Heap Telemetry **/
+
+static uint8_t line_class(uint16_t cap)
+{
+	uint8_t cls = 0;
+
+	while (cls < LINE_CLASSES - 1 && cap > _line_class_size[cls])
+		++cls;
+	return cls;
+}
+
+// Walks the document and the caches for where the heap has gone. mem_free()
+// does not see the nodes parked in the caches, which are as good as free.
+static void heap_gather(heap_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	for (line_t *it = _document_first_line; it != 0; it = it->next)
+	{
+		if (it->flags & LINE_VIEW)
+		{
+			++stats->views;
+		}
+		else if (it->flags & (LINE_STUB | LINE_PACKED))
+		{
+			++stats->stubs;
+		}
+		else
+		{
+			++stats->lines[line_class(it->cap)];
+			if (!(it->flags & LINE_SHARED))
+				stats->wasted += it->cap - it->len;
+		}
+	}
+
+	for (uint8_t i = 0; i < LINE_CLASSES; ++i)
+	{
+		for (line_t *it = _line_caches[i]->next; it != 0; it = it->next)
+		{
+			++stats->cached[i];
+			stats->parked += sizeof(line_t) + it->cap;
+		}
+	}
+
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		for (payload_t *it = _payload_cache[i]; it != 0; it = it->next)
+			stats->parked += sizeof(payload_t) + it->cap - 1;
+	}
+
+	for (uint8_t i = 0; i < PACK_CLASSES; ++i)
+	{
+		for (pack_t *it = _pack_cache[i]; it != 0; it = it->next)
+			stats->parked += sizeof(pack_t) + it->cls * PACK_CLASS_SIZE - 1;
+	}
+}
+
+static void heap_write_value(short chan, const char *name, unsigned long value)
+{
+	char line[40];
+
+	snprintf(line, sizeof(line), "%s %lu\n", name, value);
+	sys_chan_write(chan, (uint8_t *)line, strlen(line));
+}
+
+// Writes the figures as "name value" lines, for scripts to compare
+static bool heap_write_report(char *path)
+{
+	heap_stats_t stats;
+	unsigned long largest;
+	unsigned long blocks = mem_free_blocks(&largest);
+	char name[24];
+
+	short file_chan = sys_fsys_open(path, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+	if (file_chan <= 0)
+		return false;
+
+	heap_gather(&stats);
+
+	heap_write_value(file_chan, "critical", _mem_critical);
+	heap_write_value(file_chan, "total", mem_total());
+	heap_write_value(file_chan, "free", mem_free());
+	heap_write_value(file_chan, "peak_used", mem_peak_used());
+	heap_write_value(file_chan, "parked", stats.parked);
+	heap_write_value(file_chan, "allocs", mem_alloc_count());
+	heap_write_value(file_chan, "releases", mem_release_count());
+	heap_write_value(file_chan, "free_blocks", blocks);
+	heap_write_value(file_chan, "largest_free_block", largest);
+
+	for (uint8_t i = 0; i < LINE_CLASSES; ++i)
+	{
+		snprintf(name, sizeof(name), "lines_%u", _line_class_size[i]);
+		heap_write_value(file_chan, name, stats.lines[i]);
+		snprintf(name, sizeof(name), "bytes_%u", _line_class_size[i]);
+		heap_write_value(file_chan, name, stats.lines[i] * (sizeof(line_t) + _line_class_size[i]));
+		snprintf(name, sizeof(name), "cached_%u", _line_class_size[i]);
+		heap_write_value(file_chan, name, stats.cached[i]);
+	}
+
+	heap_write_value(file_chan, "stubs", stats.stubs);
+	heap_write_value(file_chan, "views", stats.views);
+	heap_write_value(file_chan, "wasted", stats.wasted);
+	heap_write_value(file_chan, "shared_bytes", _shared_bytes);
+	heap_write_value(file_chan, "pack_bytes", _pack_bytes);
+	heap_write_value(file_chan, "pack_text", _pack_text);
+	heap_write_value(file_chan, "stack_used", stack_used());
+	heap_write_value(file_chan, "stack_size", stack_size());
+
+	sys_fsys_close(file_chan);
+	return true;
+}
+
+
+/** Loading and Saving **/
+
+// Loads the pages of a document again after it was saved over its own file,
+// keeping the view on the same lines. The edits are in the file now, so the
+// lines that held them are freed.
+static void doc_reindex(short chan)
+{
+	uint32_t scroll_no = doc_line_number(_scroll.line);
+	uint32_t cursor_no = doc_line_number(_cursor.line);
+	uint8_t offset = _cursor.offset;
+	uint16_t wrapped = 0;
+
+	free_document();
+	page_index(chan, &wrapped);
+
+	_scroll = doc_location(scroll_no, 0);
+	_cursor = doc_location(cursor_no, offset);
+	undo_close();
+}
+
+static void doc_save_as(void)
+{
+	char path[sizeof(_document_name) + 4];
+
+	buffer_close();
+	if (_buffer_line->len == 0)
+	{
+		display_statusbar("No filename specified");
+		return;
+	}
+
+	// The history has to be read while it still matches the old name
+	undo_load_pending();
+
+	// Copy new buffer filename
+	uint8_t name_len = _buffer_line->len < sizeof(_document_name) - 1 ? _buffer_line->len : sizeof(_document_name) - 1;
+	memcpy(_document_name, _buffer_line->data, name_len);
+	_document_name[name_len] = 0;
+
+	// A paged document is still reading from its file, so it is written to a
+	// temporary file that replaces the original afterwards
+	strcpy(path, _document_name);
+	if (_page_chan >= 0)
+		strcat(path, ".tmp");
+
+	short file_chan = sys_fsys_open(path, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+	if (file_chan <= 0)
+	{
+		display_statusbar("Could not save document to file");
+		return;
+	}
+
+	uint32_t hash = doc_write(file_chan);
+	sys_fsys_close(file_chan);
+
+	if (_page_chan >= 0)
+	{
+		page_reset();
+		sys_fsys_delete(_document_name);
+		sys_fsys_rename(path, _document_name);
+
+		file_chan = sys_fsys_open(_document_name, FILE_MODE_READ);
+		if (file_chan < 0)
+		{
+			doc_new();
+			redisplay_all();
+			display_statusbar("Saved, but could not open the file again");
+			return;
+		}
+
+		doc_reindex(file_chan);
+		redisplay_all();
+	}
+
+	undo_save(hash);
+	return;
+}
+
+// Writes the document to its name with ".sav" added, or to fte.sav if it has
+// none, and leaves the file it came from alone. Stores the name in path.
+static bool doc_save_copy(char *path)
+{
+	strcpy(path, _document_name[0] != 0 ? _document_name : "fte");
+	strcat(path, ".sav");
+
+	short file_chan = sys_fsys_open(path, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+	if (file_chan <= 0)
+		return false;
+
+	doc_write(file_chan);
+	sys_fsys_close(file_chan);
+	return true;
+}
+
+// Returns the size of a file from its directory entry, or -1 if it is missing
+static long file_size(const char *name)
+{
+	static t_file_info info;
+	char dir[sizeof(_document_name)];
+	const char *pattern = strrchr(name, '/');
+	uint8_t dir_len = 0;
+
+	if (pattern != 0)
+	{
+		dir_len = pattern - name;
+		if (dir_len == 0 || name[dir_len - 1] == ':')
+			++dir_len;
+		++pattern;
+	}
+	else
+	{
+		pattern = name;
+	}
+
+	memcpy(dir, name, dir_len);
+	dir[dir_len] = 0;
+
+	short handle = sys_fsys_findfirst(dir, pattern, &info);
+	if (handle < 0)
+		return -1;
+
+	sys_fsys_closedir(handle);
+	return info.size;
+}
+
+// Loads a whole file with one kernel call and makes every line a view into it.
+// Carriage returns are dropped in place and lines longer than LINE_MAX_LEN are
+// wrapped. Returns false if there is not enough memory or the load fails.
+static bool doc_load_image(const char *name, uint32_t size, uint16_t *wrapped)
+{
+	uint8_t *image = _doc_image;
+	line_t *views = _doc_views;
+	long start;
+
+	// New blocks are only taken over once the file is in, a failed load
+	// gives them back and leaves the old ones where they were
+	if (size > _doc_image_size || _doc_image == 0)
+	{
+		image = mem_alloc(size);
+		if (image == 0)
+			return false;
+	}
+
+	if (sys_fsys_load(name, (long)image, &start) < 0)
+	{
+		if (image != _doc_image)
+			mem_release(image, size);
+		return false;
+	}
+
+	// First pass drops carriage returns and counts the lines
+	uint8_t *end = image;
+	uint32_t count = 1;
+	uint8_t column = 0;
+
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		uint8_t ch = image[i];
+
+		if (ch == '\r')
+			continue;
+
+		if (ch == '\n')
+		{
+			++count;
+			column = 0;
+		}
+		else if (column == LINE_MAX_LEN)
+		{
+			++count;
+			++*wrapped;
+			column = 1;
+		}
+		else
+		{
+			++column;
+		}
+
+		*end++ = ch;
+	}
+
+	if (count > _doc_view_count)
+	{
+		views = mem_alloc(count * sizeof(line_t));
+		if (views == 0)
+		{
+			if (image != _doc_image)
+				mem_release(image, size);
+			return false;
+		}
+	}
+
+	// Second pass links a view for every line. The blocks of the last file
+	// are given back once its lines are gone.
+	free_document();
+
+	if (image != _doc_image)
+	{
+		if (_doc_image != 0)
+			mem_release(_doc_image, _doc_image_size);
+		_doc_image = image;
+		_doc_image_size = size;
+	}
+	if (views != _doc_views)
+	{
+		if (_doc_views != 0)
+			mem_release(_doc_views, _doc_view_count * sizeof(line_t));
+		_doc_views = views;
+		_doc_view_count = count;
+	}
+
+	line_t *prev = 0;
+	line_t *view = _doc_views;
+	uint8_t *line_start = _doc_image;
+
+	for (uint8_t *it = _doc_image; it <= end; ++it)
+	{
+		if (it != end && *it != '\n' && it - line_start < LINE_MAX_LEN)
+			continue;
+
+		view->prev = prev;
+		view->next = 0;
+		view->data = line_start;
+		view->len = it - line_start;
+		view->cap = view->len;
+		view->flags = LINE_VIEW;
+
+		if (prev != 0)
+			prev->next = view;
+		else
+			_document_first_line = view;
+
+		prev = view++;
+
+		// A wrapped line continues with the byte that did not fit
+		if (it != end && *it != '\n')
+			line_start = it--;
+		else
+			line_start = it + 1;
+	}
+
+	return true;
+}
+
+// Opens a file. Files up to DOC_PAGED_SIZE are loaded whole as views, larger
+// ones are indexed and their pages loaded as they are needed.
+static void doc_open(void)
+{
+	char msg[72];
+
+	buffer_close();
+	if (_buffer_line->len == 0)
+	{
+		display_statusbar("No filename specified");
+		return;
+	}
+
+	char name[sizeof(_document_name)];
+	uint8_t name_len = _buffer_line->len < sizeof(name) - 1 ? _buffer_line->len : sizeof(name) - 1;
+	memcpy(name, _buffer_line->data, name_len);
+	name[name_len] = 0;
+
+	long size = file_size(name);
+	if (size < 0)
+	{
+		display_statusbar("Could not open file");
+		return;
+	}
+
+	uint16_t wrapped = 0;
+
+	doc_new();
+
+	if (size > DOC_PAGED_SIZE)
+	{
+		short file_chan = sys_fsys_open(name, FILE_MODE_READ);
+		if (file_chan < 0)
+		{
+			display_statusbar("Could not open file");
+			return;
+		}
+
+		free_document();
+		page_index(file_chan, &wrapped);
+	}
+	else if (!doc_load_image(name, size, &wrapped))
+	{
+		doc_new();
+		redisplay_all();
+		display_statusbar("Could not load file");
+		return;
+	}
+
+	memcpy(_document_name, name, name_len + 1);
+	_undo_file_pending = true;
+
+	_cursor.line = doc_first_line();
+	_cursor.offset = 0;
+	_scroll.line = _cursor.line;
+
+	redisplay_all();
+
+	if (wrapped > 0)
+		snprintf(msg, sizeof(msg), "Opened %s%s, %u long lines wrapped", _document_name, _page_chan >= 0 ? " paged" : "", wrapped);
+	else
+		snprintf(msg, sizeof(msg), "Opened %s%s", _document_name, _page_chan >= 0 ? " paged" : "");
+	display_statusbar(msg);
+}
+
+
+/** Painting **/
+
+static uint16_t get_line_number(line_t *current)
+{
+	if (current == _buffer_line)
+		return _height - 1;
+
+	line_t * line = _scroll.line;
+	uint16_t line_number = 0;
+
+	while (line != 0 && line != current)
+	{
+		line = line_next(line);
+		++line_number;
+	}
+
+	return line_number;
+}
+
+static uint16_t get_current_line_number(void)
+{
+	return get_line_number(_cursor.line);
+}
+
+static void update_cursor(void)
+{
+	if (_paint_suppressed)
+		return;
+
+	line_t *line = _cursor.line;
+
+	_cursor_x = _in_buffer ? _buffer_prompt_len : 0;
+
+	for (uint8_t i = 0; i < _cursor.offset; ++i)
+	{
+		uint8_t ch = line->data[i];
+
+		if (ch == '\t')
+		{
+			uint8_t tab_count = _cursor_x / 2;
+			_cursor_x = (tab_count + 1) * 2;
+		}
+		else
+		{
+			++_cursor_x;
+		}
+	}
+
+	_cursor_y = get_current_line_number();
+	con_set_xy(_cursor_x, _cursor_y);
+}
+
+
+static void display_line(line_t *line)
+{
+	uint8_t pos = 0;
+	uint8_t highlight_start = 255;
+	uint8_t highlight_end = 255;
+
+	PERF_COUNT(PERF_LINES_RENDERED);
+
+	if (line == _highlight.line && _highlight_len > 0)
+	{
+		highlight_start = _highlight.offset;
+		highlight_end = _highlight.offset + _highlight_len;
+	}
+
+	for (uint8_t i = 0; i < _width; ++i)
+	{
+		if (i == highlight_start)
+			con_set_color(CON_COLOR_BLUE, CON_COLOR_GREY);
+		else if (i == highlight_end)
+			con_set_color(CON_COLOR_GREY, CON_COLOR_BLUE);
+
+		if (i < line->len)
+		{
+			uint8_t ch = line->data[i];
+
+			if (ch == '\t')
+			{
+				uint8_t tab_count = pos / 2;
+				uint8_t new_pos = (tab_count + 1) * 2;
+
+				while (pos < new_pos)
+				{
+					++pos;
+					con_out_raw(' ');
+				}
+			}
+			else
+			{
+				++pos;
+				con_out_raw(ch);
+			}
+		}
+		else
+		{
+			con_out_raw(' ');
+		}
+	}
+
+	if (highlight_start != 255)
+		con_set_color(CON_COLOR_GREY, CON_COLOR_BLUE);
+}
+
+// Returns the screen row of a document line, or -1 if it is not in view
+static int16_t get_visible_row(line_t *line)
+{
+	line_t *it = _scroll.line;
+
+	for (int16_t row = 0; it != 0 && row < (_height - 1); ++row)
+	{
+		if (it == line)
+			return row;
+
+		it = line_next(it);
+	}
+
+	return -1;
+}
+
+static void redisplay_line(line_t *line)
+{
+	if (_paint_suppressed)
+		return;
+
+	int16_t row = get_visible_row(line);
+	if (row >= 0)
+	{
+		con_set_xy(0, row);
+		display_line(line);
+	}
+}
+
+static void redisplay_current_line(void)
+{
+	if (_paint_suppressed)
+		return;
+
+	if (_in_buffer)
+	{
+		display_statusbar(0);
+	}
+	else
+	{
+		uint16_t line_number = get_line_number(_cursor.line);
+		con_set_xy(0, line_number);
+		display_line(_cursor.line);
+	}
+
+	update_cursor();
+}
+
+static void redisplay_all(void)
+{
+	if (_paint_suppressed)
+		return;
+
+	con_set_xy(0, 0);
+
+	uint16_t line_number = 0;
+	uint8_t x = _cursor.offset;
+	line_t *it = _scroll.line;
+
+	while (it != 0 && line_number < (_height - 1))
+	{
+		display_line(it);
+		con_newline();
+		
+		line_number++;
+		it = line_next(it);
+	}
+
+	// Clear rows left over from a longer document
+	while (line_number < (_height - 1))
+	{
+		con_clear_line();
+		con_newline();
+
+		line_number++;
+	}
+
+	update_cursor();
+}
+
+static void redisplay_line_down(line_t *line)
+{
+	if (_paint_suppressed)
+		return;
+
+	uint16_t line_number = get_line_number(line);
+	con_set_xy(0, line_number);
+
+	while (line != 0 && line_number < (_height - 1))
+	{
+		display_line(line);
+		con_newline();
+
+		line_number++;
+		line = line_next(line);
+	}
+
+	while (line_number < (_height - 1))
+	{
+		con_clear_line();
+		con_newline();
+
+		line_number++;
+	}
+
+	update_cursor();
+}
+
+static void display_statusbar(char * msg)
+{
+	if (_paint_suppressed)
+		return;
+
+	if (!_in_buffer)
+		_statusbar_message = true;
+
+	con_set_xy(0, _height - 1);
+	con_set_color(CON_COLOR_BLUE, CON_COLOR_GREY);
+
+	if (_in_buffer)
+	{
+		con_write(_buffer_prompt, _buffer_prompt_len);
+		display_line(_buffer_line);
+	}
+	else
+	{
+		int len = strlen(msg);
+		if (len > _width - 1)
+			len = _width - 1;
+		con_clear_line();
+		con_out(' ');
+		con_write(msg, len);
+	}
+	con_set_color(CON_COLOR_GREY, CON_COLOR_BLUE);
+	con_set_xy(_cursor_x, _cursor_y);
+}
+
+/** Buffer Handling **/
+
+static void buffer_close(void)
+{
+	_in_buffer = false;
+	_cursor = _buffer_old_cursor;
+	_current_commands = _basic_commands;
+
+	update_cursor();
+}
+
+static void buffer_set_prompt(char *prompt)
+{
+	_buffer_prompt_len = strlen(prompt);
+	if (_buffer_prompt_len > sizeof(_buffer_prompt))
+		_buffer_prompt_len = sizeof(_buffer_prompt);
+
+	memcpy(_buffer_prompt, prompt, _buffer_prompt_len);
+}
+
+static void enter_buffer(char *prompt, buffer_command_t accept, buffer_command_t reject)
+{
+	_in_buffer = true;
+	_buffer_accept_cmd = accept;
+	_buffer_reject_cmd = reject == 0 ? buffer_close : reject;
+	_buffer_line->len = 0;
+
+	_buffer_old_cursor = _cursor;
+	_cursor.line = _buffer_line;
+	_cursor.offset = 0;
+
+	_buffer_change_cmd = 0;
+
+	_current_commands = _buffer_commands;
+
+	buffer_set_prompt(prompt);
+
+	display_statusbar(0);
+	update_cursor();
+}
+
+
+/** Search **/
+
+static void search_init(void)
+{
+	for (uint16_t i = 0; i < 256; ++i)
+	{
+		_search_identity[i] = i;
+		_search_fold[i] = (i >= 'A' && i <= 'Z') ? i + ('a' - 'A') : i;
+	}
+}
+
+// Copies the pattern through the active case map and builds the Horspool skip
+// tables for both directions, or compiles it when searching by regex.
+static void search_compile(const uint8_t *pattern, uint8_t len)
+{
+	_search_map = _search_fold_case ? _search_fold : _search_identity;
+	_search_len = len;
+	_search_valid = true;
+
+	if (_search_regex)
+	{
+		_search_valid = re_compile(&_search_prog, pattern, len, _search_fold_case);
+		return;
+	}
+
+	for (uint8_t i = 0; i < len; ++i)
+		_search_pattern[i] = _search_map[pattern[i]];
+
+	memset(_search_skip_fwd, len, sizeof(_search_skip_fwd));
+	memset(_search_skip_back, len, sizeof(_search_skip_back));
+
+	if (len == 0)
+		return;
+
+	for (uint8_t i = 0; i < len - 1; ++i)
+		_search_skip_fwd[_search_pattern[i]] = len - 1 - i;
+
+	for (uint8_t i = len - 1; i > 0; --i)
+		_search_skip_back[_search_pattern[i]] = i;
+}
+
+// First match in the line starting at or after start, or -1
+static int16_t search_line_forward(line_t *line, uint8_t start)
+{
+	const uint8_t *data = line->data;
+	const uint8_t *map = _search_map;
+	uint8_t last = _search_len - 1;
+	uint8_t last_ch = _search_pattern[last];
+	uint16_t pos = start;
+
+	while (pos + _search_len <= line->len)
+	{
+		uint8_t ch = map[data[pos + last]];
+
+		if (ch == last_ch)
+		{
+			int16_t i = last - 1;
+			while (i >= 0 && map[data[pos + i]] == _search_pattern[i])
+				--i;
+
+			if (i < 0)
+			{
+				_search_match_len = _search_len;
+				return pos;
+			}
+		}
+
+		pos += _search_skip_fwd[ch];
+	}
+
+	return -1;
+}
+
+// Last match in the line starting at or before start, or -1
+static int16_t search_line_backward(line_t *line, int16_t start)
+{
+	const uint8_t *data = line->data;
+	const uint8_t *map = _search_map;
+	uint8_t first_ch = _search_pattern[0];
+
+	if (line->len < _search_len)
+		return -1;
+
+	int16_t pos = line->len - _search_len;
+	if (start < pos)
+		pos = start;
+
+	while (pos >= 0)
+	{
+		uint8_t ch = map[data[pos]];
+
+		if (ch == first_ch)
+		{
+			uint8_t i = 1;
+			while (i < _search_len && map[data[pos + i]] == _search_pattern[i])
+				++i;
+
+			if (i == _search_len)
+			{
+				_search_match_len = _search_len;
+				return pos;
+			}
+		}
+
+		pos -= _search_skip_back[ch];
+	}
+
+	return -1;
+}
+
+static int16_t regex_line_forward(line_t *line, uint8_t start)
+{
+	if (start > line->len)
+		return -1;
+
+	return re_search(&_search_prog, line->data, line->len, start, &_search_match_len);
+}
+
+// The regex only matches forward, so the last match before start is found by
+// stepping through the matches in the line.
+static int16_t regex_line_backward(line_t *line, int16_t start)
+{
+	int16_t found = -1;
+	uint8_t found_len = 0;
+	uint16_t pos = 0;
+
+	while (pos <= line->len)
+	{
+		uint8_t len;
+		int16_t match = re_search(&_search_prog, line->data, line->len, pos, &len);
+
+		if (match < 0 || match > start)
+			break;
+
+		found = match;
+		found_len = len;
+		pos = match + 1;
+	}
+
+	if (found >= 0)
+		_search_match_len = found_len;
+
+	return found;
+}
+
+// Searches the document from a location, wrapping around once at either end.
+// The text is scanned in place, line by line.
+static bool search_document(location_t from, bool backward, location_t *found)
+{
+	line_t *line = from.line;
+	int16_t start = from.offset;
+	bool wrapped = false;
+
+	if (_search_len == 0 || !_search_valid)
+		return false;
+
+	while (true)
+	{
+		int16_t pos;
+
+		if (_search_regex)
+			pos = backward ? regex_line_backward(line, start) : regex_line_forward(line, start);
+		else
+			pos = backward ? search_line_backward(line, start) : search_line_forward(line, start);
+
+		if (pos >= 0)
+		{
+			found->line = line;
+			found->offset = pos;
+			_search_wrapped = wrapped;
+			return true;
+		}
+
+		if (wrapped && line == from.line)
+			return false;
+
+		line = backward ? line_prev(line) : line_next(line);
+		if (line == 0)
+		{
+			if (wrapped)
+				return false;
+
+			wrapped = true;
+			line = backward ? doc_last_line() : doc_first_line();
+		}
+
+		page_trim(from.line);
+
+		start = backward ? 255 : 0;
+	}
+}
+
+static void search_set_prompt(bool failing)
+{
+	char prompt[32];
+
+	snprintf(prompt, sizeof(prompt), "%s%s%s%s:", failing ? "Failing " : "", _search_regex ? "Regex" : "Search", _search_backward ? " backward" : "", _search_fold_case ? " [i]" : "");
+	buffer_set_prompt(prompt);
+}
+
+// Moves the highlight to a new match. If the match is on screen only the old
+// and new rows are repainted, otherwise the view is scrolled to show it.
+static void search_show(location_t match, uint8_t len)
+{
+	line_t *old_line = _highlight.line;
+
+	_highlight = match;
+	_highlight_len = len;
+
+	if (match.line != 0 && get_visible_row(match.line) < 0)
+	{
+		_scroll.line = match.line;
+		for (int16_t i = 0; i < (_height - 1) / 3 && _scroll.line->prev != 0; ++i)
+			_scroll.line = line_prev(_scroll.line);
+
+		redisplay_all();
+		return;
+	}
+
+	if (old_line != 0 && old_line != match.line)
+		redisplay_line(old_line);
+	if (match.line != 0)
+		redisplay_line(match.line);
+
+	update_cursor();
+}
+
+static void search_run(location_t from)
+{
+	location_t found;
+
+	if (_search_len > 0 && search_document(from, _search_backward, &found))
+	{
+		_search_match = found;
+		search_set_prompt(false);
+		search_show(found, _search_match_len);
+	}
+	else if (_search_len == 0)
+	{
+		_search_match.line = 0;
+		search_set_prompt(false);
+		search_show(_search_origin, 0);
+	}
+	else
+	{
+		search_set_prompt(true);
+	}
+
+	display_statusbar(0);
+}
+
+static void search_update(void)
+{
+	search_compile(_buffer_line->data, _buffer_line->len);
+
+	// Extend the current match if there is one, so typing narrows in place
+	search_run(_search_match.line != 0 ? _search_match : _search_origin);
+}
+
+static void search_next(bool backward)
+{
+	location_t from = _search_match.line != 0 ? _search_match : _search_origin;
+
+	_search_backward = backward;
+
+	if (_search_match.line != 0)
+	{
+		if (backward)
+		{
+			if (from.offset > 0)
+			{
+				--from.offset;
+			}
+			else if (from.line->prev != 0)
+			{
+				from.line = line_prev(from.line);
+				from.offset = 255;
+			}
+		}
+		else
+		{
+			++from.offset;
+		}
+	}
+
+	search_run(from);
+}
+
+static void search_finish(void)
+{
+	_highlight.line = 0;
+	_highlight_len = 0;
+}
+
+static void search_accept(void)
+{
+	location_t match = _search_match;
+
+	buffer_close();
+	search_finish();
+
+	if (match.line != 0)
+		_cursor = match;
+
+	redisplay_line(_cursor.line);
+	update_cursor();
+}
+
+static void search_reject(void)
+{
+	buffer_close();
+	search_finish();
+
+	if (_scroll.line != _search_origin_scroll)
+	{
+		_scroll.line = _search_origin_scroll;
+		redisplay_all();
+	}
+	else if (_search_match.line != 0)
+	{
+		redisplay_line(_search_match.line);
+		update_cursor();
+	}
+}
+
+static void search_start(bool backward, bool regex)
+{
+	_search_backward = backward;
+	_search_regex = regex;
+	_search_origin = _cursor;
+	_search_origin_scroll = _scroll.line;
+	_search_match.line = 0;
+	_search_len = 0;
+
+	enter_buffer("Search:", search_accept, search_reject);
+	_buffer_change_cmd = search_update;
+	_current_commands = _search_commands;
+
+	search_set_prompt(false);
+	display_statusbar(0);
+}
+
+
+/** Replace **/
+
+// Replaces every match in a line. The matches are collected and the final
+// length computed in one scan, then the line is rebuilt with at most one
+// allocation. Returns the number of replacements, or -1 if the result would
+// not fit in a line.
+static int16_t replace_in_line(line_t *line, uint32_t line_no, bool linked)
+{
+	static uint8_t starts[256];
+	static uint8_t lens[256];
+	static uint8_t scratch[256];
+	uint16_t count = 0;
+	uint16_t new_len = 0;
+	uint16_t pos = 0;
+
+	while (pos <= line->len)
+	{
+		uint8_t len;
+		int16_t match = re_search(&_search_prog, line->data, line->len, pos, &len);
+		if (match < 0)
+			break;
+
+		starts[count] = match;
+		lens[count] = len;
+		++count;
+
+		new_len += (match - pos) + _replace_len;
+		pos = match + len;
+
+		// Step over a character after an empty match so the scan advances
+		if (len == 0)
+		{
+			if (pos < line->len)
+				++new_len;
+			++pos;
+		}
+	}
+
+	if (count == 0)
+		return 0;
+
+	if (pos < line->len)
+		new_len += line->len - pos;
+
+	if (new_len > LINE_MAX_LEN)
+		return -1;
+
+	uint8_t *out = scratch;
+	pos = 0;
+	for (uint16_t i = 0; i < count; ++i)
+	{
+		memcpy(out, line->data + pos, starts[i] - pos);
+		out += starts[i] - pos;
+		memcpy(out, _replace_text, _replace_len);
+		out += _replace_len;
+
+		pos = starts[i] + lens[i];
+		if (lens[i] == 0 && pos < line->len)
+			*out++ = line->data[pos++];
+	}
+	if (pos < line->len)
+	{
+		memcpy(out, line->data + pos, line->len - pos);
+		out += line->len - pos;
+	}
+
+	// Journal the whole line so the replace is undone in one step
+	undo_record_text(UNDO_DELETE | (linked ? UNDO_LINKED : 0), line_no, 0, line->data, line->len);
+	undo_record_text(UNDO_INSERT | UNDO_LINKED, line_no, 0, scratch, new_len);
+
+	if (new_len > line->cap || (line->flags & LINE_SHARED))
+	{
+		PERF_COUNT(PERF_GROW_LINE);
+
+		line_t *new_line = alloc_line(new_len);
+		replace_line(line, new_line);
+		line = new_line;
+	}
+
+	memcpy(line->data, scratch, new_len);
+	line->len = new_len;
+	line->flags &= ~LINE_CLEAN;
+
+	return count;
+}
+
+static void replace_all(void)
+{
+	char msg[80];
+	uint16_t total = 0;
+	uint16_t skipped = 0;
+	uint32_t line_no = 0;
+	long start = sys_time_jiffies();
+
+	bool out_of_memory = false;
+	_undo_lost = false;
+
+	line_t *line = doc_first_line();
+	while (line != 0 && !_mem_critical)
+	{
+		// A page that would not fit ends the replace here rather than the
+		// reserve, or the editor, running out part way through loading it
+		if (line->next != 0 && (line->next->flags & LINE_STUB) && !page_fits(line->next))
+		{
+			out_of_memory = true;
+			break;
+		}
+
+		line_t *next = line_next(line);
+
+		int16_t count = replace_in_line(line, line_no, total > 0);
+		if (count < 0)
+			++skipped;
+		else
+			total += count;
+
+		page_trim(next);
+
+		// Lines already replaced are packed as the replace goes along
+		if (_pack_enabled && line_no % PACK_LINES == PACK_LINES - 1)
+			pack_document(next);
+
+		line = next;
+		++line_no;
+	}
+
+	if (_cursor.offset > _cursor.line->len)
+		_cursor.offset = _cursor.line->len;
+
+	long elapsed = sys_time_jiffies() - start;
+
+	redisplay_all();
+
+	if (_mem_critical || out_of_memory)
+		snprintf(msg, sizeof(msg), "Out of memory after %u replacements", total);
+	else if (_undo_lost)
+		snprintf(msg, sizeof(msg), "Replaced %u in %ld jiffies, too many to undo", total, elapsed);
+	else if (skipped > 0)
+		snprintf(msg, sizeof(msg), "Replaced %u in %ld jiffies, %u lines too long", total, elapsed, skipped);
+	else
+		snprintf(msg, sizeof(msg), "Replaced %u in %ld jiffies", total, elapsed);
+	display_statusbar(msg);
+}
+
+static void replace_with_accept(void)
+{
+	_replace_len = _buffer_line->len;
+	memcpy(_replace_text, _buffer_line->data, _replace_len);
+
+	buffer_close();
+	replace_all();
+}
+
+static void replace_pattern_accept(void)
+{
+	bool valid = _buffer_line->len > 0 && re_compile(&_search_prog, _buffer_line->data, _buffer_line->len, _search_fold_case);
+
+	buffer_close();
+
+	if (!valid)
+	{
+		display_statusbar("Invalid pattern");
+		return;
+	}
+
+	enter_buffer("With:", replace_with_accept, 0);
+}
+
+
+/** Undo **/
+
+static location_t doc_location(uint32_t line_no, uint8_t offset)
+{
+	location_t loc;
+
+	loc.line = _document_first_line;
+	while (true)
+	{
+		// Skip whole pages that are not loaded, load the one holding the line
+		if (loc.line->flags & LINE_STUB)
+		{
+			uint8_t lines = line_count(loc.line);
+
+			if (line_no < lines || loc.line->next == 0)
+			{
+				loc.line = page_expand(loc.line);
+				continue;
+			}
+
+			line_no -= lines;
+		}
+		else if (line_no == 0 || loc.line->next == 0)
+		{
+			break;
+		}
+		else
+		{
+			--line_no;
+		}
+
+		loc.line = loc.line->next;
+	}
+
+	loc.offset = offset <= loc.line->len ? offset : loc.line->len;
+	return loc;
+}
+
+// Inserts the text of a record, which may wrap around the end of the ring
+static location_t undo_insert_text(location_t at, uint16_t pos, uint16_t len)
+{
+	uint16_t index = pos & (UNDO_ARENA_SIZE - 1);
+	uint16_t first = UNDO_ARENA_SIZE - index;
+
+	if (first >= len)
+		return doc_insert(at, &_undo_arena[index], len);
+
+	at = doc_insert(at, &_undo_arena[index], first);
+	if (at.line == 0)
+		return at;
+
+	return doc_insert(at, _undo_arena, len - first);
+}
+
+// Finds where the text of a record ends when it starts at a location
+static location_t undo_text_end(location_t at, uint16_t pos, uint16_t len)
+{
+	uint8_t offset = at.offset;
+
+	for (uint16_t i = 0; i < len; ++i)
+	{
+		if (undo_get(pos + i) == '\n')
+		{
+			at.line = line_next(at.line);
+			offset = 0;
+		}
+		else
+		{
+			++offset;
+		}
+	}
+
+	at.offset = offset;
+	return at;
+}
+
+// Applies a record forwards for redo, or backwards for undo. Returns the
+// location the cursor should move to.
+static location_t undo_apply(uint16_t start, bool forward)
+{
+	uint8_t kind = undo_get(start) & UNDO_KIND_MASK;
+	uint16_t len = undo_get16(start + 2);
+	uint16_t text = start + UNDO_HEADER_SIZE;
+	location_t at = doc_location(undo_get32(start + 4), undo_get(start + 1));
+	location_t end;
+	uint8_t newline = '\n';
+	uint8_t count = len / sizeof(payload_t *);
+
+	// Undoing a delete is inserting its text and the other way around
+	if (!forward)
+	{
+		if (kind == UNDO_INSERT)
+			kind = UNDO_DELETE;
+		else if (kind == UNDO_DELETE)
+			kind = UNDO_INSERT;
+		else if (kind == UNDO_PUT_LINES)
+			kind = UNDO_CUT_LINES;
+		else if (kind == UNDO_CUT_LINES)
+			kind = UNDO_PUT_LINES;
+		else if (kind == UNDO_SPLIT)
+			kind = UNDO_JOIN;
+		else
+			kind = UNDO_SPLIT;
+	}
+
+	switch (kind)
+	{
+		case UNDO_INSERT:
+			end = undo_insert_text(at, text, len);
+			return end.line != 0 ? end : at;
+
+		case UNDO_DELETE:
+			end = doc_delete(at, undo_text_end(at, text, len));
+			return end.line != 0 ? end : at;
+
+		case UNDO_SPLIT:
+			end = doc_insert(at, &newline, 1);
+			return end.line != 0 ? end : at;
+
+		case UNDO_PUT_LINES:
+			for (uint8_t i = 0; i < count; ++i)
+				_undo_lines[i] = undo_get_payload(text + i * sizeof(payload_t *));
+
+			at.line = doc_put_lines(undo_get32(start + 4), _undo_lines, count);
+			at.offset = 0;
+			return at;
+
+		case UNDO_CUT_LINES:
+			at.line = doc_cut_lines(at.line, count, _undo_lines);
+			at.offset = 0;
+
+			for (uint8_t i = 0; i < count; ++i)
+				payload_release(_undo_lines[i]);
+			return at;
+
+		default:
+			if (at.line->next != 0)
+			{
+				end.line = line_next(at.line);
+				end.offset = 0;
+				end = doc_delete(at, end);
+				if (end.line != 0)
+					return end;
+			}
+			return at;
+	}
+}
+
+static void undo_show(location_t cursor)
+{
+	_cursor = cursor;
+
+	if (get_visible_row(_cursor.line) < 0)
+	{
+		_scroll.line = _cursor.line;
+		for (int16_t i = 0; i < (_height - 1) / 3 && _scroll.line->prev != 0; ++i)
+			_scroll.line = line_prev(_scroll.line);
+	}
+
+	redisplay_all();
+}
+
+static bool undo(void)
+{
+	location_t cursor = _cursor;
+	bool linked = true;
+
+	undo_load_pending();
+
+	if (_undo_current == _undo_tail)
+		return false;
+
+	undo_close();
+	_undo_suspended = true;
+
+	while (linked && _undo_current != _undo_tail)
+	{
+		uint16_t start = _undo_current - undo_get16(_undo_current - UNDO_FOOTER_SIZE);
+
+		linked = (undo_get(start) & UNDO_LINKED) != 0;
+		cursor = undo_apply(start, false);
+		_undo_current = start;
+	}
+
+	_undo_suspended = false;
+
+	undo_show(cursor);
+	return true;
+}
+
+static bool redo(void)
+{
+	location_t cursor = _cursor;
+
+	undo_load_pending();
+
+	if (_undo_current == _undo_head)
+		return false;
+
+	undo_close();
+	_undo_suspended = true;
+
+	do
+	{
+		cursor = undo_apply(_undo_current, true);
+		_undo_current += undo_record_size(_undo_current);
+	}
+	while (_undo_current != _undo_head && (undo_get(_undo_current) & UNDO_LINKED) != 0);
+
+	_undo_suspended = false;
+
+	undo_show(cursor);
+	return true;
+}
+
+
+/** Macros **/
+
+static void macro_record_key(uint8_t key)
+{
+	if (_macro_len == MACRO_MAX_KEYS)
+	{
+		_macro_recording = false;
+		display_statusbar("Macro too long, recording stopped");
+		return;
+	}
+
+	_macro_keys[_macro_len++] = key;
+}
+
+static bool macro_run_once(void)
+{
+	for (uint16_t i = 0; i < _macro_len; ++i)
+	{
+		uint8_t key = _macro_keys[i];
+		command_t cmd = _current_commands[key];
+
+		// Once memory is critical even moving the cursor can load a page
+		if (_mem_critical || (cmd != 0 && !cmd(key)))
+			return false;
+
+		_last_command = cmd;
+	}
+
+	return true;
+}
+
+// Whether the cursor is further into the document than it was. The old line
+// may have been freed by the edit, so it is only compared, never followed.
+static bool macro_moved_forward(location_t before)
+{
+	if (_cursor.line == before.line)
+		return _cursor.offset > before.offset;
+
+	for (line_t *line = _cursor.line->prev; line != 0; line = line->prev)
+	{
+		if (line == before.line)
+			return true;
+	}
+
+	return false;
+}
+
+// Replays the macro count times, or when count is 0 until a search in it wraps
+// around or the cursor stops moving forward. Either way it stops if a command
+// fails or the cursor does not move at all. Esc stops a replay between runs,
+// another key typed meanwhile is kept for after it. Nothing is painted until
+// the whole replay is done.
+static uint16_t macro_replay(uint16_t count, bool *stopped)
+{
+	uint16_t done = 0;
+	bool typed_ahead = false;
+
+	*stopped = false;
+	_paint_suppressed = true;
+
+	while (count == 0 ? done < MACRO_MAX_REPEAT : done < count)
+	{
+		location_t before = _cursor;
+
+		_search_wrapped = false;
+		if (!macro_run_once() || _mem_critical)
+			break;
+
+		++done;
+
+		if (count == 0 ? _search_wrapped || !macro_moved_forward(before) : _cursor.line == before.line && _cursor.offset == before.offset)
+			break;
+
+		page_trim(0);
+
+		if (!typed_ahead && con_key_ready())
+		{
+			uint8_t key = con_get_key();
+			if (key == CON_KEY_ESC)
+			{
+				*stopped = true;
+				break;
+			}
+
+			con_unget_key(key);
+			typed_ahead = true;
+		}
+	}
+
+	_paint_suppressed = false;
+
+	redisplay_all();
+	if (_in_buffer)
+		display_statusbar(0);
+
+	return done;
+}
+
+static void macro_replay_accept(void)
+{
+	char msg[32];
+	uint16_t count = 0;
+
+	for (uint8_t i = 0; i < _buffer_line->len; ++i)
+	{
+		uint8_t ch = _buffer_line->data[i];
+		if (ch < '0' || ch > '9')
+		{
+			buffer_close();
+			display_statusbar("Invalid repeat count");
+			return;
+		}
+
+		count = count * 10 + (ch - '0');
+	}
+
+	buffer_close();
+
+	bool stopped;
+	uint16_t done = macro_replay(count, &stopped);
+
+	snprintf(msg, sizeof(msg), stopped ? "Macro stopped after %u times" : "Macro replayed %u times", done);
+	display_statusbar(msg);
+}
+
+
+/** Commands **/
+
+static bool cmd_quit(uint8_t ch)
+{
+	con_teardown();
+	sys_exit(0);
+	return true;
+}
+
+static bool cmd_insert_char(uint8_t ch)
+{
+	location_t end = doc_insert(_cursor, &ch, 1);
+	if (end.line == 0)
+		return false;
+
+	_cursor = end;
+
+	redisplay_current_line();
+
+	if (_in_buffer && _buffer_change_cmd)
+		_buffer_change_cmd();
+	return true;
+}
+
+static bool cmd_insert_newline(uint8_t ch)
+{
+	uint8_t line_count = get_current_line_number();
+	uint8_t newline = '\n';
+
+	location_t end = doc_insert(_cursor, &newline, 1);
+	if (end.line == 0)
+		return false;
+
+	line_t *current_line = end.line->prev;
+	_cursor = end;
+
+	if (line_count >= _height - 2)
+	{
+		_scroll.line = line_next(_scroll.line);
+		redisplay_all();
+	}
+	else
+	{
+		redisplay_line_down(current_line);
+	}
+
+	return true;
+}
+
+static bool cmd_backspace(uint8_t ch)
+{
+	location_t from = _cursor;
+
+	if (_cursor.offset > 0)
+	{
+		--from.offset;
+		_cursor = doc_delete(from, _cursor);
+	}
+	else if (_cursor.line->prev != 0 && !_in_buffer)
 	{
-		display_statusbar(0);
+		// Merge the current line onto the end of the previous one
+		bool scrolled = _scroll.line == _cursor.line;
+
+		from.line = line_prev(_cursor.line);
+		from.offset = from.line->len;
+
+		location_t at = doc_delete(from, _cursor);
+		if (at.line == 0)
+		{
+			display_statusbar("Line too long to join");
+			return false;
+		}
+
+		_cursor = at;
+
+		if (scrolled)
+			redisplay_all();
+		else
+			redisplay_line_down(_cursor.line);
+		return true;
 	}
 	else
 	{
-		uint16_t line_number = get_line_number(_cursor.line);
-		con_set_xy(0, line_number);
-		display_line(_cursor.line);
+		return false;
 	}
 
-	update_cursor();
+
+	redisplay_current_line();
+
+	if (_in_buffer && _buffer_change_cmd)
+		_buffer_change_cmd();
+	return true;
 }
 
-static void redisplay_all(void)
+static bool cmd_move_up(uint8_t ch)
 {
-	con_set_xy(0, 0);
-
-	uint16_t line_number = 0;
-	uint8_t x = _cursor.offset;
-	line_t *it = _scroll.line;
+	if (_cursor.line->prev == 0)
+		return false;
 
-	while (it != 0 && line_number < (_height - 1))
+	if (_scroll.line == _cursor.line)
 	{
-		display_line(it);
-		con_newline();
-		
-		line_number++;
-		it = it->next;
+		_scroll.line = line_prev(_scroll.line);
+		redisplay_all();
 	}
 
+	_cursor.line = line_prev(_cursor.line);
+	if (_cursor.line->len < _cursor.offset)
+		_cursor.offset = _cursor.line->len;
+
 	update_cursor();
+	return true;
 }
 
-static void redisplay_line_down(line_t *line)
+static bool cmd_move_down(uint8_t ch)
 {
-	uint16_t line_number = get_line_number(line);
-	con_set_xy(0, line_number);
+	if (_cursor.line->next == 0)
+		return false;
 
-	while (line != 0 && line_number < (_height - 1))
-	{
-		display_line(line);
-		con_newline();
+	uint8_t line_count = get_current_line_number();
+	bool scrolled = false;
 
-		line_number++;
-		line = line->next;
+	if (line_count >= _height - 2)
+	{
+		_scroll.line = line_next(_scroll.line);
+		scrolled = true;
 	}
 
-	update_cursor();
+	_cursor.line = line_next(_cursor.line);
+	if (_cursor.line->len < _cursor.offset)
+		_cursor.offset = _cursor.line->len;
+
+	if (scrolled)
+		redisplay_all();
+	else
+		update_cursor();
+	return true;
 }
 
-static void display_statusbar(char * msg)
+static bool cmd_move_left(uint8_t ch)
 {
-	con_set_xy(0, _height - 1);
-	con_set_color(CON_COLOR_BLUE, CON_COLOR_GREY);
-
-	if (_in_buffer)
+	if (_cursor.offset > 0)
 	{
-		con_write(_buffer_prompt, _buffer_prompt_len);
-		display_line(_buffer_line);
+		--_cursor.offset;
+		update_cursor();
+		return true;
 	}
-	else
+	else if (!_in_buffer && _cursor.line->prev != 0)
 	{
-		int len = strlen(msg);
-		con_clear_line();
-		con_out(' ');
-		con_write(msg, len);
+		_cursor.offset = 255;	// this ensures we are placed at the end of the line
+		return cmd_move_up(ch);
 	}
-	con_set_color(CON_COLOR_GREY, CON_COLOR_BLUE);
-	con_set_xy(_cursor_x, _cursor_y);
-}
 
-/** Buffer Handling **/
+	return false;
+}
 
-static void buffer_close(void)
+static bool cmd_move_right(uint8_t ch)
 {
-	_in_buffer = false;
-	_cursor = _buffer_old_cursor;
-	_current_commands = _basic_commands;
+	if (_cursor.offset < _cursor.line->len)
+	{
+		++_cursor.offset;
+		update_cursor();
+		return true;
+	}
+	else if (!_in_buffer)
+	{
+		uint8_t old_offset = _cursor.offset;
 
-	update_cursor();
-}
+		_cursor.offset = 0;
+		if (cmd_move_down(ch))
+			return true;
 
-static void enter_buffer(char *prompt, buffer_command_t accept, buffer_command_t reject)
-{
-	_in_buffer = true;
-	_buffer_accept_cmd = accept;
-	_buffer_reject_cmd = reject == 0 ? buffer_close : reject;
-	_buffer_line->len = 0;
+		_cursor.offset = old_offset;
+	}
 
-	_buffer_old_cursor = _cursor;
-	_cursor.line = _buffer_line;
-	_cursor.offset = 0;
+	return false;
+}
 
-	_current_commands = _buffer_commands;
+static bool cmd_document_save_as(uint8_t ch)
+{
+	enter_buffer("Save as:", doc_save_as, 0);
+	return true;
+}
 
-	_buffer_prompt_len = strlen(prompt);
-	if (_buffer_prompt_len > sizeof(_buffer_prompt))
-		_buffer_prompt_len = sizeof(_buffer_prompt_len);
+static bool cmd_search_forward(uint8_t ch)
+{
+	search_start(false, false);
+	return true;
+}
 
-	memcpy(_buffer_prompt, prompt, _buffer_prompt_len);
+static bool cmd_search_backward(uint8_t ch)
+{
+	search_start(true, false);
+	return true;
+}
 
-	display_statusbar(0);
-	update_cursor();
+static bool cmd_search_regex(uint8_t ch)
+{
+	search_start(false, true);
+	return true;
 }
 
+static bool cmd_search_next(uint8_t ch)
+{
+	search_next(false);
+	return _search_match.line != 0;
+}
 
-/** Commands **/
+static bool cmd_search_previous(uint8_t ch)
+{
+	search_next(true);
+	return _search_match.line != 0;
+}
 
-static bool cmd_quit(uint8_t ch)
+static bool cmd_search_toggle_case(uint8_t ch)
 {
-	con_teardown();
-	sys_exit(0);
+	_search_fold_case = !_search_fold_case;
+	search_update();
 	return true;
 }
 
-static bool cmd_insert_char(uint8_t ch)
+static bool cmd_undo(uint8_t ch)
 {
-	line_t *line = _cursor.line;
-
-	// Make room for another char
-	if (line->len == line->cap)
+	if (!undo())
 	{
-		line_t *old = line;
-		line = grow_line(line);
-
-		if (line != old)
-		{
-			_cursor.line = line;
-			if (_scroll.line == old)
-				_scroll.line = line;
-			if (_document_first_line == old)
-				_document_first_line = line;
-		}
+		display_statusbar("Nothing to undo");
+		return false;
 	}
 
-	uint8_t len = line->cap - _cursor.offset;
-	for (uint8_t i = 1; i < len; ++i)
-		line->data[line->cap - i] = line->data[line->cap - i - 1];
+	return true;
+}
 
-	line->data[_cursor.offset] = ch;
-	line->len++;
-	_cursor.offset++;
+static bool cmd_redo(uint8_t ch)
+{
+	if (!redo())
+	{
+		display_statusbar("Nothing to redo");
+		return false;
+	}
 
-	redisplay_current_line();
 	return true;
 }
 
-static bool cmd_insert_newline(uint8_t ch)
+// Pressed again, steps through the heap, the lines by size, the caches and
+// the stack
+static bool cmd_show_memory_stats(uint8_t ch)
 {
-	uint8_t line_count = get_current_line_number();
+	static uint8_t page = 0;
+	char msg[STATUS_MSG_SIZE];
+	heap_stats_t stats;
+	unsigned long largest;
+	uint8_t len;
 
-	line_t *current_line = _cursor.line;
-	line_t *new_line = alloc_line(8);
+	page = _last_command == cmd_show_memory_stats ? (page + 1) % 5 : 0;
 
-	new_line->next = current_line->next;
-	new_line->prev = current_line;
+	if (page > 0 && page < 4)
+		heap_gather(&stats);
 
-	if (current_line->next != 0)
-		current_line->next->prev = new_line;
+	if (page == 1)
+	{
+		unsigned long blocks = mem_free_blocks(&largest);
+		snprintf(msg, sizeof(msg), "Peak %lu Kb, parked %lu, %lu free up to %lu, %lu allocs %lu frees", mem_peak_used() / 1024, (unsigned long)stats.parked, blocks, largest, mem_alloc_count(), mem_release_count());
+	}
+	else if (page == 2)
+	{
+		len = snprintf(msg, sizeof(msg), "Lines");
+		for (uint8_t i = 0; i < LINE_CLASSES && len < sizeof(msg); ++i)
+			len += snprintf(msg + len, sizeof(msg) - len, " %u:%lu", _line_class_size[i], (unsigned long)stats.lines[i]);
+		if (len < sizeof(msg))
+			snprintf(msg + len, sizeof(msg) - len, ", %lu stubs, %lu views, %lu wasted", (unsigned long)stats.stubs, (unsigned long)stats.views, (unsigned long)stats.wasted);
+	}
+	else if (page == 3)
+	{
+		len = snprintf(msg, sizeof(msg), "Cached");
+		for (uint8_t i = 0; i < LINE_CLASSES && len < sizeof(msg); ++i)
+			len += snprintf(msg + len, sizeof(msg) - len, " %u:%lu", _line_class_size[i], (unsigned long)stats.cached[i]);
+		if (len < sizeof(msg))
+			snprintf(msg + len, sizeof(msg) - len, ", %lu bytes parked", (unsigned long)stats.parked);
+	}
+	else if (page == 4)
+	{
+		unsigned long used = stack_used();
+		snprintf(msg, sizeof(msg), used < stack_size() ? "Stack %lu of %lu bytes at the deepest" : "Stack %lu of %lu bytes, it has overflowed", used, stack_size());
+	}
+	else if (_page_chan >= 0)
+		snprintf(msg, sizeof(msg), "%lu/%lu Kb free, undo %u/%u in %u, shared %lu/%lu, %u pages", mem_free() / 1024, mem_total() / 1024, _undo_used, UNDO_ARENA_SIZE, _undo_records, (unsigned long)_shared_bytes, (unsigned long)_shared_saved, _resident_count);
+	else
+		snprintf(msg, sizeof(msg), "%lu/%lu Kb free, undo %u/%u bytes in %u records, shared %lu/%lu", mem_free() / 1024, mem_total() / 1024, _undo_used, UNDO_ARENA_SIZE, _undo_records, (unsigned long)_shared_bytes, (unsigned long)_shared_saved);
+	display_statusbar(msg);
+	return true;
+}
 
-	current_line->next = new_line;
+// Cuts the cursor line into the clipboard. Lines killed one after another are
+// collected together.
+static bool cmd_kill_line(uint8_t ch)
+{
+	if (_last_command != cmd_kill_line)
+		clip_clear();
 
-	// Copy data from the current line to the new one
-	if (_cursor.offset < current_line->len)
+	if (_clip_count == CLIP_MAX_LINES)
 	{
-		uint8_t left = current_line->len - _cursor.offset;
-		memcpy(new_line->data, current_line->data + _cursor.offset, left);
-
-		current_line->len = _cursor.offset;
-		new_line->len = left;
+		display_statusbar("Clipboard is full");
+		return false;
 	}
 
-	_cursor.line = new_line;
-	_cursor.offset = 0;
-
-	if (line_count >= _height - 2)
+	if (_cursor.line->prev == 0 && _cursor.line->next == 0)
 	{
-		_scroll.line = _scroll.line->next;
-		redisplay_all();
+		// The only line is emptied instead
+		location_t from = {_cursor.line, 0};
+		location_t to = {_cursor.line, _cursor.line->len};
+
+		_clip[_clip_count++] = payload_new(_cursor.line->data, _cursor.line->len);
+		_cursor = doc_delete(from, to);
 	}
 	else
 	{
-		redisplay_line_down(current_line);
+		doc_cut_lines(_cursor.line, 1, &_clip[_clip_count++]);
 	}
 
+	undo_show(_cursor);
 	return true;
 }
 
-static bool cmd_backspace(uint8_t ch)
+// Copies the cursor line into the clipboard and moves down
+static bool cmd_copy_line(uint8_t ch)
 {
-	if (_cursor.offset > 0)
+	char msg[32];
+
+	if (_last_command != cmd_copy_line)
+		clip_clear();
+
+	if (_clip_count == CLIP_MAX_LINES)
 	{
-		line_t * line = _cursor.line;
-		uint8_t i;
+		display_statusbar("Clipboard is full");
+		return false;
+	}
 
-		--_cursor.offset;
+	_clip[_clip_count++] = line_share(&_cursor.line);
+	cmd_move_down(ch);
 
-		for (i = _cursor.offset; i < line->len; ++i)
-			line->data[i] = line->data[i+1];
+	snprintf(msg, sizeof(msg), "%u lines copied", _clip_count);
+	display_statusbar(msg);
+	return true;
+}
 
-		line->len--;
+static bool cmd_paste(uint8_t ch)
+{
+	if (_clip_count == 0)
+	{
+		display_statusbar("Clipboard is empty");
+		return false;
 	}
+
+	doc_put_lines(doc_line_number(_cursor.line), _clip, _clip_count);
+
+	undo_show(_cursor);
+	return true;
+}
+
+static bool cmd_duplicate_line(uint8_t ch)
+{
+	payload_t *payload = line_share(&_cursor.line);
+	location_t at;
+
+	at.line = doc_put_lines(doc_line_number(_cursor.line) + 1, &payload, 1);
+	at.offset = _cursor.offset;
+	payload_release(payload);
+
+	undo_show(at);
+	return true;
+}
+
+// Writes the document to a copy without loading anything, so it also works when
+// memory is full
+static bool cmd_save_copy(uint8_t ch)
+{
+	char path[sizeof(_document_name) + 4];
+	char msg[64];
+
+	if (doc_save_copy(path))
+		snprintf(msg, sizeof(msg), "Saved a copy to %s", path);
 	else
+		snprintf(msg, sizeof(msg), "Could not save a copy to %s", path);
+	display_statusbar(msg);
+	return true;
+}
+
+static bool cmd_write_heap_report(uint8_t ch)
+{
+	display_statusbar(heap_write_report("fte.mem") ? "Heap report written to fte.mem" : "Could not write fte.mem");
+	return true;
+}
+
+#ifdef FTE_TRACE
+static bool cmd_dump_trace(uint8_t ch)
+{
+	display_statusbar(trace_dump("fte.trc") ? "Session trace written to fte.trc" : "Could not write fte.trc");
+	return true;
+}
+#endif
+
+static bool cmd_toggle_packing(uint8_t ch)
+{
+	char msg[64];
+
+	if (!_pack_enabled && !pack_init())
 	{
-		// Here we need to merge the current line with the previous one.
+		display_statusbar("Not enough memory to pack lines");
+		return false;
 	}
 
+	_pack_enabled = !_pack_enabled;
+	if (_pack_enabled)
+		pack_document(0);
 
-	redisplay_current_line();
+	snprintf(msg, sizeof(msg), "Packing %s, %lu bytes of text in %lu", _pack_enabled ? "on" : "off", (unsigned long)_pack_text, (unsigned long)_pack_bytes);
+	display_statusbar(msg);
 	return true;
 }
 
-static bool cmd_move_up(uint8_t ch)
+#ifdef FTE_PERF
+static bool cmd_toggle_perf_overlay(uint8_t ch)
 {
-	if (_cursor.line->prev != 0)
-	{
-		if (_scroll.line == _cursor.line)
-			_scroll.line = _scroll.line->prev;
+	// The overlay is drawn over the text, which is all that needs putting back
+	if (!perf_toggle_overlay())
+		redisplay_all();
+	return true;
+}
+
+// Shows the key latency histogram, and writes it to latency.txt when pressed
+// a second time
+static bool cmd_show_latency(uint8_t ch)
+{
+	char msg[80];
 
-		_cursor.line = _cursor.line->prev;
-		if (_cursor.line->len < _cursor.offset)
-			_cursor.offset = _cursor.line->len;
+	if (_last_command == cmd_show_latency)
+	{
+		display_statusbar(perf_latency_dump("latency.txt") ? "Latency written to latency.txt" : "Could not write latency.txt");
+		return true;
 	}
 
-	update_cursor();
+	perf_latency_format(msg, _width < sizeof(msg) ? _width : sizeof(msg));
+	display_statusbar(msg);
 	return true;
 }
 
-static bool cmd_move_down(uint8_t ch)
+// Starts the sampling profiler, or stops it and writes the samples to fte.prf
+static bool cmd_toggle_profiler(uint8_t ch)
 {
-	uint8_t line_count = get_current_line_number();
+	char msg[64];
+	unsigned long busiest;
 
-	if (_cursor.line->next != 0)
+	if (!prof_running())
 	{
-		if (line_count >= _height - 1)
-			_scroll.line = _scroll.line->next;
-
-		_cursor.line = _cursor.line->next;
-		if (_cursor.line->len < _cursor.offset)
-			_cursor.offset = _cursor.line->len;
+		prof_start();
+		display_statusbar("Profiling, F10 stops");
+		return true;
 	}
 
-	update_cursor();
+	prof_stop();
+	if (prof_dump("fte.prf", &busiest))
+		snprintf(msg, sizeof(msg), "Profile written to fte.prf, busiest at %08lX", busiest);
+	else
+		snprintf(msg, sizeof(msg), "Could not write fte.prf");
+	display_statusbar(msg);
 	return true;
 }
+#endif
 
-static bool cmd_move_left(uint8_t ch)
+static bool cmd_replace_all(uint8_t ch)
 {
-	if (_cursor.offset > 0)
+	enter_buffer("Replace regex:", replace_pattern_accept, 0);
+	return true;
+}
+
+static bool cmd_macro_record(uint8_t ch)
+{
+	if (_macro_recording)
 	{
-		--_cursor.offset;
-		update_cursor();
+		char msg[32];
+
+		_macro_recording = false;
+		snprintf(msg, sizeof(msg), "Macro recorded, %u keys", _macro_len);
+		display_statusbar(msg);
 	}
-	else if (!_in_buffer)
+	else
 	{
-		_cursor.offset = 255;	// this ensures we are placed at the end of the line
-		cmd_move_up(ch);		
+		_macro_recording = true;
+		_macro_len = 0;
+		display_statusbar("Recording macro, F3 to stop");
 	}
 
 	return true;
 }
 
-static bool cmd_move_right(uint8_t ch)
+static bool cmd_macro_replay(uint8_t ch)
 {
-	if (_cursor.offset < _cursor.line->len)
-	{
-		++_cursor.offset;
-		update_cursor();
-	}
-	else if (!_in_buffer)
+	_macro_recording = false;
+
+	if (_macro_len == 0)
 	{
-		_cursor.offset = 0;
-		cmd_move_down(ch);
+		display_statusbar("No macro recorded");
+		return false;
 	}
+
+	enter_buffer("Repeat (empty = to end):", macro_replay_accept, 0);
 	return true;
 }
 
-static bool cmd_document_save_as(uint8_t ch)
+static bool cmd_document_open(uint8_t ch)
 {
-	enter_buffer("Save as:", doc_save_as, 0);
+	enter_buffer("Open:", doc_open, 0);
 	return true;
 }
 
@@ -629,6 +4937,32 @@ static bool cmd_reject_buffer(uint8_t ch)
 
 /** Main **/
 
+// While memory is full only commands that save or replace the document are
+// run. Even moving the cursor can load a page.
+static bool command_allowed(command_t cmd)
+{
+#ifdef FTE_TRACE
+	if (cmd == cmd_dump_trace)
+		return true;
+#endif
+
+	return !_mem_critical || _current_commands == _buffer_commands ||
+		cmd == cmd_quit || cmd == cmd_document_save_as || cmd == cmd_document_open || cmd == cmd_save_copy ||
+		cmd == cmd_show_memory_stats || cmd == cmd_write_heap_report;
+}
+
+#ifdef FTE_TRACE
+// Which of the tables a command is looked up in, for the session trace
+static uint16_t command_table(void)
+{
+	if (_current_commands == _search_commands)
+		return TRACE_TABLE_SEARCH;
+	if (_current_commands == _buffer_commands)
+		return TRACE_TABLE_BUFFER;
+	return TRACE_TABLE_BASIC;
+}
+#endif
+
 static void add_char_commands(command_t *commands)
 {
 	commands['a'] = cmd_insert_char;
@@ -727,9 +5061,11 @@ static void add_char_commands(command_t *commands)
 
 int main(int argc, char * argv[])
 {
-	char buffer[64];
+	char buffer[STATUS_MSG_SIZE];
 	char * msg = "Hello, World\n";
 
+	mem_add_system_ram();
+
 	con_setup();
 	con_get_size(&_width, &_height);
 
@@ -742,6 +5078,7 @@ int main(int argc, char * argv[])
 
 	_basic_commands[CON_KEY_CTRL_Q] = cmd_quit;
 	_basic_commands[CON_KEY_CTRL_S] = cmd_document_save_as;
+	_basic_commands[CON_KEY_CTRL_O] = cmd_document_open;
 	_basic_commands['\t'] = cmd_insert_char;
 	_basic_commands[CON_KEY_ENTER] = cmd_insert_newline;
 	_basic_commands[CON_KEY_BACKSPACE] = cmd_backspace;
@@ -749,6 +5086,30 @@ int main(int argc, char * argv[])
 	_basic_commands[CON_KEY_RIGHT] = cmd_move_right;
 	_basic_commands[CON_KEY_UP] = cmd_move_up;
 	_basic_commands[CON_KEY_DOWN] = cmd_move_down;
+	_basic_commands[CON_KEY_CTRL_F] = cmd_search_forward;
+	_basic_commands[CON_KEY_CTRL_R] = cmd_search_backward;
+	_basic_commands[CON_KEY_CTRL_G] = cmd_search_regex;
+	_basic_commands[CON_KEY_CTRL_E] = cmd_replace_all;
+	_basic_commands[CON_KEY_CTRL_Z] = cmd_undo;
+	_basic_commands[CON_KEY_CTRL_Y] = cmd_redo;
+	_basic_commands[CON_KEY_CTRL_K] = cmd_kill_line;
+	_basic_commands[CON_KEY_CTRL_C] = cmd_copy_line;
+	_basic_commands[CON_KEY_CTRL_V] = cmd_paste;
+	_basic_commands[CON_KEY_CTRL_D] = cmd_duplicate_line;
+	_basic_commands[CON_KEY_F2] = cmd_show_memory_stats;
+	_basic_commands[CON_KEY_F3] = cmd_macro_record;
+	_basic_commands[CON_KEY_F4] = cmd_macro_replay;
+	_basic_commands[CON_KEY_F6] = cmd_toggle_packing;
+	_basic_commands[CON_KEY_F7] = cmd_save_copy;
+	_basic_commands[CON_KEY_F8] = cmd_write_heap_report;
+#ifdef FTE_TRACE
+	_basic_commands[CON_KEY_F9] = cmd_dump_trace;
+#endif
+#ifdef FTE_PERF
+	_basic_commands[CON_KEY_F10] = cmd_toggle_profiler;
+	_basic_commands[CON_KEY_F11] = cmd_show_latency;
+	_basic_commands[CON_KEY_F12] = cmd_toggle_perf_overlay;
+#endif
 
 	_buffer_commands[CON_KEY_ENTER] = cmd_accept_buffer;
 	_buffer_commands[CON_KEY_ESC] = cmd_reject_buffer;
@@ -756,8 +5117,14 @@ int main(int argc, char * argv[])
 	_buffer_commands[CON_KEY_LEFT] = cmd_move_left;
 	_buffer_commands[CON_KEY_RIGHT] = cmd_move_right;
 
+	memcpy(_search_commands, _buffer_commands, sizeof(_search_commands));
+	_search_commands[CON_KEY_CTRL_F] = cmd_search_next;
+	_search_commands[CON_KEY_CTRL_R] = cmd_search_previous;
+	_search_commands[CON_KEY_CTRL_T] = cmd_search_toggle_case;
+
 	_current_commands = _basic_commands;
 
+	search_init();
 
 	doc_new();
 	update_cursor();
@@ -766,20 +5133,56 @@ int main(int argc, char * argv[])
 		
 	_in_buffer = false;
 	_buffer_line = alloc_line(128);
+	_mem_reserve = mem_alloc(MEM_RESERVE_SIZE);
 
 	while (true)
 	{
+		while (_compact_pending && !con_key_ready())
+			compact_step();
+
 		uint8_t key = con_get_key();
+		PERF_FRAME_BEGIN();
+		trace_key(key);
 
 		command_t cmd = _current_commands[key];
+
+		_statusbar_message = false;
+
+		if (_macro_recording && cmd != cmd_macro_record && cmd != cmd_macro_replay)
+			macro_record_key(key);
+
+		if (!command_allowed(cmd))
+		{
+			display_statusbar("Out of memory, F7 saves a copy, Ctrl+S saves");
+			cmd = 0;
+		}
+
+		trace_command(key, cmd != 0 ? command_table() : TRACE_TABLE_NONE);
+
 		if (cmd != 0)
 			cmd(key);
 
-		if (!_in_buffer)
+		_last_command = cmd;
+		_compact_pending = true;
+		page_trim(0);
+
+		if (_pack_enabled)
+			pack_document(0);
+
+		compact_relieve();
+
+		if (_mem_critical && !_in_buffer && !_statusbar_message)
+		{
+			display_statusbar("Out of memory, F7 saves a copy, Ctrl+S saves");
+		}
+		else if (!_in_buffer && !_statusbar_message)
 		{
-			snprintf(buffer, 64, "%c (%04X) %d (%d, %d) %d Kb free", (key > 32 && key <= 126) ? (char)key : '.', key, key == CON_KEY_LEFT, _cursor.line->len, _cursor.line->cap, mem_free() / 1024);
+			snprintf(buffer, sizeof(buffer), "%c (%04X) %d (%d, %d) %lu/%lu Kb free", (key > 32 && key <= 126) ? (char)key : '.', key, key == CON_KEY_LEFT, _cursor.line->len, _cursor.line->cap, mem_free() / 1024, mem_total() / 1024);
 			display_statusbar(buffer);
 		}
+
+		trace_paint();
+		PERF_FRAME_END(_cursor_x, _cursor_y);
 	}
 
 	return 0;
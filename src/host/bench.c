@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "mem.h"
+#include "stack.h"
+#include "vicky3.h"
+
+
+static const char *_trace;
+static bool _started = false;
+
+static uint32_t _keys = 0;
+static uint64_t _key_start_ns;
+static uint64_t _total_ns = 0;
+static uint64_t _max_ns = 0;
+static uint64_t _cells = 0;
+static uint64_t _syscalls = 0;
+static unsigned long _allocs_start;
+
+// Time spent on idle work between keys, and the longest single step of it,
+// also as the free list nodes the allocator walked, which the host's timer
+// noise does not touch
+static bool _idle = false;
+static uint64_t _idle_poll_ns;
+static unsigned long _idle_poll_visits;
+static uint64_t _idle_ns = 0;
+static uint64_t _max_step_ns = 0;
+static unsigned long _max_step_nodes = 0;
+static uint32_t _idle_steps = 0;
+
+// Copies of the planes from the last key, to count the cells written since
+static char _text_seen[VKY3_PLANE_SIZE];
+static char _color_seen[VKY3_PLANE_SIZE];
+
+
+static uint64_t bench_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Counts the cells that changed since the last key and takes a new copy. A
+// cell written with the value it already had is not seen.
+static void bench_count_cells(void)
+{
+	for (uint16_t i = 0; i < VKY3_PLANE_SIZE; ++i)
+	{
+		if (host_text_plane[i] != _text_seen[i] || host_color_plane[i] != _color_seen[i])
+		{
+			_text_seen[i] = host_text_plane[i];
+			_color_seen[i] = host_color_plane[i];
+			++_cells;
+		}
+	}
+}
+
+bool host_bench_enabled(void)
+{
+	if (_trace == 0)
+		_trace = getenv("FTE_BENCH");
+
+	return _trace != 0;
+}
+
+void host_bench_syscall(void)
+{
+	++_syscalls;
+}
+
+// The work for a key ends when the next one is read, or when the editor
+// first finds no key waiting and starts on idle work
+static void bench_end_key(uint64_t now)
+{
+	uint64_t spent = now - _key_start_ns;
+
+	_total_ns += spent;
+	if (spent > _max_ns)
+		_max_ns = spent;
+	++_keys;
+
+	bench_count_cells();
+}
+
+// Every poll after the first ends a step of idle work
+static void bench_end_step(uint64_t now)
+{
+	uint64_t spent = now - _idle_poll_ns;
+	unsigned long nodes = mem_visits() - _idle_poll_visits;
+
+	_idle_ns += spent;
+	if (spent > _max_step_ns)
+		_max_step_ns = spent;
+	if (nodes > _max_step_nodes)
+		_max_step_nodes = nodes;
+	++_idle_steps;
+}
+
+void host_bench_idle(void)
+{
+	if (!_started)
+		return;
+
+	uint64_t now = bench_now();
+
+	if (_idle)
+		bench_end_step(now);
+	else
+		bench_end_key(now);
+
+	_idle = true;
+	_idle_poll_visits = mem_visits();
+	_idle_poll_ns = bench_now();
+}
+
+void host_bench_key(void)
+{
+	if (!host_bench_enabled())
+		return;
+
+	uint64_t now = bench_now();
+
+	if (_started && _idle)
+	{
+		bench_end_step(now);
+		_idle = false;
+	}
+	else if (_started)
+	{
+		bench_end_key(now);
+	}
+	else
+	{
+		// The screen drawn at startup is not part of the first key
+		_started = true;
+		_allocs_start = mem_alloc_count();
+		_syscalls = 0;
+		bench_count_cells();
+		_cells = 0;
+	}
+
+	_key_start_ns = bench_now();
+}
+
+void host_bench_report(void)
+{
+	uint32_t keys = _keys > 0 ? _keys : 1;
+	unsigned long allocs = mem_alloc_count() - _allocs_start;
+
+	printf("{\"trace\": \"%s\", \"keys\": %u, \"total_ms\": %.3f, \"us_per_key\": %.3f, \"max_us\": %.3f, "
+		"\"cells\": %llu, \"cells_per_key\": %.2f, \"syscalls\": %llu, \"syscalls_per_key\": %.2f, "
+		"\"allocs\": %lu, \"allocs_per_key\": %.2f, \"free_kb\": %lu, \"total_kb\": %lu, \"stack\": %lu, "
+		"\"idle_ms\": %.3f, \"idle_steps\": %u, \"max_step_us\": %.3f, \"max_step_nodes\": %lu}\n",
+		_trace, _keys, _total_ns / 1e6, _total_ns / 1e3 / keys, _max_ns / 1e3,
+		(unsigned long long)_cells, (double)_cells / keys, (unsigned long long)_syscalls, (double)_syscalls / keys,
+		allocs, (double)allocs / keys, mem_free() / 1024, mem_total() / 1024, stack_used(),
+		_idle_ns / 1e6, _idle_steps, _max_step_ns / 1e3, _max_step_nodes);
+}
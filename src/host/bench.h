@@ -0,0 +1,30 @@
+/*
+ * Measurements for replaying key traces in the hosted build.
+ *
+ * With FTE_BENCH set to the name of a trace, the keys are timed one by one
+ * and, instead of the screen, a line of JSON with the results is written to
+ * standard output when they run out. With FTE_IDLE set to a number, the
+ * editor is told that many times before each key that none is waiting, so it
+ * does as many steps of its idle work, which are timed apart from the keys.
+ */
+
+#ifndef __HOST_BENCH_H
+#define __HOST_BENCH_H
+
+#include <stdbool.h>
+
+bool host_bench_enabled(void);
+
+// Called for every kernel call except reading keys
+void host_bench_syscall(void);
+
+// Called as each key is read, which ends the work done for the one before
+void host_bench_key(void);
+
+// Called when the editor polls for a key and is told none is waiting, which
+// it does between steps of its idle work
+void host_bench_idle(void);
+
+void host_bench_report(void);
+
+#endif
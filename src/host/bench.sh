@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Replays key traces through the hosted build and prints the results as a
+# JSON array, one object per trace. Run from src/ after `make host`, or with
+# `make bench`. The traces and the files they use are written to a scratch
+# directory, BENCH_DIR. Without it one is made and removed afterwards, a
+# directory that is given is left in place.
+#
+
+FTE=${FTE:-$(pwd)/fte_host}
+BENCH_TEMP=
+if [ -z "$BENCH_DIR" ]; then
+	BENCH_DIR=$(mktemp -d) || exit 1
+	BENCH_TEMP=$BENCH_DIR
+fi
+LINES=${LINES:-2000}
+CORPUS_KB=${CORPUS_KB:-1024}
+
+cd "$BENCH_DIR" || exit 1
+
+# Text typed and opened by the traces, lines of 20 to 70 characters
+awk -v lines="$LINES" 'BEGIN {
+	for (i = 0; i < lines; ++i) {
+		line = sprintf("%5d the quick brown fox jumps over the lazy dog", i)
+		print substr(line, 1, 20 + (i * 7) % 51)
+	}
+}' > bench.txt
+
+# The same lines up to CORPUS_KB, opened as a paged document, with the only
+# occurrence of the word searched for at the end
+awk -v size="$CORPUS_KB" 'BEGIN {
+	for (i = 0; bytes < size * 1024; ++i) {
+		line = sprintf("%5d the quick brown fox jumps over the lazy dog", i)
+		line = substr(line, 1, 20 + (i * 7) % 51)
+		print line
+		bytes += length(line) + 1
+	}
+	print "zebra"
+}' > corpus.txt
+
+# Keys, CR is Enter, 0x0F Ctrl+O, 0x13 Ctrl+S, 0x06 Ctrl+F, 0x07 Ctrl+G, 0xA0
+# and 0xA1 the up and down arrows, 0xB5 F6 and 0xB7 F8
+open_file() { printf '\017%s\r' "$1"; }
+repeat() { awk -v n="$2" -v k="$1" 'BEGIN { for (i = 0; i < n; ++i) printf "%s", k }'; }
+
+tr '\n' '\r' < bench.txt > type.keys
+{ open_file bench.txt; repeat '\241' "$LINES"; } > down.keys
+{ open_file bench.txt; repeat '\r' 500; } > enter.keys
+{ open_file bench.txt; for i in 1 2 3 4 5 6 7 8 9 10; do printf 'x\023save%s.txt\r' "$i"; done; } > save.keys
+
+# From the second key of the word on, every key and every Ctrl+F after it
+# searches the whole corpus. Once with the literal search and once with the
+# regex engine.
+{ open_file corpus.txt; printf '\006zebra'; repeat '\006' 10; printf '\r'; } > search.keys
+{ open_file corpus.txt; printf '\007zebra'; repeat '\006' 10; printf '\r'; } > regex.keys
+
+# Every line is edited so it holds its own text, and then the cursor goes back
+# up through all of them. With F6 the lines off the screen are packed, and
+# going up unpacks them again. F8 writes the heap report, which gives the
+# compression ratio.
+edit_lines() { open_file bench.txt; repeat 'x\241' "$LINES"; }
+{ edit_lines; repeat '\240' "$LINES"; printf '\267'; } > edit.keys
+{ edit_lines; printf '\265'; repeat '\240' "$LINES"; printf '\267'; } > pack.keys
+
+# Every line is edited on the way down and grown into a larger size on the
+# way back up, which leaves the lines scattered over the heap. The compact
+# trace is given idle time before every key to move them back together, see
+# FTE_IDLE in host/bench.h. Its idle_ms and max_step_us show what that took.
+{ edit_lines; repeat 'yyyyyyyyyyyyyyyyyyyyyyyyyyyyyy\240' "$LINES"; printf '\267'; } > grow.keys
+cp grow.keys compact.keys
+
+echo "["
+first=1
+for trace in type down enter save search regex edit pack grow compact; do
+	[ $first -eq 1 ] || echo ","
+	first=0
+	idle=0
+	[ $trace = compact ] && idle=16
+	rm -f fte.mem
+	result=$(FTE_BENCH=$trace FTE_IDLE=$idle FTE_KEYS=$trace.keys "$FTE" | tr -d '\n')
+
+	# The heap report of a trace that wrote one is added to its results
+	if [ -f fte.mem ]; then
+		result="${result%\}}$(awk '{ printf ", \"mem_%s\": %s", $1, $2; value[$1] = $2 }
+			END { if (value["pack_bytes"] > 0) printf ", \"pack_ratio\": %.2f", value["pack_text"] / value["pack_bytes"] }' fte.mem)}"
+	fi
+	printf '%s' "$result"
+done
+echo
+echo "]"
+
+cd - > /dev/null
+if [ -n "$BENCH_TEMP" ]; then
+	rm -rf "$BENCH_TEMP"
+fi
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Opens files of growing size in the hosted build with heaps of different
+# sizes, edits every line so each holds its own text, and prints the heap
+# report F8 writes for every run as a JSON array. A run with "critical": 1
+# ran out of memory. Run from src/ after `make host`, or with `make heap`.
+#
+# HEAPS and LINES are lists of heap sizes in Kb and file sizes in lines.
+#
+
+FTE=${FTE:-$(pwd)/fte_host}
+HEAP_TEMP=
+if [ -z "$HEAP_DIR" ]; then
+	HEAP_DIR=$(mktemp -d) || exit 1
+	HEAP_TEMP=$HEAP_DIR
+fi
+HEAPS=${HEAPS:-128 256 384}
+LINES=${LINES:-1000 2000 4000 8000}
+
+cd "$HEAP_DIR" || exit 1
+
+# Keys, CR is Enter, 0x0F Ctrl+O, 0xA1 the down arrow and 0xB7 F8
+edit_file() {
+	printf '\017%s\r' "$1"
+	awk -v n="$2" 'BEGIN { for (i = 0; i < n; ++i) printf "x\241" }'
+	printf '\267'
+}
+
+echo "["
+first=1
+for lines in $LINES; do
+	awk -v lines="$lines" 'BEGIN {
+		for (i = 0; i < lines; ++i)
+			printf "%5d the quick brown fox jumps over the lazy dog\n", i
+	}' > heap.txt
+	edit_file heap.txt "$lines" > heap.keys
+
+	for heap in $HEAPS; do
+		rm -f fte.mem
+		FTE_HEAP=$heap FTE_KEYS=heap.keys "$FTE" > /dev/null 2>&1
+
+		[ $first -eq 1 ] || echo ","
+		first=0
+		printf '{"heap_kb": %s, "lines": %s' "$heap" "$lines"
+		[ -f fte.mem ] && awk '{ printf ", \"%s\": %s", $1, $2 }' fte.mem
+		printf '}'
+	done
+done
+echo
+echo "]"
+
+cd - > /dev/null
+if [ -n "$HEAP_TEMP" ]; then
+	rm -rf "$HEAP_TEMP"
+fi
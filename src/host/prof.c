@@ -0,0 +1,106 @@
+/*
+ * The profiler's timer for the hosted build, SIGPROF from setitimer() every
+ * millisecond of CPU time. The program counter is taken from the context
+ * the signal interrupted.
+ */
+
+#define _GNU_SOURCE
+#include <link.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "prof.h"
+
+#ifdef FTE_PERF
+
+#define HOST_PROF_INTERVAL_US	1000
+
+
+static unsigned long host_context_pc(void *context)
+{
+	ucontext_t *uc = context;
+
+#if defined(__x86_64__)
+	return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	return uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	return uc->uc_mcontext.pc;
+#else
+	return 0;
+#endif
+}
+
+static void host_prof_signal(int signal, siginfo_t *info, void *context)
+{
+	prof_sample(host_context_pc(context));
+}
+
+static void host_prof_interval(long us)
+{
+	struct itimerval timer;
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_interval.tv_usec = us;
+	timer.it_value.tv_usec = us;
+	setitimer(ITIMER_PROF, &timer, 0);
+}
+
+void prof_timer_start(void)
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = host_prof_signal;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigaction(SIGPROF, &action, 0);
+
+	host_prof_interval(HOST_PROF_INTERVAL_US);
+}
+
+void prof_timer_stop(void)
+{
+	host_prof_interval(0);
+	signal(SIGPROF, SIG_IGN);
+}
+
+const char *prof_timer_source(void)
+{
+	return "SIGPROF, every 1 ms of CPU time";
+}
+
+// The first object listed is the program itself, its executable segment is
+// the code. nm lists the addresses it is linked at, before relocation.
+static int host_find_code(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned long *range = data;
+
+	for (int i = 0; i < info->dlpi_phnum; ++i)
+	{
+		const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+
+		if (segment->p_type == PT_LOAD && (segment->p_flags & PF_X))
+		{
+			range[0] = info->dlpi_addr + segment->p_vaddr;
+			range[1] = range[0] + segment->p_memsz;
+			range[2] = segment->p_vaddr;
+			break;
+		}
+	}
+
+	return 1;
+}
+
+void prof_code_range(unsigned long *start, unsigned long *end, unsigned long *linked)
+{
+	unsigned long range[3] = { 0, 0, 0 };
+
+	dl_iterate_phdr(host_find_code, range);
+	*start = range[0];
+	*end = range[1];
+	*linked = range[2];
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * The stack canary for the hosted build. There is no linker script to say
+ * where the stack is, so an area below the frame of a constructor is painted
+ * before main() runs, and the depth is measured down from the top of it.
+ */
+
+#include <stdint.h>
+
+#include "stack.h"
+
+#define HOST_STACK_WATCH    (64 * 1024)
+
+static uintptr_t _stack_top;
+static uintptr_t _stack_bottom;
+
+
+__attribute__((noinline)) static void host_stack_paint(void)
+{
+	volatile uint32_t area[HOST_STACK_WATCH / 4];
+
+	for (uint32_t i = 0; i < HOST_STACK_WATCH / 4; ++i)
+		area[i] = STACK_CANARY;
+
+	_stack_bottom = (uintptr_t)&area[0];
+	_stack_top = (uintptr_t)&area[HOST_STACK_WATCH / 4];
+}
+
+__attribute__((constructor)) static void host_stack_startup(void)
+{
+	host_stack_paint();
+}
+
+// The frames being run are in the area too, and their guards are not to be
+// reported as read
+__attribute__((no_sanitize_address)) unsigned long stack_used(void)
+{
+	volatile uint32_t *it = (volatile uint32_t *)_stack_bottom;
+
+	while ((uintptr_t)it < _stack_top && *it == STACK_CANARY)
+		++it;
+
+	return (unsigned long)(_stack_top - (uintptr_t)it);
+}
+
+unsigned long stack_size(void)
+{
+	return HOST_STACK_WATCH;
+}
@@ -0,0 +1,44 @@
+/*
+ * What foenix/startup.s and the linker script set up on the machine, for the
+ * hosted build: the heap between the program and its stack, and the RAM above
+ * the program window.
+ *
+ * FTE_HEAP sets the size of the heap in Kb, 320 by default, about what is
+ * left of the 384 Kb window. FTE_RAM sets the RAM above the window in Kb,
+ * none by default as on an A2560U with the editor linked to the top of RAM.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mem.h"
+
+#define HOST_HEAP_MAX       (4 * 1024 * 1024)
+#define HOST_HIGH_RAM_MAX   (16 * 1024 * 1024)
+
+void mem_init(uint8_t *heap, uint8_t *heap_end);
+
+static _Alignas(MEM_ALIGN) uint8_t _heap[HOST_HEAP_MAX];
+
+// Named after the linker symbol mem_add_system_ram() starts from
+_Alignas(MEM_ALIGN) uint8_t __STACK[HOST_HIGH_RAM_MAX];
+unsigned long host_high_ram_size;
+
+
+static unsigned long host_size(const char *name, unsigned long size, unsigned long max)
+{
+	const char *value = getenv(name);
+
+	if (value != 0)
+		size = strtoul(value, 0, 10) * 1024;
+
+	return size < max ? size : max;
+}
+
+__attribute__((constructor)) static void host_startup(void)
+{
+	unsigned long heap_size = host_size("FTE_HEAP", 320 * 1024, HOST_HEAP_MAX);
+
+	host_high_ram_size = host_size("FTE_RAM", 0, HOST_HIGH_RAM_MAX);
+	mem_init(_heap, _heap + heap_size);
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# Edits until the heap is exhausted and checks that the editor is still
+# running afterwards, with the document saved intact. Run from src/ after
+# `make host`, or with `make test`.
+#
+# Every run opens a file of random lines, a paged one for larger sizes, and
+# either grows it with a replace-all that lengthens every line or duplicates
+# lines until memory runs out. It then saves the document with Ctrl+S. A run
+# fails if the editor exits with an error, or if the file it saved does not
+# hold as many lines as it opened. RUNS sets the number of runs, the seeds
+# are 1 to RUNS. A few fixed edits that once broke are checked first.
+#
+
+FTE=${FTE:-$(pwd)/fte_host}
+STRESS_TEMP=
+if [ -z "$STRESS_DIR" ]; then
+	STRESS_DIR=$(mktemp -d) || exit 1
+	STRESS_TEMP=$STRESS_DIR
+fi
+RUNS=${RUNS:-40}
+
+cd "$STRESS_DIR" || exit 1
+
+failed=0
+
+# Edits that once went wrong, as keys and the file they should save. Each
+# ends with Ctrl+S (0x13) saving to check.txt.
+check() {
+	rm -f check.txt
+	printf "$2\023check.txt\r" > check.keys
+	FTE_KEYS=check.keys "$FTE" > check.out 2>&1
+	status=$?
+
+	if [ $status -ne 0 ]; then
+		echo "$1: exited with $status"
+		failed=$((failed + 1))
+	elif [ "$(cat check.txt)" != "$(printf "$3")" ]; then
+		echo "$1: saved \"$(cat check.txt)\", expected \"$(printf "$3")\""
+		failed=$((failed + 1))
+	fi
+}
+
+# Enter on the empty first line of a duplicate, whose text is shared with the
+# clipboard after a cut and paste: left (0xA2), Ctrl+D (0x04), Enter, up
+# (0xA0), Ctrl+K (0x0B) and Ctrl+V (0x16)
+check "split a shared line" '}\242\004\r\240\013\026' '}\n\n}'
+
+seed=1
+while [ $seed -le "$RUNS" ]; do
+	# Lines of a, x and spaces, 20 to 400 Kb in total
+	awk -v seed="$seed" 'BEGIN {
+		srand(seed)
+		lines = 500 + int(rand() * 9500)
+		for (i = 0; i < lines; ++i) {
+			len = int(rand() * 60)
+			line = ""
+			for (j = 0; j < len; ++j)
+				line = line substr("aax ", 1 + int(rand() * 4), 1)
+			print line
+		}
+	}' > stress.txt
+	lines=$(wc -l < stress.txt)
+
+	# Keys, CR is Enter, 0x0F Ctrl+O, 0x05 Ctrl+E, 0x04 Ctrl+D, 0xA1 the
+	# down arrow and 0x13 Ctrl+S
+	{
+		printf '\017stress.txt\r'
+		if [ $((seed % 2)) -eq 1 ]; then
+			printf '\005x*\rlonger text here\r'
+		else
+			awk 'BEGIN { for (i = 0; i < 3000; ++i) printf "\004\241" }'
+		fi
+		printf '\023stress.txt\r'
+	} > stress.keys
+
+	FTE_KEYS=stress.keys "$FTE" > stress.out 2>&1
+	status=$?
+	saved=$(wc -l < stress.txt)
+
+	if [ $status -ne 0 ]; then
+		echo "seed $seed: exited with $status, $(tail -c 200 stress.out | tr -d '\n' | tr -s ' ')"
+		failed=$((failed + 1))
+	elif [ "$saved" -lt "$lines" ]; then
+		echo "seed $seed: opened $lines lines, saved $saved"
+		failed=$((failed + 1))
+	fi
+
+	seed=$((seed + 1))
+done
+
+echo "$RUNS runs, $failed failed"
+
+cd - > /dev/null
+if [ -n "$STRESS_TEMP" ]; then
+	rm -rf "$STRESS_TEMP"
+fi
+[ $failed -eq 0 ]
@@ -0,0 +1,292 @@
+/*
+ * The kernel calls the editor makes, implemented over POSIX for the hosted
+ * build.
+ *
+ * Channel 0 is the console. Keys are read from the file named by FTE_KEYS,
+ * or from standard input, as the raw bytes the keyboard channel would
+ * deliver. Once they run out the screen, or the results of a benchmark, is
+ * written to standard output and the editor exits. Text written to channel 0
+ * goes to standard error. Other channels are file descriptors.
+ *
+ * With FTE_STACK_BUDGET set to a number of bytes, a run whose stack went
+ * deeper than that exits with status 3, see stack.h.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The kernel entry point is named like the POSIX one unistd.h declares
+#define syscall mcp_syscall
+#include "syscalls.h"
+#undef syscall
+#include "vicky3.h"
+#include "bench.h"
+#include "perf.h"
+#include "stack.h"
+
+// Size of the RAM above the program window, see host/startup.c
+extern unsigned long host_high_ram_size;
+
+// The keys are read in one go, so it is known whether more are waiting
+static uint8_t *_keys = 0;
+static size_t _key_count = 0;
+static size_t _key_pos = 0;
+
+// Polls before each key is reported waiting in a benchmark, see FTE_IDLE in
+// bench.h, and those left before the next one
+static long _idle_per_key = 0;
+static long _idle_polls = 0;
+
+
+// Every call but reading keys is counted for a benchmark, and all of them by
+// number in a PERF=1 build as startup.s does on the machine
+static void host_count(short function)
+{
+	host_bench_syscall();
+	PERF_SYSCALL(function);
+}
+
+static void host_load_keys(void)
+{
+	const char *path = getenv("FTE_KEYS");
+	const char *idle = getenv("FTE_IDLE");
+	int fd = path != 0 ? open(path, O_RDONLY) : STDIN_FILENO;
+	size_t cap = 4096;
+	ssize_t count;
+
+	if (fd < 0)
+	{
+		perror(path);
+		exit(2);
+	}
+
+	_keys = malloc(cap);
+	while ((count = read(fd, _keys + _key_count, cap - _key_count)) > 0)
+	{
+		_key_count += count;
+		if (_key_count == cap)
+			_keys = realloc(_keys, cap *= 2);
+	}
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if (idle != 0)
+		_idle_per_key = strtol(idle, 0, 10);
+}
+
+// With FTE_STACK_BUDGET set, a run that went deeper than that many bytes of
+// stack fails
+static void host_check_stack(void)
+{
+	const char *budget = getenv("FTE_STACK_BUDGET");
+
+	if (budget != 0 && stack_used() > strtoul(budget, 0, 10))
+	{
+		fprintf(stderr, "stack used %lu bytes, over the budget of %s\n", stack_used(), budget);
+		exit(3);
+	}
+}
+
+static short host_read_key(void)
+{
+	if (_keys == 0)
+		host_load_keys();
+
+	host_bench_key();
+
+	if (_key_pos < _key_count)
+	{
+		_idle_polls = _idle_per_key;
+		return _keys[_key_pos++];
+	}
+
+	if (host_bench_enabled())
+		host_bench_report();
+	else
+		host_dump_screen(stdout);
+
+	host_check_stack();
+	exit(0);
+}
+
+void sys_exit(short result)
+{
+	host_count(KFN_EXIT);
+	host_check_stack();
+	exit(result);
+}
+
+void sys_get_info(p_sys_info info)
+{
+	host_count(KFN_SYS_GET_INFO);
+	memset(info, 0, sizeof(*info));
+
+	info->model_name = "Host";
+	info->cpu_name = "Host";
+
+	// Host RAM starts at __STACK (the Makefile sets MEM_RAM_BASE to it). The
+	// kernel keeps the top 64 KB, mem_add_system_ram() leaves it out.
+	if (host_high_ram_size > 0)
+		info->system_ram_size = (long)(host_high_ram_size + 0x10000);
+}
+
+short sys_chan_read_b(short channel)
+{
+	unsigned char b;
+
+	if (channel == 0)
+	{
+		PERF_SYSCALL(KFN_CHAN_READ_B);
+		return host_read_key();
+	}
+
+	host_count(KFN_CHAN_READ_B);
+	return read(channel, &b, 1) == 1 ? b : -1;
+}
+
+short sys_chan_read(short channel, unsigned char * buffer, short size)
+{
+	host_count(KFN_CHAN_READ);
+	return read(channel, buffer, size);
+}
+
+short sys_chan_write_b(short channel, unsigned char b)
+{
+	return sys_chan_write(channel, &b, 1);
+}
+
+short sys_chan_write(short channel, unsigned char * buffer, short size)
+{
+	host_count(KFN_CHAN_WRITE);
+	return write(channel == 0 ? STDERR_FILENO : channel, buffer, size);
+}
+
+// Scripted keys are reported as not pending, which gives the editor its idle
+// time between every key as if they were typed. A benchmark replays them as
+// if they were held down instead, after FTE_IDLE polls that find none.
+short sys_chan_status(short channel)
+{
+	host_count(KFN_CHAN_STATUS);
+
+	if (channel == 0 && host_bench_enabled() && _key_pos < _key_count)
+	{
+		if (_idle_polls == 0)
+			return CDEV_STAT_READABLE;
+
+		--_idle_polls;
+		host_bench_idle();
+	}
+	return 0;
+}
+
+short sys_chan_seek(short channel, long position, short base)
+{
+	host_count(KFN_CHAN_SEEK);
+	return lseek(channel, position, base == CDEV_SEEK_ABSOLUTE ? SEEK_SET : SEEK_CUR) < 0 ? -1 : 0;
+}
+
+short sys_chan_ioctrl(short channel, short command, uint8_t * buffer, short size)
+{
+	host_count(KFN_CHAN_IOCTRL);
+	return 0;
+}
+
+short sys_fsys_open(const char * path, short mode)
+{
+	int flags = O_RDONLY;
+
+	host_count(KFN_OPEN);
+
+	if (mode & FILE_MODE_WRITE)
+	{
+		flags = (mode & FILE_MODE_READ) ? O_RDWR : O_WRONLY;
+		if (mode & FILE_MODE_CREATE_ALWAYS)
+			flags |= O_CREAT | O_TRUNC;
+		if (mode & FILE_MODE_CREATE_NEW)
+			flags |= O_CREAT | O_EXCL;
+	}
+
+	int fd = open(path, flags, 0644);
+	return fd < 0 ? -1 : fd;
+}
+
+short sys_fsys_close(short fd)
+{
+	host_count(KFN_CLOSE);
+	return close(fd);
+}
+
+// Directories are not listed, the pattern is taken as the name of one file
+short sys_fsys_findfirst(const char * path, const char * pattern, p_file_info file)
+{
+	char name[MAX_PATH_LEN * 2];
+	struct stat st;
+
+	host_count(KFN_FINDFIRST);
+
+	if (path[0] != 0)
+		snprintf(name, sizeof(name), "%s/%s", path, pattern);
+	else
+		snprintf(name, sizeof(name), "%s", pattern);
+
+	if (stat(name, &st) != 0)
+		return -1;
+
+	memset(file, 0, sizeof(*file));
+	file->size = st.st_size;
+	strncpy(file->name, pattern, MAX_PATH_LEN - 1);
+	return 1;
+}
+
+short sys_fsys_closedir(short dir)
+{
+	host_count(KFN_CLOSEDIR);
+	return 0;
+}
+
+short sys_fsys_delete(const char * path)
+{
+	host_count(KFN_DELETE);
+	return unlink(path);
+}
+
+short sys_fsys_rename(const char * old_path, const char * new_path)
+{
+	host_count(KFN_RENAME);
+	return rename(old_path, new_path);
+}
+
+short sys_fsys_load(const char * path, long destination, long * start)
+{
+	host_count(KFN_LOAD);
+
+	FILE *file = fopen(path, "rb");
+	if (file == 0)
+		return -1;
+
+	size_t size = 0;
+	size_t count;
+
+	while ((count = fread((uint8_t *)destination + size, 1, 4096, file)) > 0)
+		size += count;
+
+	fclose(file);
+
+	if (start != 0)
+		*start = 0;
+	return 0;
+}
+
+long sys_time_jiffies()
+{
+	struct timespec now;
+
+	host_count(KFN_TIME_JIFFIES);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 60 + now.tv_nsec / 16666667;
+}
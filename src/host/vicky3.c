@@ -0,0 +1,46 @@
+#include "vicky3.h"
+
+
+volatile uint32_t host_master_control;
+volatile uint32_t host_border_control[2];
+volatile uint32_t host_cursor_settings;
+volatile uint32_t host_cursor_position;
+volatile char host_text_plane[VKY3_PLANE_SIZE];
+volatile char host_color_plane[VKY3_PLANE_SIZE];
+
+
+void host_dump_screen(FILE *file)
+{
+	static const int16_t columns_max[] = { 80, 100, 128, 80 };
+	static const int16_t rows_max[] = { 60, 75, 96, 50 };
+
+	uint8_t resolution = (host_master_control & VKY3_MCR_RESOLUTION_MASK) >> 8;
+	int16_t columns = columns_max[resolution];
+	int16_t rows = rows_max[resolution];
+
+	if (host_master_control & VKY3_MCR_DOUBLE_EN)
+	{
+		columns /= 2;
+		rows /= 2;
+	}
+
+	// The border hides the same rows and columns console.c leaves out
+	int16_t visible_columns = columns;
+	int16_t visible_rows = rows;
+
+	if (host_border_control[0] & VKY3_BRDR_EN)
+	{
+		visible_columns -= ((host_border_control[0] & VKY3_X_SIZE_MASK) >> 8) / 4;
+		visible_rows -= ((host_border_control[0] & VKY3_Y_SIZE_MASK) >> 16) / 4;
+	}
+
+	for (int16_t y = 0; y < visible_rows; ++y)
+	{
+		fputc('|', file);
+		for (int16_t x = 0; x < visible_columns; ++x)
+			fputc(host_text_plane[y * columns + x], file);
+		fputs("|\n", file);
+	}
+
+	fprintf(file, "cursor %u,%u\n", (unsigned)(host_cursor_position & 0xFFFF), (unsigned)(host_cursor_position >> 16));
+}
@@ -0,0 +1,46 @@
+/*
+ * Stand-in for the VICKY III definitions console.c uses, for the hosted build.
+ *
+ * The registers and the text and color planes are plain memory defined in
+ * host/vicky3.c, so the console code runs unchanged on a workstation and what
+ * it draws can be dumped afterwards.
+ */
+
+#ifndef __VICKY3_H
+#define __VICKY3_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define VKY3_MCR_TEXT_EN            0x00000001
+#define VKY3_MCR_640x480            0x00000000
+#define VKY3_MCR_RESOLUTION_MASK    0x00000300
+#define VKY3_MCR_DOUBLE_EN          0x00000400
+
+#define VKY3_BRDR_EN                0x00000001
+#define VKY3_X_SIZE_MASK            0x00003F00
+#define VKY3_Y_SIZE_MASK            0x003F0000
+
+#define VKY3_PLANE_SIZE             0x2000
+
+extern volatile uint32_t host_master_control;
+extern volatile uint32_t host_border_control[2];
+extern volatile uint32_t host_cursor_settings;
+extern volatile uint32_t host_cursor_position;
+extern volatile char host_text_plane[VKY3_PLANE_SIZE];
+extern volatile char host_color_plane[VKY3_PLANE_SIZE];
+
+#define MASTER_CONTROL_REG_A        (&host_master_control)
+#define BORDER_CONTROL_REG_A        (host_border_control)
+#define CURSOR_SETTINGS_REG_A       (&host_cursor_settings)
+#define CURSOR_POSITION_REG_A       (&host_cursor_position)
+#define SCREEN_TEXT_A               (host_text_plane)
+#define COLOR_TEXT_A                (host_color_plane)
+
+/*
+ * Writes the visible part of the text plane to a file, one row per line, and
+ * the cursor position after it.
+ */
+void host_dump_screen(FILE *file);
+
+#endif
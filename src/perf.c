@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include "perf.h"
+
+#ifdef FTE_PERF
+
+#include "syscalls.h"
+#include "console.h"
+
+
+#define PERF_OVERLAY_WIDTH      32
+#define PERF_OVERLAY_LINE_SIZE  56      // a line with both counts at their widest, it is cut to the overlay
+#define PERF_OVERLAY_KFNS       2
+
+
+uint32_t perf_counters[PERF_COUNTERS];
+uint32_t perf_syscalls[PERF_KFN_COUNT];
+
+static const char *_counter_names[PERF_COUNTERS] = {
+	"vram", "set_xy", "alloc", "grow", "lines"
+};
+
+// Totals at the end of the last frame, which the next one is counted from
+static uint32_t _seen_counters[PERF_COUNTERS];
+static uint32_t _seen_syscalls[PERF_KFN_COUNT];
+
+static long _frame_start = 0;
+static uint32_t _jiffies_total = 0;
+static bool _overlay = false;
+
+static uint32_t _latency[PERF_LATENCY_BUCKETS];
+static uint32_t _latency_max = 0;
+
+
+static uint32_t perf_syscall_total(uint32_t *counts)
+{
+	uint32_t total = 0;
+
+	for (uint8_t i = 0; i < PERF_KFN_COUNT; ++i)
+		total += counts[i];
+
+	return total;
+}
+
+static void perf_overlay_line(int16_t x, int16_t y, const char *name, uint32_t frame, uint32_t total)
+{
+	char line[PERF_OVERLAY_LINE_SIZE];
+	size_t len;
+
+	len = snprintf(line, sizeof(line), " %-10.10s %8lu %10lu ", name, (unsigned long)frame, (unsigned long)total);
+	con_set_xy(x, y);
+	con_write((uint8_t *)line, len < PERF_OVERLAY_WIDTH ? len : PERF_OVERLAY_WIDTH);
+}
+
+// Draws the counters in the top right corner, the busiest kernel calls last
+static void perf_overlay_draw(uint32_t jiffies)
+{
+	char line[PERF_OVERLAY_WIDTH + 1];
+	char name[16];
+	int16_t width, height;
+	int16_t x, y = 0;
+	uint8_t shown[PERF_OVERLAY_KFNS];
+
+	con_get_size(&width, &height);
+	x = width - PERF_OVERLAY_WIDTH;
+
+	con_set_color(CON_COLOR_BLACK, CON_COLOR_CYAN);
+
+	snprintf(line, sizeof(line), " %-10s %8s %10s ", "counter", "key", "total");
+	con_set_xy(x, y++);
+	con_write((uint8_t *)line, strlen(line));
+
+	for (uint8_t i = 0; i < PERF_COUNTERS; ++i)
+		perf_overlay_line(x, y++, _counter_names[i], perf_counters[i] - _seen_counters[i], perf_counters[i]);
+
+	perf_overlay_line(x, y++, "syscalls", perf_syscall_total(perf_syscalls) - perf_syscall_total(_seen_syscalls), perf_syscall_total(perf_syscalls));
+	perf_overlay_line(x, y++, "jiffies", jiffies, _jiffies_total);
+
+	for (uint8_t n = 0; n < PERF_OVERLAY_KFNS; ++n)
+	{
+		uint8_t busiest = 0;
+
+		for (uint8_t i = 1; i < PERF_KFN_COUNT; ++i)
+		{
+			bool taken = false;
+
+			for (uint8_t j = 0; j < n; ++j)
+				taken |= shown[j] == i;
+
+			if (!taken && perf_syscalls[i] > perf_syscalls[busiest])
+				busiest = i;
+		}
+
+		shown[n] = busiest;
+		snprintf(name, sizeof(name), "kfn %02X", busiest);
+		perf_overlay_line(x, y++, name, perf_syscalls[busiest] - _seen_syscalls[busiest], perf_syscalls[busiest]);
+	}
+
+	con_set_color(CON_COLOR_GREY, CON_COLOR_BLUE);
+}
+
+static void perf_latency_add(uint32_t jiffies)
+{
+	uint8_t bucket = 0;
+
+	while (bucket < PERF_LATENCY_BUCKETS - 1 && jiffies >= (1ul << bucket))
+		++bucket;
+
+	_latency[bucket]++;
+	if (jiffies > _latency_max)
+		_latency_max = jiffies;
+}
+
+// The lowest latency that goes into a bucket
+static uint32_t perf_latency_floor(uint8_t bucket)
+{
+	return bucket == 0 ? 0 : 1ul << (bucket - 1);
+}
+
+void perf_frame_begin(void)
+{
+	_frame_start = sys_time_jiffies();
+}
+
+void perf_frame_end(uint16_t cursor_x, uint16_t cursor_y)
+{
+	uint32_t jiffies = sys_time_jiffies() - _frame_start;
+
+	_jiffies_total += jiffies;
+	perf_latency_add(jiffies);
+
+	if (_overlay)
+	{
+		perf_overlay_draw(jiffies);
+		con_set_xy(cursor_x, cursor_y);
+	}
+
+	// Drawing the overlay is left out of the next frame
+	memcpy(_seen_counters, perf_counters, sizeof(_seen_counters));
+	memcpy(_seen_syscalls, perf_syscalls, sizeof(_seen_syscalls));
+}
+
+bool perf_toggle_overlay(void)
+{
+	_overlay = !_overlay;
+	return _overlay;
+}
+
+void perf_latency_format(char *buffer, uint16_t size)
+{
+	uint16_t len = snprintf(buffer, size, "Latency");
+
+	for (uint8_t i = 0; i < PERF_LATENCY_BUCKETS && len < size; ++i)
+		len += snprintf(buffer + len, size - len, " %lu%s:%lu", (unsigned long)perf_latency_floor(i), i == PERF_LATENCY_BUCKETS - 1 ? "+" : "", (unsigned long)_latency[i]);
+
+	if (len < size)
+		snprintf(buffer + len, size - len, " max %lu", (unsigned long)_latency_max);
+}
+
+// One bucket per line, its lowest latency and the number of keys, so the
+// files from two builds can be compared side by side
+bool perf_latency_dump(const char *path)
+{
+	char line[32];
+	short file_chan = sys_fsys_open(path, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+
+	if (file_chan <= 0)
+		return false;
+
+	snprintf(line, sizeof(line), "# jiffies keys, max %lu\n", (unsigned long)_latency_max);
+	sys_chan_write(file_chan, (uint8_t *)line, strlen(line));
+
+	for (uint8_t i = 0; i < PERF_LATENCY_BUCKETS; ++i)
+	{
+		snprintf(line, sizeof(line), "%lu %lu\n", (unsigned long)perf_latency_floor(i), (unsigned long)_latency[i]);
+		sys_chan_write(file_chan, (uint8_t *)line, strlen(line));
+	}
+
+	sys_fsys_close(file_chan);
+	return true;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Performance counters, built with PERF=1 (FTE_PERF). The hot spots count
+ * into a fixed table and F12 shows them over the text, for the last key and
+ * since startup. Without FTE_PERF the macros are empty and nothing of this is
+ * compiled in.
+ */
+
+#define PERF_VRAM_BYTES         0       /* Bytes written to the text and color planes */
+#define PERF_SET_XY             1       /* con_set_xy() calls */
+#define PERF_ALLOC_BYTES        2       /* Bytes handed out by mem_alloc() */
+#define PERF_GROW_LINE          3       /* Lines an edit moved into a new allocation */
+#define PERF_LINES_RENDERED     4       /* Lines drawn by display_line() */
+#define PERF_COUNTERS           5
+
+// Kernel calls are counted by function number, KFN_*
+#define PERF_KFN_COUNT          0x80
+
+// Jiffies from a key being read to its paint being done, in buckets of 0, 1,
+// 2-3, 4-7 and so on, the last one taking everything from 64 up
+#define PERF_LATENCY_BUCKETS    8
+
+
+#ifdef FTE_PERF
+
+extern uint32_t perf_counters[PERF_COUNTERS];
+extern uint32_t perf_syscalls[PERF_KFN_COUNT];
+
+#define PERF_ADD(counter, n)    (perf_counters[counter] += (n))
+#define PERF_COUNT(counter)     (perf_counters[counter]++)
+#define PERF_SYSCALL(function)  (perf_syscalls[(function) & (PERF_KFN_COUNT - 1)]++)
+
+// A frame is the work done for one key, up to the cursor being put back
+#define PERF_FRAME_BEGIN()      perf_frame_begin()
+#define PERF_FRAME_END(x, y)    perf_frame_end(x, y)
+
+void perf_frame_begin(void);
+void perf_frame_end(uint16_t cursor_x, uint16_t cursor_y);
+
+// Returns whether the overlay is now shown
+bool perf_toggle_overlay(void);
+
+// The latency histogram on one line for the status bar, and as text in a file
+void perf_latency_format(char *buffer, uint16_t size);
+bool perf_latency_dump(const char *path);
+
+#else
+
+#define PERF_ADD(counter, n)    ((void)0)
+#define PERF_COUNT(counter)     ((void)0)
+#define PERF_SYSCALL(function)  ((void)0)
+#define PERF_FRAME_BEGIN()      ((void)0)
+#define PERF_FRAME_END(x, y)    ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include "prof.h"
+
+#ifdef FTE_PERF
+
+#include "syscalls.h"
+
+
+static uint16_t _buckets[PROF_BUCKETS];
+static unsigned long _code_start = 0;
+static unsigned long _code_end = 0;
+static unsigned long _code_linked = 0;
+static uint8_t _bucket_shift = 0;
+
+static uint32_t _samples = 0;
+static uint32_t _outside = 0;
+static bool _running = false;
+
+
+void prof_start(void)
+{
+	if (_running)
+		return;
+
+	// The buckets are sized once so all of the code fits
+	if (_bucket_shift == 0)
+	{
+		prof_code_range(&_code_start, &_code_end, &_code_linked);
+
+		_bucket_shift = 1;
+		while ((1ul << _bucket_shift) < PROF_MIN_BUCKET || ((_code_end - _code_start) >> _bucket_shift) >= PROF_BUCKETS)
+			++_bucket_shift;
+	}
+
+	memset(_buckets, 0, sizeof(_buckets));
+	_samples = 0;
+	_outside = 0;
+	_running = true;
+
+	prof_timer_start();
+}
+
+void prof_stop(void)
+{
+	if (!_running)
+		return;
+
+	prof_timer_stop();
+	_running = false;
+}
+
+bool prof_running(void)
+{
+	return _running;
+}
+
+// Samples outside the program, in the kernel or a library, are only counted
+void prof_sample(unsigned long pc)
+{
+	++_samples;
+
+	if (pc < _code_start || pc >= _code_end)
+	{
+		++_outside;
+		return;
+	}
+
+	uint16_t *bucket = &_buckets[(pc - _code_start) >> _bucket_shift];
+	if (*bucket < 0xFFFF)
+		++*bucket;
+}
+
+bool prof_dump(const char *path, unsigned long *busiest)
+{
+	char line[80];
+	uint16_t most = 0;
+	short file_chan = sys_fsys_open(path, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+
+	if (file_chan <= 0)
+		return false;
+
+	*busiest = 0;
+
+	snprintf(line, sizeof(line), "# fte profile %lu %lu %lu\n", (unsigned long)_samples, (unsigned long)_outside, 1ul << _bucket_shift);
+	sys_chan_write(file_chan, (uint8_t *)line, strlen(line));
+	snprintf(line, sizeof(line), "# sampled by %s\n", prof_timer_source());
+	sys_chan_write(file_chan, (uint8_t *)line, strlen(line));
+
+	for (uint16_t i = 0; i < PROF_BUCKETS; ++i)
+	{
+		unsigned long address = _code_linked + ((unsigned long)i << _bucket_shift);
+
+		if (_buckets[i] == 0)
+			continue;
+
+		if (_buckets[i] > most)
+		{
+			most = _buckets[i];
+			*busiest = address;
+		}
+
+		snprintf(line, sizeof(line), "%08lX %u\n", address, _buckets[i]);
+		sys_chan_write(file_chan, (uint8_t *)line, strlen(line));
+	}
+
+	sys_fsys_close(file_chan);
+	return true;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Sampling profiler, built with PERF=1 (FTE_PERF). While it runs, a timer
+ * interrupt samples the program counter into a histogram of the code, which
+ * is written to a file as text, one bucket per line. prof/fte_prof.c names
+ * the buckets from the vlink map, or from nm for the hosted build.
+ *
+ * The timer is the platform's, foenix/prof.c on the machine and host/prof.c
+ * with setitimer() and SIGPROF on a workstation. On the machine it is GABE
+ * timer 0 at a rate that is not a multiple of the 60 Hz frame, so the samples
+ * are not in step with the display. The file names the timer so fte_prof can
+ * say which it was.
+ */
+
+#define PROF_BUCKETS            4096
+#define PROF_MIN_BUCKET         16      /* Smallest stretch of code a bucket covers, in bytes */
+
+
+#ifdef FTE_PERF
+
+void prof_start(void);
+void prof_stop(void);
+bool prof_running(void);
+
+// Called from the timer with the address the program was interrupted at
+void prof_sample(unsigned long pc);
+
+// Writes the histogram and returns the linked address of the busiest bucket
+bool prof_dump(const char *path, unsigned long *busiest);
+
+// Provided by the platform. The range is where the code is loaded, and the
+// address it was linked at is what the map lists for the start of it. The
+// timer source is a description written to the file for fte_prof.
+void prof_timer_start(void);
+void prof_timer_stop(void);
+void prof_code_range(unsigned long *start, unsigned long *end, unsigned long *linked);
+const char *prof_timer_source(void);
+
+#endif
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Names the buckets of a profile F10 writes to fte.prf, see prof.h, and
+ * lists the functions by the samples taken in them.
+ *
+ *     fte_prof fte.map fte.prf
+ *     nm fte_host > fte_host.sym && fte_prof fte_host.sym fte.prf
+ *
+ * The symbols are read from the map vlink writes with -Mmapfile, or from
+ * the output of nm for the hosted build. A bucket counts towards the symbol
+ * at its start, so with large buckets a short function can be charged to
+ * the one before it. The numbered labels vbcc gives its branches and static
+ * data are left out of the map, so they do not split functions.
+ *
+ * The timer the samples were taken with is printed with the totals, see
+ * prof.h.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROF_MAX_SYMBOLS 8192
+
+
+typedef struct symbol_t {
+    unsigned long address;
+    char name[64];
+    unsigned long samples;
+} symbol_t;
+
+static symbol_t _symbols[PROF_MAX_SYMBOLS];
+static int _symbol_count = 0;
+
+
+static int prof_address_compare(const void *a, const void *b)
+{
+    unsigned long x = ((const symbol_t *)a)->address;
+    unsigned long y = ((const symbol_t *)b)->address;
+    return x < y ? -1 : x > y;
+}
+
+static int prof_samples_compare(const void *a, const void *b)
+{
+    unsigned long x = ((const symbol_t *)a)->samples;
+    unsigned long y = ((const symbol_t *)b)->samples;
+    return x > y ? -1 : x < y;
+}
+
+// vlink lists a symbol as "  0x00020000 _main: global reloc, value 0x0,
+// size 0" and nm as "0000000000001139 T main". Only code is taken from nm.
+static void prof_load_symbols(const char *path)
+{
+    char line[256];
+    FILE *file = fopen(path, "r");
+
+    if (file == 0)
+    {
+        perror(path);
+        exit(2);
+    }
+
+    while (fgets(line, sizeof(line), file) != 0 && _symbol_count < PROF_MAX_SYMBOLS)
+    {
+        symbol_t *symbol = &_symbols[_symbol_count];
+        unsigned long address;
+        char type;
+        char name[sizeof(symbol->name)];
+
+        if (sscanf(line, " 0x%lx %63[^:]:", &address, name) == 2 && strstr(line, "value") != 0)
+        {
+            // vbcc names its labels l1, l2 and so on, they would split functions
+            if (name[0] == 'l' && name[1] != 0 && strspn(name + 1, "0123456789") == strlen(name + 1))
+                continue;
+        }
+        else if (sscanf(line, "%lx %c %63s", &address, &type, name) == 3 && (type == 't' || type == 'T'))
+            ;
+        else
+            continue;
+
+        symbol->address = address;
+        strcpy(symbol->name, name);
+        symbol->samples = 0;
+        _symbol_count++;
+    }
+
+    fclose(file);
+    qsort(_symbols, _symbol_count, sizeof(symbol_t), prof_address_compare);
+}
+
+static symbol_t *prof_symbol(unsigned long address)
+{
+    int low = 0;
+    int high = _symbol_count - 1;
+    symbol_t *found = 0;
+
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+
+        if (_symbols[mid].address <= address)
+        {
+            found = &_symbols[mid];
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    char line[128];
+    char timer[128] = "an unknown timer";
+    unsigned long samples = 0, outside = 0, bucket_size = 0;
+    unsigned long unnamed = 0;
+    FILE *file;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: fte_prof mapfile fte.prf\n");
+        return 2;
+    }
+
+    prof_load_symbols(argv[1]);
+
+    file = fopen(argv[2], "r");
+    if (file == 0)
+    {
+        perror(argv[2]);
+        return 2;
+    }
+
+    if (fgets(line, sizeof(line), file) == 0 || sscanf(line, "# fte profile %lu %lu %lu", &samples, &outside, &bucket_size) != 3)
+    {
+        fprintf(stderr, "%s: not a profile\n", argv[2]);
+        return 2;
+    }
+
+    while (fgets(line, sizeof(line), file) != 0)
+    {
+        unsigned long address, count;
+
+        if (sscanf(line, "# sampled by %127[^\n]", timer) == 1)
+            continue;
+        if (sscanf(line, "%lx %lu", &address, &count) != 2)
+            continue;
+
+        symbol_t *symbol = prof_symbol(address);
+        if (symbol != 0)
+            symbol->samples += count;
+        else
+            unnamed += count;
+    }
+
+    fclose(file);
+
+    printf("%lu samples, %lu outside the program, %lu byte buckets\n", samples, outside, bucket_size);
+    printf("sampled by %s\n", timer);
+    if (samples == 0)
+        return 0;
+
+    qsort(_symbols, _symbol_count, sizeof(symbol_t), prof_samples_compare);
+
+    for (int i = 0; i < _symbol_count && _symbols[i].samples > 0; ++i)
+        printf("%8lu %6.2f%% %s\n", _symbols[i].samples, 100.0 * _symbols[i].samples / samples, _symbols[i].name);
+    if (unnamed > 0)
+        printf("%8lu %6.2f%% (before the first symbol)\n", unnamed, 100.0 * unnamed / samples);
+    if (outside > 0)
+        printf("%8lu %6.2f%% (outside the program)\n", outside, 100.0 * outside / samples);
+
+    return 0;
+}
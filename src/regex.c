@@ -0,0 +1,596 @@
+#include <string.h>
+#include "regex.h"
+
+
+#define FOLD(ch)                (((ch) >= 'A' && (ch) <= 'Z') ? (ch) + ('a' - 'A') : (ch))
+#define CLASS_HAS(bits, ch)     ((bits)[(ch) >> 3] & (1 << ((ch) & 7)))
+
+
+typedef struct re_thread_t {
+	uint8_t pc;
+	uint8_t start;
+} re_thread_t;
+
+
+/* Compiler state */
+static re_prog_t *_prog;
+static const uint8_t *_pattern;
+static uint8_t _pattern_len;
+static uint8_t _pos;
+static bool _error;
+
+/* Matcher workspace, sized by the program limit so matching never allocates */
+static re_thread_t _list_a[RE_MAX_INSTS];
+static re_thread_t _list_b[RE_MAX_INSTS];
+static uint8_t _stack[RE_MAX_INSTS * 2 + 1];
+static uint8_t _mark[RE_MAX_INSTS];
+static uint8_t _generation = 0;
+
+
+
+/** Compiler **/
+
+static uint8_t re_emit(uint8_t op, uint8_t arg, uint8_t x, uint8_t y)
+{
+	if (_prog->len == RE_MAX_INSTS)
+	{
+		_error = true;
+		return 0;
+	}
+
+	re_inst_t *inst = &_prog->insts[_prog->len];
+	inst->op = op;
+	inst->arg = arg;
+	inst->x = x;
+	inst->y = y;
+
+	return _prog->len++;
+}
+
+static void re_relocate(uint8_t *target, uint8_t pc, uint8_t at)
+{
+	// Jumps into the moved code shift with it. Jumps from before the insertion
+	// point to exactly 'at' now land on the new instruction.
+	if (*target > at || (*target == at && pc > at))
+		++*target;
+}
+
+// Inserts an instruction in front of the code starting at 'at'
+static void re_insert(uint8_t at, uint8_t op)
+{
+	if (_prog->len == RE_MAX_INSTS)
+	{
+		_error = true;
+		return;
+	}
+
+	memmove(&_prog->insts[at + 1], &_prog->insts[at], (_prog->len - at) * sizeof(re_inst_t));
+	_prog->len++;
+
+	for (uint8_t pc = 0; pc < _prog->len; ++pc)
+	{
+		re_inst_t *inst = &_prog->insts[pc];
+
+		if (pc == at)
+			continue;
+
+		if (inst->op == RE_OP_SPLIT || inst->op == RE_OP_JMP)
+			re_relocate(&inst->x, pc, at);
+		if (inst->op == RE_OP_SPLIT)
+			re_relocate(&inst->y, pc, at);
+	}
+
+	memset(&_prog->insts[at], 0, sizeof(re_inst_t));
+	_prog->insts[at].op = op;
+}
+
+static bool re_peek(uint8_t ch)
+{
+	return _pos < _pattern_len && _pattern[_pos] == ch;
+}
+
+static uint8_t re_new_class(void)
+{
+	if (_prog->class_count == RE_MAX_CLASSES)
+	{
+		_error = true;
+		return 0;
+	}
+
+	memset(_prog->classes[_prog->class_count], 0, 32);
+	return _prog->class_count++;
+}
+
+static void re_class_add(uint8_t *bits, uint8_t ch)
+{
+	bits[ch >> 3] |= 1 << (ch & 7);
+
+	if (_prog->fold_case)
+	{
+		if (ch >= 'A' && ch <= 'Z')
+			re_class_add(bits, ch + ('a' - 'A'));
+		else if (ch >= 'a' && ch <= 'z')
+			bits[(ch - ('a' - 'A')) >> 3] |= 1 << ((ch - ('a' - 'A')) & 7);
+	}
+}
+
+static void re_class_range(uint8_t *bits, uint8_t lo, uint8_t hi)
+{
+	for (uint16_t ch = lo; ch <= hi; ++ch)
+		re_class_add(bits, ch);
+}
+
+// Adds the set named by \d, \w or \s. Returns false for other escapes.
+static bool re_escape_class(uint8_t *bits, uint8_t ch)
+{
+	switch (ch)
+	{
+		case 'd':
+			re_class_range(bits, '0', '9');
+			return true;
+
+		case 'w':
+			re_class_range(bits, 'a', 'z');
+			re_class_range(bits, 'A', 'Z');
+			re_class_range(bits, '0', '9');
+			re_class_add(bits, '_');
+			return true;
+
+		case 's':
+			re_class_add(bits, ' ');
+			re_class_add(bits, '\t');
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static uint8_t re_escape_char(uint8_t ch)
+{
+	return ch == 't' ? '\t' : ch;
+}
+
+static void re_parse_class(void)
+{
+	uint8_t index = re_new_class();
+	uint8_t *bits = _prog->classes[index];
+	bool negate = false;
+	bool first = true;
+
+	if (re_peek('^'))
+	{
+		negate = true;
+		++_pos;
+	}
+
+	// A ']' right after the opening bracket is a literal
+	while (_pos < _pattern_len && (first || _pattern[_pos] != ']'))
+	{
+		uint8_t lo = _pattern[_pos++];
+		uint8_t hi;
+
+		first = false;
+
+		if (lo == '\\' && _pos < _pattern_len)
+		{
+			uint8_t esc = _pattern[_pos++];
+			if (re_escape_class(bits, esc))
+				continue;
+
+			lo = re_escape_char(esc);
+		}
+
+		hi = lo;
+		if (_pos + 1 < _pattern_len && _pattern[_pos] == '-' && _pattern[_pos + 1] != ']')
+		{
+			hi = _pattern[_pos + 1];
+			_pos += 2;
+
+			if (hi == '\\' && _pos < _pattern_len)
+				hi = re_escape_char(_pattern[_pos++]);
+		}
+
+		re_class_range(bits, lo, hi);
+	}
+
+	if (_pos >= _pattern_len)
+	{
+		_error = true;
+		return;
+	}
+
+	++_pos;
+
+	if (negate)
+	{
+		for (uint8_t i = 0; i < 32; ++i)
+			bits[i] = ~bits[i];
+	}
+
+	re_emit(RE_OP_CLASS, index, 0, 0);
+}
+
+static void re_parse_alt(void);
+
+// Returns false when there is no atom at the current position
+static bool re_parse_atom(void)
+{
+	uint8_t ch = _pattern[_pos];
+
+	switch (ch)
+	{
+		case '|':
+		case ')':
+			return false;
+
+		case '*':
+		case '+':
+		case '?':
+			_error = true;
+			return false;
+
+		default:
+			break;
+	}
+
+	++_pos;
+
+	switch (ch)
+	{
+		case '.':
+			re_emit(RE_OP_ANY, 0, 0, 0);
+			break;
+
+		case '^':
+			re_emit(RE_OP_BOL, 0, 0, 0);
+			break;
+
+		case '$':
+			re_emit(RE_OP_EOL, 0, 0, 0);
+			break;
+
+		case '[':
+			re_parse_class();
+			break;
+
+		case '(':
+			re_parse_alt();
+			if (re_peek(')'))
+				++_pos;
+			else
+				_error = true;
+			break;
+
+		case '\\':
+			if (_pos >= _pattern_len)
+			{
+				_error = true;
+				break;
+			}
+
+			ch = _pattern[_pos++];
+			if (ch == 'd' || ch == 'w' || ch == 's')
+			{
+				uint8_t index = re_new_class();
+				re_escape_class(_prog->classes[index], ch);
+				re_emit(RE_OP_CLASS, index, 0, 0);
+			}
+			else
+			{
+				ch = re_escape_char(ch);
+				re_emit(RE_OP_CHAR, _prog->fold_case ? FOLD(ch) : ch, 0, 0);
+			}
+			break;
+
+		default:
+			re_emit(RE_OP_CHAR, _prog->fold_case ? FOLD(ch) : ch, 0, 0);
+			break;
+	}
+
+	return true;
+}
+
+static void re_parse_concat(void)
+{
+	while (_pos < _pattern_len && !_error)
+	{
+		uint8_t start = _prog->len;
+
+		if (!re_parse_atom())
+			break;
+
+		while (_pos < _pattern_len && !_error)
+		{
+			uint8_t ch = _pattern[_pos];
+
+			if (ch == '*')
+			{
+				// L1: split L2, L3  L2: e  jmp L1  L3:
+				re_insert(start, RE_OP_SPLIT);
+				re_emit(RE_OP_JMP, 0, start, 0);
+				_prog->insts[start].x = start + 1;
+				_prog->insts[start].y = _prog->len;
+			}
+			else if (ch == '+')
+			{
+				// L1: e  split L1, L3  L3:
+				uint8_t split = _prog->len;
+				re_emit(RE_OP_SPLIT, 0, start, split + 1);
+			}
+			else if (ch == '?')
+			{
+				// split L1, L2  L1: e  L2:
+				re_insert(start, RE_OP_SPLIT);
+				_prog->insts[start].x = start + 1;
+				_prog->insts[start].y = _prog->len;
+			}
+			else
+			{
+				break;
+			}
+
+			++_pos;
+		}
+	}
+}
+
+static void re_parse_alt(void)
+{
+	uint8_t start = _prog->len;
+
+	re_parse_concat();
+
+	while (re_peek('|') && !_error)
+	{
+		++_pos;
+
+		// split L1, L2  L1: a  jmp L3  L2: b  L3:
+		re_insert(start, RE_OP_SPLIT);
+		uint8_t jmp = re_emit(RE_OP_JMP, 0, 0, 0);
+		_prog->insts[start].x = start + 1;
+		_prog->insts[start].y = jmp + 1;
+
+		re_parse_concat();
+		_prog->insts[jmp].x = _prog->len;
+	}
+}
+
+
+/** Matcher **/
+
+static void re_next_generation(void)
+{
+	if (++_generation == 0)
+	{
+		memset(_mark, 0, sizeof(_mark));
+		_generation = 1;
+	}
+}
+
+// Collects the bytes that can begin a match so the matcher can skip ahead
+static void re_compute_first(re_prog_t *prog)
+{
+	uint16_t sp = 0;
+
+	memset(prog->first, 0, sizeof(prog->first));
+	prog->any_first = false;
+
+	re_next_generation();
+	_stack[sp++] = 0;
+
+	while (sp > 0)
+	{
+		uint8_t pc = _stack[--sp];
+		const re_inst_t *inst = &prog->insts[pc];
+
+		if (_mark[pc] == _generation)
+			continue;
+		_mark[pc] = _generation;
+
+		switch (inst->op)
+		{
+			case RE_OP_CHAR:
+				prog->first[inst->arg >> 3] |= 1 << (inst->arg & 7);
+				if (prog->fold_case && inst->arg >= 'a' && inst->arg <= 'z')
+				{
+					uint8_t upper = inst->arg - ('a' - 'A');
+					prog->first[upper >> 3] |= 1 << (upper & 7);
+				}
+				break;
+
+			case RE_OP_CLASS:
+				for (uint8_t i = 0; i < 32; ++i)
+					prog->first[i] |= prog->classes[inst->arg][i];
+				break;
+
+			case RE_OP_BOL:
+				_stack[sp++] = pc + 1;
+				break;
+
+			case RE_OP_SPLIT:
+				_stack[sp++] = inst->y;
+				_stack[sp++] = inst->x;
+				break;
+
+			case RE_OP_JMP:
+				_stack[sp++] = inst->x;
+				break;
+
+			default:
+				prog->any_first = true;
+				return;
+		}
+	}
+}
+
+// Adds a thread and everything reachable from it without consuming input.
+// Threads are appended in priority order, which gives leftmost-first matching.
+static void re_add_thread(const re_prog_t *prog, re_thread_t *list, uint8_t *count, uint8_t pc, uint8_t start, uint16_t pos, uint8_t len)
+{
+	uint16_t sp = 0;
+
+	_stack[sp++] = pc;
+
+	while (sp > 0)
+	{
+		pc = _stack[--sp];
+
+		if (_mark[pc] == _generation)
+			continue;
+		_mark[pc] = _generation;
+
+		const re_inst_t *inst = &prog->insts[pc];
+		switch (inst->op)
+		{
+			case RE_OP_JMP:
+				_stack[sp++] = inst->x;
+				break;
+
+			case RE_OP_SPLIT:
+				_stack[sp++] = inst->y;
+				_stack[sp++] = inst->x;
+				break;
+
+			case RE_OP_BOL:
+				if (pos == 0)
+					_stack[sp++] = pc + 1;
+				break;
+
+			case RE_OP_EOL:
+				if (pos == len)
+					_stack[sp++] = pc + 1;
+				break;
+
+			default:
+				list[*count].pc = pc;
+				list[*count].start = start;
+				++*count;
+				break;
+		}
+	}
+}
+
+bool re_compile(re_prog_t *prog, const uint8_t *pattern, uint8_t len, bool fold_case)
+{
+	prog->len = 0;
+	prog->class_count = 0;
+	prog->fold_case = fold_case;
+
+	_prog = prog;
+	_pattern = pattern;
+	_pattern_len = len;
+	_pos = 0;
+	_error = false;
+
+	re_parse_alt();
+
+	// Anything left over is an unbalanced ')'
+	if (_pos < _pattern_len)
+		_error = true;
+
+	re_emit(RE_OP_MATCH, 0, 0, 0);
+
+	if (_error)
+		return false;
+
+	re_compute_first(prog);
+	return true;
+}
+
+int16_t re_search(const re_prog_t *prog, const uint8_t *text, uint8_t len, uint8_t start, uint8_t *match_len)
+{
+	re_thread_t *clist = _list_a;
+	re_thread_t *nlist = _list_b;
+	uint8_t ccount = 0;
+	int16_t match_start = -1;
+	uint8_t match_end = 0;
+	uint16_t pos = start;
+
+	re_next_generation();
+
+	while (pos <= len)
+	{
+		if (match_start < 0)
+		{
+			if (ccount == 0 && !prog->any_first)
+			{
+				uint16_t skip = pos;
+
+				while (skip < len && !CLASS_HAS(prog->first, text[skip]))
+					++skip;
+
+				if (skip >= len)
+					break;
+
+				if (skip != pos)
+				{
+					pos = skip;
+					re_next_generation();
+				}
+			}
+
+			re_add_thread(prog, clist, &ccount, 0, pos, pos, len);
+		}
+
+		// With no match yet, a start failing an assertion such as $ only means
+		// the next position is tried
+		if (ccount == 0 && match_start >= 0)
+			break;
+
+		uint8_t ch = pos < len ? text[pos] : 0;
+		uint8_t folded = prog->fold_case ? FOLD(ch) : ch;
+		uint8_t ncount = 0;
+
+		re_next_generation();
+
+		for (uint8_t i = 0; i < ccount; ++i)
+		{
+			const re_thread_t *thread = &clist[i];
+			const re_inst_t *inst = &prog->insts[thread->pc];
+			bool step = false;
+
+			switch (inst->op)
+			{
+				case RE_OP_MATCH:
+					match_start = thread->start;
+					match_end = pos;
+					break;
+
+				case RE_OP_CHAR:
+					step = pos < len && folded == inst->arg;
+					break;
+
+				case RE_OP_ANY:
+					step = pos < len;
+					break;
+
+				case RE_OP_CLASS:
+					step = pos < len && CLASS_HAS(prog->classes[inst->arg], ch);
+					break;
+
+				default:
+					break;
+			}
+
+			// Lower priority threads cannot beat a match that was just found
+			if (inst->op == RE_OP_MATCH)
+				break;
+
+			if (step)
+				re_add_thread(prog, nlist, &ncount, thread->pc + 1, thread->start, pos + 1, len);
+		}
+
+		re_thread_t *swap = clist;
+		clist = nlist;
+		nlist = swap;
+		ccount = ncount;
+
+		++pos;
+	}
+
+	if (match_start >= 0)
+		*match_len = match_end - match_start;
+
+	return match_start;
+}
@@ -0,0 +1,57 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define RE_MAX_INSTS            128
+#define RE_MAX_CLASSES          16
+
+#define RE_OP_CHAR              0
+#define RE_OP_ANY               1
+#define RE_OP_CLASS             2
+#define RE_OP_BOL               3
+#define RE_OP_EOL               4
+#define RE_OP_SPLIT             5
+#define RE_OP_JMP               6
+#define RE_OP_MATCH             7
+
+
+typedef struct re_inst_t {
+	uint8_t op;
+	uint8_t arg;                /* Character or class index */
+	uint8_t x;                  /* Jump target, preferred branch of a split */
+	uint8_t y;                  /* Second branch of a split */
+} re_inst_t;
+
+/*
+ * A compiled expression. The size is fixed so a program can live in static
+ * storage, and matching uses a fixed workspace inside regex.c.
+ */
+typedef struct re_prog_t {
+	re_inst_t insts[RE_MAX_INSTS];
+	uint8_t classes[RE_MAX_CLASSES][32];
+	uint8_t first[32];          /* Bytes that can start a match */
+	uint8_t len;
+	uint8_t class_count;
+	bool fold_case;
+	bool any_first;             /* A match can start with any byte, or be empty */
+} re_prog_t;
+
+
+/*
+ * Compiles a pattern. Supports . [] [^] * + ? | () ^ $ and the escapes
+ * \d \w \s \t plus escaped metacharacters.
+ *
+ * Returns false if the pattern is malformed or too large.
+ */
+bool re_compile(re_prog_t *prog, const uint8_t *pattern, uint8_t len, bool fold_case);
+
+/*
+ * Finds the leftmost match in text[start..len). Returns the match offset and
+ * stores its length in match_len, or returns -1 if there is no match.
+ */
+int16_t re_search(const re_prog_t *prog, const uint8_t *text, uint8_t len, uint8_t start, uint8_t *match_len);
+
+#endif
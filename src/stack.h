@@ -0,0 +1,19 @@
+#ifndef STACK_H
+#define STACK_H
+
+
+/*
+ * How deep the stack has been. startup.s fills the 1 Kb stack below ___STACK
+ * with a canary before anything runs, and the words still holding it are
+ * what was never reached. When none are left it overflowed into the heap.
+ *
+ * foenix/stack.c reads the stack on the machine. host/stack.c paints an
+ * area of the workstation's stack the same way, which is deeper per call.
+ */
+
+#define STACK_CANARY            0xA5A5A5A5
+
+unsigned long stack_used(void);
+unsigned long stack_size(void);
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "syscalls.h"
+
+#ifdef FTE_SYSTRACE
+
+// The wrappers call the kernel, so they are declared without the renaming
+#define SYSTRACE_RAW
+#include "systrace.h"
+
+
+typedef struct systrace_t {
+	const char *name;
+	uint32_t calls;
+	uint32_t bytes;				// moved over a channel
+	uint32_t jiffies;			// from before the call to after it
+} systrace_t;
+
+static systrace_t _calls[SYSTRACE_KFN_COUNT];
+static bool _started = false;
+static bool _written = false;
+
+
+static void systrace_write(void)
+{
+	char line[64];
+
+	if (_written)
+		return;
+	_written = true;
+
+	short file_chan = sys_fsys_open("fte.sys", FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+	if (file_chan <= 0)
+		return;
+
+	snprintf(line, sizeof(line), "# kfn calls bytes jiffies name\n");
+	sys_chan_write(file_chan, (unsigned char *)line, strlen(line));
+
+	for (uint8_t i = 0; i < SYSTRACE_KFN_COUNT; ++i)
+	{
+		if (_calls[i].calls == 0)
+			continue;
+
+		snprintf(line, sizeof(line), "%02X %lu %lu %lu %s\n", i, (unsigned long)_calls[i].calls, (unsigned long)_calls[i].bytes, (unsigned long)_calls[i].jiffies, _calls[i].name);
+		sys_chan_write(file_chan, (unsigned char *)line, strlen(line));
+	}
+
+	sys_fsys_close(file_chan);
+}
+
+// The summary is written by systrace_exit(), and also when the program ends
+// through exit(), as the hosted build does when its keys run out
+static long systrace_begin(void)
+{
+	if (!_started)
+	{
+		_started = true;
+		atexit(systrace_write);
+	}
+
+	return sys_time_jiffies();
+}
+
+static void systrace_end(uint8_t function, const char *name, long start, long bytes)
+{
+	systrace_t *call = &_calls[function & (SYSTRACE_KFN_COUNT - 1)];
+
+	call->name = name;
+	call->calls++;
+	call->jiffies += sys_time_jiffies() - start;
+	if (bytes > 0)
+		call->bytes += bytes;
+}
+
+short systrace_chan_ioctrl(short channel, short command, uint8_t * buffer, short size)
+{
+	long start = systrace_begin();
+	short result = sys_chan_ioctrl(channel, command, buffer, size);
+	systrace_end(KFN_CHAN_IOCTRL, "chan_ioctrl", start, 0);
+	return result;
+}
+
+short systrace_chan_read(short channel, unsigned char * buffer, short size)
+{
+	long start = systrace_begin();
+	short result = sys_chan_read(channel, buffer, size);
+	systrace_end(KFN_CHAN_READ, "chan_read", start, result);
+	return result;
+}
+
+short systrace_chan_read_b(short channel)
+{
+	long start = systrace_begin();
+	short result = sys_chan_read_b(channel);
+	systrace_end(KFN_CHAN_READ_B, "chan_read_b", start, result >= 0 ? 1 : 0);
+	return result;
+}
+
+short systrace_chan_seek(short channel, long position, short base)
+{
+	long start = systrace_begin();
+	short result = sys_chan_seek(channel, position, base);
+	systrace_end(KFN_CHAN_SEEK, "chan_seek", start, 0);
+	return result;
+}
+
+short systrace_chan_status(short channel)
+{
+	long start = systrace_begin();
+	short result = sys_chan_status(channel);
+	systrace_end(KFN_CHAN_STATUS, "chan_status", start, 0);
+	return result;
+}
+
+short systrace_chan_write(short channel, unsigned char * buffer, short size)
+{
+	long start = systrace_begin();
+	short result = sys_chan_write(channel, buffer, size);
+	systrace_end(KFN_CHAN_WRITE, "chan_write", start, result);
+	return result;
+}
+
+short systrace_chan_write_b(short channel, unsigned char b)
+{
+	long start = systrace_begin();
+	short result = sys_chan_write_b(channel, b);
+	systrace_end(KFN_CHAN_WRITE_B, "chan_write_b", start, 1);
+	return result;
+}
+
+void systrace_exit(short result)
+{
+	long start = systrace_begin();
+	systrace_end(KFN_EXIT, "exit", start, 0);
+	systrace_write();
+	sys_exit(result);
+}
+
+short systrace_fsys_close(short fd)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_close(fd);
+	systrace_end(KFN_CLOSE, "fsys_close", start, 0);
+	return result;
+}
+
+short systrace_fsys_closedir(short dir)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_closedir(dir);
+	systrace_end(KFN_CLOSEDIR, "fsys_closedir", start, 0);
+	return result;
+}
+
+short systrace_fsys_delete(const char * path)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_delete(path);
+	systrace_end(KFN_DELETE, "fsys_delete", start, 0);
+	return result;
+}
+
+short systrace_fsys_findfirst(const char * path, const char * pattern, p_file_info file)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_findfirst(path, pattern, file);
+	systrace_end(KFN_FINDFIRST, "fsys_findfirst", start, 0);
+	return result;
+}
+
+short systrace_fsys_load(const char * path, long destination, long * start_address)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_load(path, destination, start_address);
+	systrace_end(KFN_LOAD, "fsys_load", start, 0);
+	return result;
+}
+
+short systrace_fsys_open(const char * path, short mode)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_open(path, mode);
+	systrace_end(KFN_OPEN, "fsys_open", start, 0);
+	return result;
+}
+
+short systrace_fsys_rename(const char * old_path, const char * new_path)
+{
+	long start = systrace_begin();
+	short result = sys_fsys_rename(old_path, new_path);
+	systrace_end(KFN_RENAME, "fsys_rename", start, 0);
+	return result;
+}
+
+void systrace_get_info(p_sys_info info)
+{
+	long start = systrace_begin();
+	sys_get_info(info);
+	systrace_end(KFN_SYS_GET_INFO, "get_info", start, 0);
+}
+
+// Timing the clock with itself would only double the calls, so it is counted
+long systrace_time_jiffies(void)
+{
+	long now = sys_time_jiffies();
+	systrace_t *call = &_calls[KFN_TIME_JIFFIES];
+
+	call->name = "time_jiffies";
+	call->calls++;
+	return now;
+}
+
+#endif
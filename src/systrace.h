@@ -0,0 +1,62 @@
+#ifndef SYSTRACE_H
+#define SYSTRACE_H
+
+#include "syscalls.h"
+
+
+/*
+ * Kernel call tracing, built with SYSTRACE=1 (FTE_SYSTRACE). Included after
+ * syscalls.h, it sends the sys_* calls the editor makes through systrace.c,
+ * which counts them by KFN number with the bytes moved over channels and the
+ * jiffies spent in them. The totals are written to fte.sys when the editor
+ * exits, one line per function. perf.c and prof.c call the kernel directly
+ * so writing their own files does not show up. Without FTE_SYSTRACE this
+ * does nothing.
+ */
+
+#define SYSTRACE_KFN_COUNT      0x80
+
+
+#ifdef FTE_SYSTRACE
+
+short systrace_chan_ioctrl(short channel, short command, uint8_t * buffer, short size);
+short systrace_chan_read(short channel, unsigned char * buffer, short size);
+short systrace_chan_read_b(short channel);
+short systrace_chan_seek(short channel, long position, short base);
+short systrace_chan_status(short channel);
+short systrace_chan_write(short channel, unsigned char * buffer, short size);
+short systrace_chan_write_b(short channel, unsigned char b);
+void systrace_exit(short result);
+short systrace_fsys_close(short fd);
+short systrace_fsys_closedir(short dir);
+short systrace_fsys_delete(const char * path);
+short systrace_fsys_findfirst(const char * path, const char * pattern, p_file_info file);
+short systrace_fsys_load(const char * path, long destination, long * start);
+short systrace_fsys_open(const char * path, short mode);
+short systrace_fsys_rename(const char * old_path, const char * new_path);
+void systrace_get_info(p_sys_info info);
+long systrace_time_jiffies(void);
+
+#ifndef SYSTRACE_RAW
+#define sys_chan_ioctrl         systrace_chan_ioctrl
+#define sys_chan_read           systrace_chan_read
+#define sys_chan_read_b         systrace_chan_read_b
+#define sys_chan_seek           systrace_chan_seek
+#define sys_chan_status         systrace_chan_status
+#define sys_chan_write          systrace_chan_write
+#define sys_chan_write_b        systrace_chan_write_b
+#define sys_exit                systrace_exit
+#define sys_fsys_close          systrace_fsys_close
+#define sys_fsys_closedir       systrace_fsys_closedir
+#define sys_fsys_delete         systrace_fsys_delete
+#define sys_fsys_findfirst      systrace_fsys_findfirst
+#define sys_fsys_load           systrace_fsys_load
+#define sys_fsys_open           systrace_fsys_open
+#define sys_fsys_rename         systrace_fsys_rename
+#define sys_get_info            systrace_get_info
+#define sys_time_jiffies        systrace_time_jiffies
+#endif
+
+#endif
+
+#endif
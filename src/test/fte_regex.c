@@ -0,0 +1,273 @@
+/*
+ * Tests the regex engine in regex.c on the host, and measures it against the
+ * POSIX engine of the C library.
+ *
+ *     fte_regex                  runs the tests, the exit status is the result
+ *     fte_regex -b [lines]       prints the throughput of both engines as JSON
+ *
+ * The tests are a table of patterns with the match expected, followed by
+ * random patterns and lines checked against regexec(). regex.c matches
+ * leftmost-first and POSIX leftmost-longest, so only where the match starts
+ * is compared for those. Both agree on that, as both take the leftmost
+ * position any match can start at.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <regex.h>
+
+#include "regex.h"
+
+#define REGEX_FUZZ_RUNS         20000
+#define REGEX_BENCH_LINES       20000
+
+
+typedef struct regex_case_t {
+    const char *pattern;
+    const char *text;
+    int start;
+    int offset;                 /* -1 if it does not match */
+    int len;
+} regex_case_t;
+
+static const regex_case_t _cases[] = {
+    { "abc",            "xxabcxx",      0,  2, 3 },
+    { "abc",            "xxabcxx",      3, -1, 0 },
+    { "a.c",            "abc",          0,  0, 3 },
+    { "a*",             "bbb",          0,  0, 0 },
+    { "a+",             "baaab",        0,  1, 3 },
+    { "ab?c",           "ac abc",       0,  0, 2 },
+    { "ab?c",           "ac abc",       1,  3, 3 },
+    { "cat|dog",        "hotdog",       0,  3, 3 },
+    { "(ab)+",          "xababab",      0,  1, 6 },
+    { "[a-c]+",         "xxbcaz",       0,  2, 3 },
+    { "[^a-c]+",        "abxyc",        0,  2, 2 },
+    { "\\d+",           "ab 123 c",     0,  3, 3 },
+    { "\\w+",           "  foo_1 ",     0,  2, 5 },
+    { "\\s",            "ab\tc",        0,  2, 1 },
+    { "a\\.b",          "axb a.b",      0,  4, 3 },
+    { "^abc",           "abcabc",       0,  0, 3 },
+    { "^abc",           "abcabc",       1, -1, 0 },
+    { "^",              "abc",          0,  0, 0 },
+    { "$",              "abc",          0,  3, 0 },
+    { "$",              "",             0,  0, 0 },
+    { "c$",             "cbc",          0,  2, 1 },
+    { "b*$",            "abb",          0,  1, 2 },
+    { "(^[a-c])*$",     "abc",          0,  3, 0 },
+    { "x|$",            "abc",          0,  3, 0 },
+    { "^$",             "",             0,  0, 0 },
+    { "^$",             "a",            0, -1, 0 },
+    { "a|ab",           "ab",           0,  0, 1 },
+    { "ab|a",           "ab",           0,  0, 2 },
+};
+
+static uint32_t _seed = 1;
+
+
+static uint32_t regex_random(void)
+{
+    _seed = _seed * 1103515245u + 12345u;
+    return (_seed >> 16) & 0x7FFF;
+}
+
+static int regex_check(const regex_case_t *test)
+{
+    re_prog_t prog;
+    uint8_t len = 0;
+    int16_t offset;
+
+    if (!re_compile(&prog, (const uint8_t *)test->pattern, strlen(test->pattern), false))
+    {
+        printf("FAIL /%s/ does not compile\n", test->pattern);
+        return 1;
+    }
+
+    offset = re_search(&prog, (const uint8_t *)test->text, strlen(test->text), test->start, &len);
+    if (offset != test->offset || (offset >= 0 && len != test->len))
+    {
+        printf("FAIL /%s/ in \"%s\" from %d: %d,%d, expected %d,%d\n", test->pattern, test->text, test->start,
+               offset, offset >= 0 ? len : 0, test->offset, test->len);
+        return 1;
+    }
+
+    return 0;
+}
+
+// A pattern of the parts both engines read the same way
+static void regex_random_pattern(char *out, int size)
+{
+    static const char *atoms[] = { "a", "b", "c", ".", "[ab]", "[^a]", "(a|b)", "(ab)", "(a|bc)" };
+    static const char *counts[] = { "", "", "", "*", "+", "?" };
+    int len = 0;
+    int atoms_wanted = 1 + regex_random() % 4;
+
+    if (regex_random() % 4 == 0)
+        out[len++] = '^';
+
+    for (int i = 0; i < atoms_wanted; ++i)
+        len += snprintf(out + len, size - len, "%s%s", atoms[regex_random() % 9], counts[regex_random() % 6]);
+
+    if (regex_random() % 4 == 0 && len < size - 1)
+        out[len++] = '$';
+
+    out[len] = 0;
+}
+
+// Where both engines find the first match of random patterns in random lines
+static int regex_fuzz(int runs)
+{
+    int failed = 0;
+
+    for (int run = 0; run < runs && failed < 10; ++run)
+    {
+        char pattern[64];
+        char text[32];
+        int text_len = regex_random() % sizeof(text);
+        bool fold = regex_random() % 4 == 0;
+        re_prog_t prog;
+        regex_t ref;
+        regmatch_t ref_match;
+        uint8_t len;
+
+        regex_random_pattern(pattern, sizeof(pattern));
+        for (int i = 0; i < text_len; ++i)
+            text[i] = "abcAB"[regex_random() % (fold ? 5 : 3)];
+        text[text_len] = 0;
+
+        if (regcomp(&ref, pattern, REG_EXTENDED | (fold ? REG_ICASE : 0)) != 0)
+            continue;
+
+        if (!re_compile(&prog, (const uint8_t *)pattern, strlen(pattern), fold))
+        {
+            printf("FAIL /%s/ does not compile\n", pattern);
+            regfree(&ref);
+            ++failed;
+            continue;
+        }
+
+        int expected = regexec(&ref, text, 1, &ref_match, 0) == 0 ? ref_match.rm_so : -1;
+        int offset = re_search(&prog, (const uint8_t *)text, text_len, 0, &len);
+
+        if (offset != expected)
+        {
+            printf("FAIL /%s/%s in \"%s\": %d, regexec %d\n", pattern, fold ? "i" : "", text, offset, expected);
+            ++failed;
+        }
+
+        regfree(&ref);
+    }
+
+    return failed;
+}
+
+static uint64_t regex_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Times finding every match in every line with both engines, lines as
+// host/bench.sh writes them
+static void regex_bench(int lines)
+{
+    static const char *patterns[] = { "lazy dog", "[0-9]+ the", "fox|cat", "o.*dog$", "^ *1" };
+    static const int pattern_count = sizeof(patterns) / sizeof(patterns[0]);
+    char (*text)[80] = malloc((size_t)lines * sizeof(*text));
+    unsigned long bytes = 0;
+
+    for (int i = 0; i < lines; ++i)
+    {
+        char line[80];
+        snprintf(line, sizeof(line), "%5d the quick brown fox jumps over the lazy dog", i);
+        line[20 + (i * 7) % 51] = 0;
+        strcpy(text[i], line);
+        bytes += strlen(line);
+    }
+
+    printf("[\n");
+
+    for (int p = 0; p < pattern_count; ++p)
+    {
+        re_prog_t prog;
+        regex_t ref;
+        regmatch_t ref_match;
+        unsigned long matches = 0, ref_matches = 0;
+        uint64_t start;
+
+        re_compile(&prog, (const uint8_t *)patterns[p], strlen(patterns[p]), false);
+        regcomp(&ref, patterns[p], REG_EXTENDED);
+
+        start = regex_now();
+        for (int i = 0; i < lines; ++i)
+        {
+            uint8_t len = strlen(text[i]);
+            uint8_t match_len;
+            uint16_t pos = 0;
+            int16_t found;
+
+            while (pos <= len && (found = re_search(&prog, (const uint8_t *)text[i], len, pos, &match_len)) >= 0)
+            {
+                ++matches;
+                pos = found + (match_len > 0 ? match_len : 1);
+            }
+        }
+        uint64_t spent = regex_now() - start;
+
+        start = regex_now();
+        for (int i = 0; i < lines; ++i)
+        {
+            int len = strlen(text[i]);
+            int pos = 0;
+
+            while (pos <= len && regexec(&ref, text[i] + pos, 1, &ref_match, pos > 0 ? REG_NOTBOL : 0) == 0)
+            {
+                int found = pos + ref_match.rm_so;
+                int match_len = ref_match.rm_eo - ref_match.rm_so;
+
+                ++ref_matches;
+                pos = found + (match_len > 0 ? match_len : 1);
+            }
+        }
+        uint64_t ref_spent = regex_now() - start;
+
+        printf("%s{\"trace\": \"regex %s\", \"bytes\": %lu, \"matches\": %lu, \"mb_per_s\": %.2f, "
+               "\"ref_matches\": %lu, \"ref_mb_per_s\": %.2f}\n", p > 0 ? "," : "", patterns[p], bytes,
+               matches, bytes / 1e6 / (spent / 1e9), ref_matches, bytes / 1e6 / (ref_spent / 1e9));
+
+        regfree(&ref);
+    }
+
+    printf("]\n");
+    free(text);
+}
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+    int cases = sizeof(_cases) / sizeof(_cases[0]);
+
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0)
+    {
+        regex_bench(argc == 3 ? atoi(argv[2]) : REGEX_BENCH_LINES);
+        return 0;
+    }
+
+    if (argc != 1)
+    {
+        fprintf(stderr, "usage: fte_regex [-b [lines]]\n");
+        return 2;
+    }
+
+    for (int i = 0; i < cases; ++i)
+        failed += regex_check(&_cases[i]);
+
+    failed += regex_fuzz(REGEX_FUZZ_RUNS);
+
+    printf("%d cases, %d random patterns, %d failed\n", cases, REGEX_FUZZ_RUNS, failed);
+    return failed > 0 ? 1 : 0;
+}
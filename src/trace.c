@@ -0,0 +1,146 @@
+#include <string.h>
+#include "trace.h"
+
+#ifdef FTE_TRACE
+
+#include "syscalls.h"
+#include "systrace.h"
+
+
+#define TRACE_CHUNK             32      /* Events written to the file per call */
+
+
+typedef struct trace_event_t {
+	uint32_t time;
+	uint8_t type;
+	uint8_t data;
+	uint16_t value;
+} trace_event_t;
+
+
+static trace_event_t _events[TRACE_EVENTS];
+static uint16_t _next = 0;
+static bool _wrapped = false;
+
+// Jiffies at the last key or paint. Allocations are stamped with it rather
+// than each asking the kernel for the time.
+static uint32_t _now = 0;
+static uint32_t _key_time = 0;
+
+
+static trace_event_t *trace_add(uint8_t type, uint8_t data, uint16_t value)
+{
+	trace_event_t *event = &_events[_next];
+
+	// What is allocated before the first key is stamped with the startup time
+	if (_now == 0)
+		_now = sys_time_jiffies();
+
+	event->time = _now;
+	event->type = type;
+	event->data = data;
+	event->value = value;
+
+	if (++_next == TRACE_EVENTS)
+	{
+		_next = 0;
+		_wrapped = true;
+	}
+
+	return event;
+}
+
+static trace_event_t *trace_last(void)
+{
+	if (_next == 0 && !_wrapped)
+		return 0;
+
+	return &_events[_next == 0 ? TRACE_EVENTS - 1 : _next - 1];
+}
+
+static uint8_t *trace_put(uint8_t *out, uint32_t value, uint8_t bytes)
+{
+	while (bytes-- > 0)
+		*out++ = value >> (bytes * 8);
+	return out;
+}
+
+void trace_key(uint8_t key)
+{
+	_now = _key_time = sys_time_jiffies();
+	trace_add(TRACE_KEY, key, 0);
+}
+
+void trace_command(uint8_t key, uint16_t table)
+{
+	trace_add(TRACE_COMMAND, key, table);
+}
+
+void trace_paint(void)
+{
+	_now = sys_time_jiffies();
+	trace_add(TRACE_PAINT, 0, _now - _key_time > 0xFFFF ? 0xFFFF : _now - _key_time);
+}
+
+// A run of allocations between two keys or paints, such as loading a file,
+// is merged into as few events as fit so it does not push everything else out
+void trace_alloc(unsigned long size)
+{
+	trace_event_t *last = trace_last();
+	uint32_t words = size / 4;
+
+	if (last != 0 && last->type == TRACE_ALLOC && last->data < 0xFF && last->value + words <= 0xFFFF)
+	{
+		last->data++;
+		last->value += words;
+		return;
+	}
+
+	trace_add(TRACE_ALLOC, 1, words > 0xFFFF ? 0xFFFF : words);
+}
+
+bool trace_dump(const char *path)
+{
+	static uint8_t buffer[TRACE_CHUNK * 8];
+	uint16_t count = _wrapped ? TRACE_EVENTS : _next;
+	uint16_t index = _wrapped ? _next : 0;
+	uint8_t *out = buffer;
+
+	short file_chan = sys_fsys_open(path, FILE_MODE_CREATE_ALWAYS | FILE_MODE_WRITE);
+	if (file_chan <= 0)
+		return false;
+
+	memcpy(out, "FTET", 4);
+	out += 4;
+	*out++ = TRACE_VERSION;
+	*out++ = _wrapped ? TRACE_FLAG_WRAPPED : 0;
+	out = trace_put(out, count, 2);
+	sys_chan_write(file_chan, buffer, out - buffer);
+
+	for (uint16_t i = 0; i < count; i += TRACE_CHUNK)
+	{
+		out = buffer;
+
+		for (uint16_t j = i; j < count && j < i + TRACE_CHUNK; ++j)
+		{
+			trace_event_t *event = &_events[index];
+
+			out = trace_put(out, event->time, 4);
+			*out++ = event->type;
+			*out++ = event->data;
+			out = trace_put(out, event->value, 2);
+
+			if (++index == TRACE_EVENTS)
+				index = 0;
+		}
+
+		sys_chan_write(file_chan, buffer, out - buffer);
+	}
+
+	sys_fsys_close(file_chan);
+
+	trace_add(TRACE_DUMP, 0, 0);
+	return true;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * A record of the last events of the session, built with TRACE=1 (FTE_TRACE).
+ * It is kept in a ring in RAM and written to a file on request so a slow
+ * session can be looked at and replayed afterwards, see trace/fte_trace.c.
+ * Without FTE_TRACE the calls are empty and the ring is not compiled in.
+ *
+ * The file starts with "FTET", a version byte, a byte of flags and the
+ * number of events as 16 bits. Each event follows, oldest first, as its
+ * jiffies in 32 bits, type, data and a 16 bit value, all big endian.
+ */
+
+#define TRACE_EVENTS            1024
+#define TRACE_VERSION           1
+#define TRACE_FLAG_WRAPPED      0x01    /* Events from the start of the session were dropped */
+
+#define TRACE_KEY               1       /* data is the key read */
+#define TRACE_COMMAND           2       /* data is the key, value the command table, TRACE_TABLE_* */
+#define TRACE_PAINT             3       /* value is the jiffies since the key */
+#define TRACE_ALLOC             4       /* data is the allocations merged, value their bytes / 4 */
+#define TRACE_DUMP              5       /* The ring was written to a file */
+
+#define TRACE_TABLE_BASIC       0
+#define TRACE_TABLE_BUFFER      1
+#define TRACE_TABLE_SEARCH      2
+#define TRACE_TABLE_NONE        0xFFFF  /* Nothing bound to the key, or not allowed */
+
+
+#ifdef FTE_TRACE
+
+void trace_key(uint8_t key);
+void trace_command(uint8_t key, uint16_t table);
+void trace_paint(void);
+void trace_alloc(unsigned long size);
+
+bool trace_dump(const char *path);
+
+#else
+
+#define trace_key(key)              ((void)0)
+#define trace_command(key, table)   ((void)0)
+#define trace_paint()               ((void)0)
+#define trace_alloc(size)           ((void)0)
+
+#endif
+
+#endif
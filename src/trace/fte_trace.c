@@ -0,0 +1,213 @@
+/*
+ * Reads the session trace F9 writes to fte.trc in a TRACE=1 build, see trace.h.
+ *
+ *     fte_trace fte.trc              lists the events, one per line
+ *     fte_trace -k fte.trc > keys    writes the keys as the keyboard delivers them
+ *     fte_trace -r fte.trc [host]    replays the keys through the hosted build
+ *
+ * The keys replay the session only from the state it started in, so the
+ * files it opened need to be at hand. If the ring wrapped, the oldest events
+ * are gone and the replay starts part way in, which is warned about.
+ * Replaying runs ./fte_host, or the build given, with FTE_KEYS pointing at a
+ * temporary file of the keys.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+
+typedef struct event_t {
+    uint32_t time;
+    uint8_t type;
+    uint8_t data;
+    uint16_t value;
+} event_t;
+
+static event_t *_events;
+static uint16_t _event_count;
+static uint8_t _flags;
+
+
+static uint32_t trace_get_be(const uint8_t *in, int bytes)
+{
+    uint32_t value = 0;
+
+    while (bytes-- > 0)
+        value = (value << 8) | *in++;
+    return value;
+}
+
+static void trace_load(const char *path)
+{
+    uint8_t header[8];
+    uint8_t raw[8];
+    FILE *file = fopen(path, "rb");
+
+    if (file == 0)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "FTET", 4) != 0)
+    {
+        fprintf(stderr, "%s: not a session trace\n", path);
+        exit(1);
+    }
+
+    if (header[4] != TRACE_VERSION)
+    {
+        fprintf(stderr, "%s: trace version %d, expected %d\n", path, header[4], TRACE_VERSION);
+        exit(1);
+    }
+
+    _flags = header[5];
+    _event_count = trace_get_be(header + 6, 2);
+    _events = calloc(_event_count, sizeof(event_t));
+
+    for (uint16_t i = 0; i < _event_count; ++i)
+    {
+        if (fread(raw, 1, sizeof(raw), file) != sizeof(raw))
+        {
+            fprintf(stderr, "%s: ends after %d of %d events\n", path, i, _event_count);
+            _event_count = i;
+            break;
+        }
+
+        _events[i].time = trace_get_be(raw, 4);
+        _events[i].type = raw[4];
+        _events[i].data = raw[5];
+        _events[i].value = trace_get_be(raw + 6, 2);
+    }
+
+    fclose(file);
+
+    if (_flags & TRACE_FLAG_WRAPPED)
+        fprintf(stderr, "%s: the trace wrapped, the start of the session is missing\n", path);
+}
+
+static const char *trace_table_name(uint16_t table)
+{
+    switch (table)
+    {
+        case TRACE_TABLE_BASIC:  return "basic";
+        case TRACE_TABLE_BUFFER: return "buffer";
+        case TRACE_TABLE_SEARCH: return "search";
+        case TRACE_TABLE_NONE:   return "none";
+        default:                 return "?";
+    }
+}
+
+static void trace_list(void)
+{
+    uint32_t keys = 0;
+    uint32_t slowest = 0;
+    uint32_t start = _event_count > 0 ? _events[0].time : 0;
+
+    for (uint16_t i = 0; i < _event_count; ++i)
+    {
+        event_t *e = &_events[i];
+
+        printf("%8u ", e->time - start);
+
+        switch (e->type)
+        {
+            case TRACE_KEY:
+                printf("key      %02X %c\n", e->data, e->data > 32 && e->data <= 126 ? e->data : ' ');
+                ++keys;
+                break;
+
+            case TRACE_COMMAND:
+                printf("command  %02X %s\n", e->data, trace_table_name(e->value));
+                break;
+
+            case TRACE_PAINT:
+                printf("paint    %u jiffies\n", e->value);
+                if (e->value > slowest)
+                    slowest = e->value;
+                break;
+
+            case TRACE_ALLOC:
+                printf("alloc    %u, %u bytes\n", e->data, e->value * 4);
+                break;
+
+            case TRACE_DUMP:
+                printf("dump\n");
+                break;
+
+            default:
+                printf("unknown  %02X %02X %04X\n", e->type, e->data, e->value);
+                break;
+        }
+    }
+
+    printf("%u events, %u keys over %u jiffies, slowest paint %u jiffies\n", _event_count, keys,
+           _event_count > 0 ? _events[_event_count - 1].time - start : 0, slowest);
+}
+
+// Escape starts a sequence, so a key of its own is read as two of them
+static void trace_write_keys(FILE *out)
+{
+    for (uint16_t i = 0; i < _event_count; ++i)
+    {
+        if (_events[i].type != TRACE_KEY)
+            continue;
+
+        if (_events[i].data == 0x1B)
+            fputc(0x1B, out);
+        fputc(_events[i].data, out);
+    }
+}
+
+static int trace_replay(const char *host)
+{
+    char path[] = "/tmp/fte_traceXXXXXX";
+    int fd = mkstemp(path);
+    FILE *out = fd < 0 ? 0 : fdopen(fd, "wb");
+    int result;
+
+    if (out == 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    trace_write_keys(out);
+    fclose(out);
+
+    setenv("FTE_KEYS", path, 1);
+    result = system(host);
+    unlink(path);
+    return result == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 2 && argv[1][0] != '-')
+    {
+        trace_load(argv[1]);
+        trace_list();
+        return 0;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "-k") == 0)
+    {
+        trace_load(argv[2]);
+        trace_write_keys(stdout);
+        return 0;
+    }
+
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "-r") == 0)
+    {
+        trace_load(argv[2]);
+        return trace_replay(argc == 4 ? argv[3] : "./fte_host");
+    }
+
+    fprintf(stderr, "usage: fte_trace [-k | -r] fte.trc [host]\n");
+    return 2;
+}